@@ -0,0 +1,87 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * measures how long mixing one voice into a period takes with the selected kernels,
+ * at typical jack period sizes. voices start at odd offsets, as they do when playing
+ */
+
+#include "audio_mix.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+
+namespace {
+
+nframes_t const PERIOD_SIZES[] = { 32, 64, 128, 256, 512, 1024, 2048 };
+std::size_t const VOICES = 16;
+// total number of frames mixed per measurement, per voice
+std::size_t const FRAMES = 1 << 24;
+
+template <typename F>
+double ns_per_voice(nframes_t nframes, F mix)
+{
+    std::vector<sample_t> buffer(nframes + 16);
+    std::vector<sample_t> chunk(FRAMES / 16 + nframes + 16);
+    for (std::size_t n = 0; n < chunk.size(); ++n) {
+        chunk[n] = static_cast<float>(std::rand()) / RAND_MAX - 0.5f;
+    }
+
+    std::size_t periods = FRAMES / nframes;
+    std::size_t pos = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (std::size_t p = 0; p < periods; ++p) {
+        for (std::size_t v = 0; v < VOICES; ++v) {
+            mix(buffer.data() + v % 3, chunk.data() + pos + v, nframes - 3);
+        }
+        pos = (pos + nframes) % (chunk.size() - nframes - 16);
+    }
+
+    std::chrono::duration<double, std::nano> t = std::chrono::steady_clock::now() - start;
+
+    // keep the compiler from dropping the work
+    volatile sample_t sink = buffer[nframes / 2];
+    (void)sink;
+
+    return t.count() / (periods * VOICES);
+}
+
+} // namespace
+
+
+int main()
+{
+    std::cout << "mixing kernels: " << audio_mix::implementation() << "\n"
+              << "period    mix (ns/voice)    mix_ramp (ns/voice)    frames/us\n";
+
+    for (nframes_t nframes : PERIOD_SIZES) {
+        double m = ns_per_voice(nframes, [](sample_t *d, sample_t const *s, nframes_t n) {
+            audio_mix::mix(d, s, n, 0.5f);
+        });
+        double r = ns_per_voice(nframes, [](sample_t *d, sample_t const *s, nframes_t n) {
+            audio_mix::mix_ramp(d, s, n, 0.5f, -0.0001f);
+        });
+
+        std::cout << std::setw(6) << nframes
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(18) << m
+                  << std::setw(23) << r
+                  << std::setw(13) << (nframes - 3) / m * 1000.0 << "\n";
+    }
+
+    return 0;
+}
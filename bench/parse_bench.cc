@@ -0,0 +1,110 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * measures how long parsing a tempomap file takes, on synthetic maps with all kinds
+ * of entries. the maps are read from stdin, so no binary cache gets in the way
+ */
+
+#include "tempomap.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+
+
+namespace {
+
+std::size_t const SIZES[] = { 10, 100, 1000, 10000, 100000, 1000000 };
+// total number of entries parsed per measurement
+std::size_t const ENTRIES = 2000000;
+
+char const * const LINES[] = {
+    "%s8 120\n",
+    "%s12 120 X.x.\n",
+    "%s4 120-140 X.x.       # accelerando\n",
+    "%s16 140\n",
+    "%s8 3/4 140 0.5\n",
+    "\n",
+    "%s8 7/8 97.3 X.xX.x. 0.8\n",
+    "# a comment\n",
+    "%s  2   140-80\n",
+};
+
+std::string make_map(std::size_t nentries)
+{
+    std::string data;
+    std::size_t entries = 0;
+    char buf[64];
+
+    for (std::size_t n = 0; entries < nentries; ++n) {
+        char const *line = LINES[std::rand() % (sizeof(LINES) / sizeof(LINES[0]))];
+        if (std::string(line).find("%s") == std::string::npos) {
+            data += line;
+            continue;
+        }
+        // every few entries gets a label
+        std::string label = n % 7 ? "" : std::string("part") + std::to_string(n) + ": ";
+        std::snprintf(buf, sizeof(buf), line, label.c_str());
+        data += buf;
+        ++entries;
+    }
+    return data;
+}
+
+double ns_per_entry(std::string const & data, std::size_t nentries)
+{
+    std::size_t reps = std::max<std::size_t>(ENTRIES / nentries, 1);
+    std::streambuf *cin_buf = std::cin.rdbuf();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (std::size_t r = 0; r < reps; ++r) {
+        std::istringstream input(data);
+        std::cin.rdbuf(input.rdbuf());
+        TempoMapPtr map = TempoMap::new_from_file("-");
+        if (map->size() != nentries) {
+            std::cerr << "parsed " << map->size() << " entries instead of " << nentries << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    std::chrono::duration<double, std::nano> t = std::chrono::steady_clock::now() - start;
+
+    std::cin.rdbuf(cin_buf);
+
+    return t.count() / (reps * nentries);
+}
+
+} // namespace
+
+
+int main()
+{
+    std::cout << " entries     size (kB)    ns/entry        MB/s\n";
+
+    for (std::size_t nentries : SIZES) {
+        std::string const data = make_map(nentries);
+        double t = ns_per_entry(data, nentries);
+
+        std::cout << std::setw(8) << nentries
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(14) << data.size() / 1024.0
+                  << std::setw(12) << t
+                  << std::setw(12) << data.size() / (t * nentries) * 1000.0 << "\n";
+    }
+
+    return 0;
+}
@@ -13,6 +13,7 @@
 #define KLICK_AUDIO_HH
 
 #include <memory>
+#include <cstdint>
 
 #include <jack/types.h>
 #include <jack/transport.h>
@@ -21,6 +22,18 @@ typedef jack_default_audio_sample_t sample_t;
 typedef jack_nframes_t nframes_t;
 typedef jack_position_t position_t;
 
+// absolute position on the timeline. unlike nframes_t, this doesn't wrap around after a day
+typedef std::uint64_t framepos_t;
+
+// the 64-bit frame for a 32-bit frame from jack. if frame is where playback was expected
+// to continue (modulo 2^32), the result continues from there as well, so positions keep
+// counting after jack's counter wraps around. anything else is a relocation, and frame
+// is taken literally
+inline framepos_t unwrap_frame(framepos_t expected, nframes_t frame)
+{
+    return static_cast<nframes_t>(expected) == frame ? expected : framepos_t(frame);
+}
+
 typedef std::shared_ptr<class AudioChunk> AudioChunkPtr;
 typedef std::shared_ptr<class AudioChunk const> AudioChunkConstPtr;
 
@@ -10,12 +10,20 @@
  */
 
 #include "audio_chunk.hh"
+#include "audio_mix.hh"
 
 #include <sstream>
 #include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 #include <algorithm>
+#include <cmath>
+#include <new>
+#include <memory>
+#include <cstdint>
+#include <boost/noncopyable.hpp>
+
+#include <sys/mman.h>
 
 #include <samplerate.h>
 #include <sndfile.h>
@@ -27,7 +35,131 @@
 #include "util/debug.hh"
 
 
-AudioChunk::AudioChunk(std::string const & filename, nframes_t samplerate)
+nframes_t const AudioChunk::STREAM_BLOCK_SIZE;
+
+
+namespace {
+
+/*
+ * converts a stream of blocks to another samplerate, writing to a buffer of fixed length.
+ * output beyond the end of the buffer is dropped
+ */
+class Converter
+  : boost::noncopyable
+{
+  public:
+    Converter(AudioChunk::Quality quality, double ratio, sample_t *out, nframes_t length)
+      : _ratio(ratio)
+      , _out(out)
+      , _length(length)
+      , _written(0)
+    {
+        static int const types[] = {
+            SRC_SINC_BEST_QUALITY, SRC_SINC_MEDIUM_QUALITY, SRC_SINC_FASTEST, SRC_LINEAR
+        };
+
+        int error;
+        if ((_state = src_new(types[quality], 1, &error)) == NULL) {
+            throw std::runtime_error(das::make_string() << "error converting samplerate: " << src_strerror(error));
+        }
+    }
+
+    ~Converter() {
+        src_delete(_state);
+    }
+
+    // convert length frames. after the last block, the remaining output is flushed
+    void process(sample_t const *in, nframes_t length, bool last)
+    {
+        SRC_DATA d;
+        d.src_ratio = _ratio;
+        d.end_of_input = last;
+
+        while (_written < _length) {
+            d.data_in = in;
+            d.input_frames = length;
+            d.data_out = _out + _written;
+            d.output_frames = _length - _written;
+
+            int error;
+            if ((error = src_process(_state, &d)) != 0) {
+                throw std::runtime_error(das::make_string() << "error converting samplerate: " << src_strerror(error));
+            }
+
+            in += d.input_frames_used;
+            length -= d.input_frames_used;
+            _written += d.output_frames_gen;
+
+            if (!d.output_frames_gen && (!length || !d.input_frames_used)) {
+                // all input consumed, and nothing more to flush
+                break;
+            }
+        }
+    }
+
+  private:
+    SRC_STATE *_state;
+    double _ratio;
+    sample_t *_out;
+    nframes_t _length;
+    nframes_t _written;
+};
+
+}
+
+
+char const * AudioChunk::quality_name(Quality quality)
+{
+    switch (quality) {
+      case QUALITY_BEST:    return "best";
+      case QUALITY_MEDIUM:  return "medium";
+      case QUALITY_FASTEST: return "fastest";
+      case QUALITY_LINEAR:  return "linear";
+    }
+    FAIL();
+    return "";
+}
+
+
+bool AudioChunk::quality_from_name(std::string const & name, Quality & quality)
+{
+    for (Quality q : { QUALITY_BEST, QUALITY_MEDIUM, QUALITY_FASTEST, QUALITY_LINEAR }) {
+        if (name == quality_name(q)) {
+            quality = q;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+nframes_t AudioChunk::file_samplerate(std::string const & filename)
+{
+    SF_INFO sfinfo;
+    std::memset(&sfinfo, 0, sizeof(sfinfo));
+
+    SNDFILE *f;
+
+    if ((f = sf_open(filename.c_str(), SFM_READ, &sfinfo)) == NULL) {
+        throw std::runtime_error(das::make_string() << "failed to open audio file '" << filename << "'");
+    }
+
+    sf_close(f);
+    return sfinfo.samplerate;
+}
+
+
+bool AudioChunk::pitch_resamples()
+{
+#ifdef ENABLE_RUBBERBAND
+    return false;
+#else
+    return true;
+#endif
+}
+
+
+AudioChunk::AudioChunk(std::string const & filename, nframes_t samplerate, Quality quality)
 {
     SF_INFO sfinfo;
     std::memset(&sfinfo, 0, sizeof(sfinfo));
@@ -38,27 +170,98 @@ AudioChunk::AudioChunk(std::string const & filename, nframes_t samplerate)
         throw std::runtime_error(das::make_string() << "failed to open audio file '" << filename << "'");
     }
 
-    _samples.reset(new sample_t[sfinfo.frames * sfinfo.channels]);
-    _length = sfinfo.frames;
-    _samplerate = sfinfo.samplerate;
+    std::unique_ptr<SNDFILE, int (*)(SNDFILE *)> file(f, sf_close);
+
+    double ratio = static_cast<double>(samplerate) / sfinfo.samplerate;
+    bool convert = (static_cast<nframes_t>(sfinfo.samplerate) != samplerate);
 
-    sf_readf_float(f, _samples.get(), sfinfo.frames);
+    // only the converted audio is ever held in memory as a whole
+    _length = convert ? std::max(static_cast<nframes_t>(sfinfo.frames * ratio), nframes_t(1))
+                      : static_cast<nframes_t>(sfinfo.frames);
+    _samples = allocate(_length);
+    _samplerate = samplerate;
+
+    std::unique_ptr<Converter> converter;
+    if (convert) {
+        converter.reset(new Converter(quality, ratio, _samples.get(), _length));
+    }
 
-    // convert stereo to mono
-    if (sfinfo.channels == 2) {
-        SamplePtr mono_samples(new sample_t[sfinfo.frames]);
-        for (int i = 0; i < sfinfo.frames; ++i) {
-            mono_samples[i] = (_samples[i*2] + _samples[i*2 + 1]) / 2;
+    std::vector<sample_t> block(STREAM_BLOCK_SIZE * sfinfo.channels);
+    std::vector<sample_t> mono(STREAM_BLOCK_SIZE);
+    nframes_t pos = 0;
+
+    for (;;) {
+        nframes_t n = static_cast<nframes_t>(std::max<sf_count_t>(sf_readf_float(f, block.data(), STREAM_BLOCK_SIZE), 0));
+        bool last = (n < STREAM_BLOCK_SIZE);
+
+        // convert to mono
+        for (nframes_t i = 0; i < n; ++i) {
+            sample_t v = 0.0f;
+            for (int c = 0; c < sfinfo.channels; ++c) {
+                v += block[i * sfinfo.channels + c];
+            }
+            mono[i] = v / sfinfo.channels;
         }
-        _samples = std::move(mono_samples);
+
+        if (converter) {
+            converter->process(mono.data(), n, last);
+        } else {
+            nframes_t k = std::min(n, _length - pos);
+            std::copy(mono.begin(), mono.begin() + k, _samples.get() + pos);
+            pos += k;
+        }
+
+        if (last) break;
+    }
+
+    update_peaks();
+}
+
+
+AudioChunk::AudioChunk(AudioChunk const & other)
+  : _samples(allocate(other._length))
+  , _length(other._length)
+  , _samplerate(other._samplerate)
+  , _peaks(other._peaks)
+{
+    std::copy(other._samples.get(), other._samples.get() + other._length, _samples.get());
+}
+
+
+AudioChunk::AudioChunk(void *mapping, std::size_t mapped_bytes, sample_t *samples,
+                       nframes_t length, nframes_t samplerate)
+  : _samples(samples, SampleDeleter(mapping, mapped_bytes))
+  , _length(length)
+  , _samplerate(samplerate)
+{
+    ASSERT(reinterpret_cast<std::uintptr_t>(samples) % ALIGNMENT == 0);
+
+    update_peaks();
+}
+
+
+void AudioChunk::SampleDeleter::operator()(sample_t *p) const
+{
+    if (mapping) {
+        ::munmap(mapping, mapped_bytes);
+    } else {
+        std::free(p);
     }
+}
 
-    // convert samplerate
-    if (_samplerate != samplerate) {
-        resample(samplerate);
+
+AudioChunk::SamplePtr AudioChunk::allocate(std::size_t length)
+{
+    std::size_t bytes = (length * sizeof(sample_t) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (!bytes) bytes = ALIGNMENT;
+    void *p;
+
+    if (::posix_memalign(&p, ALIGNMENT, bytes) != 0) {
+        throw std::bad_alloc();
     }
+    std::memset(p, 0, bytes);
 
-    sf_close(f);
+    return SamplePtr(static_cast<sample_t *>(p));
 }
 
 
@@ -66,46 +269,60 @@ void AudioChunk::adjust_volume(float volume)
 {
     if (volume == 1.0f) return;
 
-    for (nframes_t i = 0; i < _length; ++i) {
-        _samples[i] *= volume;
-    }
+    audio_mix::scale(_samples.get(), _length, volume);
+
+    update_peaks();
 }
 
 
-void AudioChunk::adjust_pitch(float factor)
+void AudioChunk::adjust_pitch(float factor, Quality quality)
 {
     if (factor == 1.0f || !_length) return;
 
 #ifdef ENABLE_RUBBERBAND
     pitch_shift(factor);
+    (void)quality;
 #else
     nframes_t s = _samplerate;
-    resample(static_cast<nframes_t>(_samplerate / factor));
+    resample(static_cast<nframes_t>(_samplerate / factor), quality);
     _samplerate = s;
 #endif
+
+    update_peaks();
 }
 
 
-void AudioChunk::resample(nframes_t samplerate)
+void AudioChunk::update_peaks()
 {
-    SRC_DATA src_data;
-    int error;
+    _peaks.assign((_length + PEAK_BLOCK_SIZE - 1) / PEAK_BLOCK_SIZE, 0.0f);
+
+    // accumulate block maxima from the end, so each block also covers everything after it
+    float p = 0.0f;
+    for (std::size_t n = _peaks.size(); n-- > 0; ) {
+        nframes_t end = std::min(static_cast<nframes_t>((n + 1) * PEAK_BLOCK_SIZE), _length);
+        for (nframes_t i = n * PEAK_BLOCK_SIZE; i < end; ++i) {
+            p = std::max(p, std::fabs(_samples[i]));
+        }
+        _peaks[n] = p;
+    }
+}
 
-    src_data.input_frames = _length;
-    src_data.data_in = _samples.get();
 
-    src_data.src_ratio = static_cast<float>(samplerate) / static_cast<float>(_samplerate);
-    src_data.output_frames = std::max(static_cast<long>(_length * src_data.src_ratio), 1L);
+void AudioChunk::resample(nframes_t samplerate, Quality quality)
+{
+    double ratio = static_cast<double>(samplerate) / _samplerate;
+    nframes_t length = std::max(static_cast<nframes_t>(_length * ratio), nframes_t(1));
 
-    SamplePtr samples_new(new sample_t[src_data.output_frames]());
-    src_data.data_out = samples_new.get();
+    SamplePtr samples_new = allocate(length);
+    Converter converter(quality, ratio, samples_new.get(), length);
 
-    if ((error = src_simple(&src_data, SRC_SINC_BEST_QUALITY, 1)) != 0) {
-        throw std::runtime_error(das::make_string() << "error converting samplerate: " << src_strerror(error));
+    for (nframes_t i = 0; i < _length; i += STREAM_BLOCK_SIZE) {
+        nframes_t n = std::min(STREAM_BLOCK_SIZE, _length - i);
+        converter.process(_samples.get() + i, n, i + n == _length);
     }
 
     _samples = std::move(samples_new);
-    _length = src_data.output_frames;
+    _length = length;
     _samplerate = samplerate;
 }
 
@@ -120,7 +337,7 @@ void AudioChunk::pitch_shift(float factor)
     rb.setPitchScale(factor);
     rb.setExpectedInputDuration(_length);
 
-    SamplePtr samples_new(new sample_t[_length]());
+    SamplePtr samples_new = allocate(_length);
     sample_t *buf;
     nframes_t k = 0;
 
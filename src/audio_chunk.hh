@@ -14,6 +14,10 @@
 
 #include "audio.hh"
 
+#include <string>
+#include <vector>
+#include <cstdlib>
+
 
 /*
  * mono 32-bit float audio sample
@@ -21,8 +25,28 @@
 class AudioChunk
 {
   public:
-    // loads sample from file, converting to the given samplerate if samplerate is non-zero
-    AudioChunk(std::string const & filename, nframes_t samplerate);
+    // samplerate converter quality, from slowest to fastest
+    enum Quality {
+        QUALITY_BEST,
+        QUALITY_MEDIUM,
+        QUALITY_FASTEST,
+        QUALITY_LINEAR
+    };
+
+    // name of a quality setting, as used on the command line and over OSC
+    static char const * quality_name(Quality quality);
+    // returns false if there's no quality setting with that name
+    static bool quality_from_name(std::string const & name, Quality & quality);
+
+    // samplerate of an audio file, without reading any audio.
+    // throws if the file can't be opened
+    static nframes_t file_samplerate(std::string const & filename);
+    // true if adjust_pitch() changes the pitch by resampling, so the quality matters
+    static bool pitch_resamples();
+
+    // loads sample from file, converting to the given samplerate.
+    // the file is read and converted in blocks
+    AudioChunk(std::string const & filename, nframes_t samplerate, Quality quality = QUALITY_BEST);
 
     // create empty audio
     AudioChunk(nframes_t samplerate)
@@ -32,17 +56,53 @@ class AudioChunk
     {
     }
 
+    // copy of another chunk's audio, e.g. to be processed further
+    AudioChunk(AudioChunk const & other);
+
+    // use length frames of memory-mapped audio at samples, which must be aligned and
+    // padded like allocated sample data. the chunk takes over the mapping of
+    // mapped_bytes at mapping, and unmaps it when it's destroyed
+    AudioChunk(void *mapping, std::size_t mapped_bytes, sample_t *samples,
+               nframes_t length, nframes_t samplerate);
+
     void adjust_volume(float volume);
-    void adjust_pitch(float factor);
+    // quality is used if the pitch is changed by resampling
+    void adjust_pitch(float factor, Quality quality = QUALITY_BEST);
 
     sample_t const * samples() const { return _samples.get(); }
     nframes_t length() const { return _length; }
     nframes_t samplerate() const { return _samplerate; }
 
+    // peak level of the remaining audio, starting at (approximately) frame pos
+    float peak(nframes_t pos) const {
+        std::size_t n = pos / PEAK_BLOCK_SIZE;
+        return n < _peaks.size() ? _peaks[n] : 0.0f;
+    }
+
+    // sample data is aligned to this many bytes, and zero-padded to a multiple of it
+    static std::size_t const ALIGNMENT = 64;
+
   private:
-    typedef std::unique_ptr<sample_t[]> SamplePtr;
+    // frees allocated sample data, or unmaps the file it came from
+    struct SampleDeleter {
+        SampleDeleter() : mapping(NULL), mapped_bytes(0) { }
+        SampleDeleter(void *m, std::size_t b) : mapping(m), mapped_bytes(b) { }
+        void operator()(sample_t *p) const;
+
+        void *mapping;
+        std::size_t mapped_bytes;
+    };
+    typedef std::unique_ptr<sample_t[], SampleDeleter> SamplePtr;
 
-    void resample(nframes_t samplerate);
+    // allocates zero-initialized sample data for length frames
+    static SamplePtr allocate(std::size_t length);
+
+    static nframes_t const PEAK_BLOCK_SIZE = 256;
+    // number of frames read and converted at a time
+    static nframes_t const STREAM_BLOCK_SIZE = 4096;
+
+    void update_peaks();
+    void resample(nframes_t samplerate, Quality quality);
 #ifdef ENABLE_RUBBERBAND
     void pitch_shift(float factor);
 #endif
@@ -50,6 +110,9 @@ class AudioChunk
     SamplePtr _samples;
     nframes_t _length;
     nframes_t _samplerate;
+
+    // peak level from the start of each block to the end of the audio
+    std::vector<float> _peaks;
 };
 
 
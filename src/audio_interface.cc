@@ -11,60 +11,223 @@
 
 #include "audio_interface.hh"
 #include "audio_chunk.hh"
+#include "audio_mix.hh"
+
+#include <algorithm>
 
 #include "util/debug.hh"
 
 
-AudioInterface::AudioInterface()
-  : _next_chunk(0)
+AudioInterface::AudioInterface(std::size_t nvoices)
+  : _voices(std::max<std::size_t>(nvoices, 1))
+  , _active(_voices.size())
+  , _nactive(0)
+  , _free(_voices.size())
+  , _nfree(_voices.size())
+  , _serial(0)
+  , _steal_policy(STEAL_OLDEST)
+  , _next_processor(NULL)
+  , _processor(NULL)
+  , _periods(0)
   , _volume(1.0f)
 {
+    // all voices are unused
+    for (std::size_t n = 0; n < _free.size(); ++n) {
+        _free[n] = n;
+    }
 }
 
 
-void AudioInterface::set_process_callback(ProcessCallback cb)
+void AudioInterface::set_processor(Processor *p)
 {
-    _process_cb = cb;
+    _next_processor.store(p, std::memory_order_release);
 }
 
 
-void AudioInterface::play(AudioChunkConstPtr chunk, nframes_t offset, float volume)
+void AudioInterface::process(sample_t *buffer, nframes_t nframes, TransportState const & transport)
 {
+    // pick up the processor and samples once, and use them for the whole period
+    _processor = _next_processor.load(std::memory_order_acquire);
+    _samples.period_start();
+
+    if (_processor) {
+        _processor->process_callback(buffer, nframes, transport);
+    }
+
+    process_mix(buffer, nframes);
+
+    _periods.store(_periods.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+
+void AudioInterface::play(SampleBank::Handle sample, nframes_t offset, float volume, int type, int choke_group)
+{
+    AudioChunk const *chunk = _samples.get(sample);
+
+    if (!chunk) {
+        return;
+    }
+
     ASSERT(chunk->samplerate() == samplerate());
 
-    _chunks[_next_chunk].chunk  = chunk;
-    _chunks[_next_chunk].offset = offset;
-    _chunks[_next_chunk].pos    = 0;
-    _chunks[_next_chunk].volume = volume;
+    if (choke_group) {
+        choke_voices(choke_group, offset);
+    }
 
-    _next_chunk = (_next_chunk + 1) % _chunks.size();
+    Voice & v = _voices[allocate_voice(type)];
+
+    v.chunk        = chunk;
+    v.sample       = sample;
+    v.offset       = offset;
+    v.pos          = 0;
+    v.volume       = volume;
+    v.gain         = _samples.gain(sample) * _volume;
+    v.gain_target  = v.gain;
+    v.gain_step    = 0.0f;
+    v.gain_ramp    = 0;
+    v.type         = type;
+    v.choke_group  = choke_group;
+    v.serial       = _serial++;
+    v.choke_offset = 0;
+    v.release      = 0;
+}
+
+
+std::size_t AudioInterface::allocate_voice(int type)
+{
+    if (_nfree) {
+        // use an unused voice
+        std::size_t n = _free[--_nfree];
+        _active[_nactive++] = n;
+        return n;
+    }
+
+    // all voices are in use, steal one of them. voices are compared by their serial
+    // number relative to the newest one, so wrap-around doesn't matter
+    std::size_t victim = _active[0];
+
+    auto age = [&](std::size_t n) { return _serial - _voices[n].serial; };
+
+    switch (_steal_policy) {
+      case STEAL_QUIETEST: {
+        auto level = [&](std::size_t n) {
+            Voice const & v = _voices[n];
+            return v.chunk->peak(v.pos) * v.volume * v.gain_target;
+        };
+        for (std::size_t i = 1; i < _nactive; ++i) {
+            if (level(_active[i]) < level(victim)) victim = _active[i];
+        }
+      } break;
+
+      case STEAL_SAME_TYPE: {
+        bool found = (_voices[victim].type == type);
+        for (std::size_t i = 1; i < _nactive; ++i) {
+            std::size_t n = _active[i];
+            bool same = (_voices[n].type == type);
+            if ((same && !found) || (same == found && age(n) > age(victim))) {
+                victim = n;
+                found = found || same;
+            }
+        }
+      } break;
+
+      case STEAL_OLDEST:
+      default:
+        for (std::size_t i = 1; i < _nactive; ++i) {
+            if (age(_active[i]) > age(victim)) victim = _active[i];
+        }
+        break;
+    }
+
+    return victim;
+}
+
+
+void AudioInterface::choke_voices(int choke_group, nframes_t offset)
+{
+    for (std::size_t i = 0; i < _nactive; ++i) {
+        Voice & v = _voices[_active[i]];
+
+        if (v.choke_group == choke_group && !v.release) {
+            v.choke_offset = std::max(offset, v.offset);
+            v.release = CHOKE_FADE_FRAMES;
+        }
+    }
 }
 
 
 void AudioInterface::process_mix(sample_t *buffer, nframes_t nframes)
 {
-    for (auto & a : _chunks)
+    // only iterate over playing voices. finished voices are swapped with the last active one
+    for (std::size_t i = 0; i < _nactive; )
     {
-        if (a.chunk) {
-            process_mix_samples(buffer + a.offset,
-                                a.chunk->samples() + a.pos,
-                                std::min(nframes - a.offset, a.chunk->length() - a.pos),
-                                a.volume * _volume);
+        std::size_t n = _active[i];
+
+        if (process_voice(_voices[n], buffer, nframes)) {
+            ++i;
+        } else {
+            _voices[n].chunk = NULL;
+            _active[i] = _active[--_nactive];
+            _free[_nfree++] = n;
+        }
+    }
 
-            a.pos += nframes - a.offset;
-            a.offset = 0;
+    _samples.period_done(nframes);
+}
 
-            if (a.pos >= a.chunk->length()) {
-                a.chunk.reset();
-            }
+
+bool AudioInterface::process_voice(Voice & v, sample_t *buffer, nframes_t nframes)
+{
+    nframes_t length = std::min(nframes - v.offset, v.chunk->length() - v.pos);
+
+    float target = _samples.gain(v.sample) * _volume;
+    if (target != v.gain_target) {
+        // ramp from wherever the gain currently is
+        v.gain_target = target;
+        v.gain_step = (target - v.gain) / GAIN_RAMP_FRAMES;
+        v.gain_ramp = GAIN_RAMP_FRAMES;
+    }
+
+    if (!v.release) {
+        mix_voice(v, buffer + v.offset, v.pos, length);
+    } else {
+        // play normally up to the point where the fade-out starts
+        nframes_t pre = std::min(length, v.choke_offset - v.offset);
+        mix_voice(v, buffer + v.offset, v.pos, pre);
+
+        // fade out from the current gain, any gain ramp is cut short
+        nframes_t fade = std::min(length - pre, v.release);
+        float step = v.volume * v.gain / CHOKE_FADE_FRAMES;
+        audio_mix::mix_ramp(buffer + v.offset + pre, v.chunk->samples() + v.pos + pre, fade,
+                            step * v.release, -step);
+
+        v.release -= fade;
+        v.choke_offset = 0;
+
+        if (!v.release) {
+            // fade-out complete
+            return false;
         }
     }
+
+    v.pos += nframes - v.offset;
+    v.offset = 0;
+
+    return v.pos < v.chunk->length();
 }
 
 
-void AudioInterface::process_mix_samples(sample_t *dest, sample_t const * src, nframes_t length, float volume)
+void AudioInterface::mix_voice(Voice & v, sample_t *dest, nframes_t pos, nframes_t length)
 {
-    for (sample_t *end = dest + length; dest < end; ++dest, ++src) {
-        *dest += *src * volume;
+    sample_t const *src = v.chunk->samples() + pos;
+    nframes_t ramp = std::min(length, v.gain_ramp);
+
+    if (ramp) {
+        audio_mix::mix_ramp(dest, src, ramp, v.volume * v.gain, v.volume * v.gain_step);
+
+        v.gain_ramp -= ramp;
+        v.gain = v.gain_ramp ? v.gain + ramp * v.gain_step : v.gain_target;
     }
+
+    audio_mix::mix(dest + ramp, src + ramp, length - ramp, v.volume * v.gain);
 }
@@ -13,14 +13,18 @@
 #define KLICK_AUDIO_INTERFACE_HH
 
 #include "audio.hh"
+#include "sample_bank.hh"
 
 #include <string>
 #include <stdexcept>
 #include <memory>
-#include <array>
-#include <functional>
+#include <vector>
+#include <atomic>
+#include <cstdint>
 #include <boost/noncopyable.hpp>
 
+#include "main.hh"
+
 
 class AudioInterface
   : boost::noncopyable
@@ -31,48 +35,146 @@ class AudioInterface
         AudioError(std::string const & w) : std::runtime_error(w) { }
     };
 
-    AudioInterface();
+    // policies for choosing the voice to be cut off when all voices are in use
+    enum StealPolicy {
+        STEAL_OLDEST,       // the voice that was started first
+        STEAL_QUIETEST,     // the voice with the lowest remaining peak level
+        STEAL_SAME_TYPE     // the oldest voice playing the same type of sound, if any
+    };
+
+    static std::size_t const DEFAULT_VOICES = 16;
+
+    // allocates a pool of nvoices voices, which can't be changed later
+    AudioInterface(std::size_t nvoices = DEFAULT_VOICES);
     virtual ~AudioInterface() { }
 
-    typedef std::function<void (sample_t *, nframes_t)> ProcessCallback;
+    /*
+     * transport state at the start of a period, queried only once per period
+     */
+    struct TransportState {
+        TransportState()
+          : available(false)
+          , rolling(false)
+          , frame(0)
+          , position()
+        {
+        }
+
+        bool available;         // false if the backend doesn't have a transport
+        bool rolling;
+        framepos_t frame;       // position.frame, unwrapped to 64 bits
+        position_t position;    // frame, BBT info and cycle start time
+    };
+
+    /*
+     * object that generates audio, called by the audio thread once per period
+     */
+    class Processor
+    {
+      public:
+        virtual ~Processor() { }
 
-    virtual void set_process_callback(ProcessCallback cb);
+        virtual void process_callback(sample_t *, nframes_t, TransportState const &) REALTIME = 0;
+        virtual void timebase_callback(position_t *) REALTIME { }
+    };
+
+    // publish a new processor, which is picked up at the start of the next period.
+    // the previous processor must be kept alive until periods() has advanced by two
+    void set_processor(Processor *p) NONREALTIME;
+
+    // number of periods processed so far
+    std::uint64_t periods() const {
+        return _periods.load(std::memory_order_acquire);
+    }
 
     // get sample rate
     virtual nframes_t samplerate() const = 0;
     // check if backend is still running
     virtual bool is_shutdown() const = 0;
+    // false if audio is processed offline, as fast as possible
+    virtual bool is_realtime() const { return true; }
 
-    // start playing audio chunk at offset into the current period
-    void play(AudioChunkConstPtr chunk, nframes_t offset, float volume = 1.0);
+    // all audio chunks that can be played
+    SampleBank & samples() { return _samples; }
+
+    // start playing the chunk in the given slot of the sample bank at offset into the current period.
+    // the voice follows the slot's gain and the master volume while it's playing.
+    // type identifies the kind of sound for voice stealing. starting a voice in a non-zero
+    // choke group fades out all other voices in the same group
+    void play(SampleBank::Handle sample, nframes_t offset, float volume = 1.0,
+              int type = 0, int choke_group = 0) REALTIME;
 
     void set_volume(float v) { _volume = v; }
     float volume() const { return _volume; }
 
+    void set_steal_policy(StealPolicy p) { _steal_policy = p; }
+    StealPolicy steal_policy() const { return _steal_policy; }
+
+    std::size_t voices() const { return _voices.size(); }
+
   protected:
 
-    ProcessCallback _process_cb;
+    // run the current processor and mix all playing voices into the buffer
+    void process(sample_t *, nframes_t, TransportState const & = TransportState()) REALTIME;
 
-    void process_mix(sample_t *, nframes_t);
+    // processor used during the current period
+    Processor * processor() const REALTIME { return _processor; }
 
-  private:
+    void process_mix(sample_t *, nframes_t) REALTIME;
 
-    void process_mix_samples(sample_t *dest, sample_t const * src, nframes_t length, float volume = 1.0);
+  private:
 
-    // maximum number of audio chunks that can be played simultaneously
-    static int const MAX_PLAYING_CHUNKS = 4;
+    // length of the fade-out of voices cut off by their choke group
+    static nframes_t const CHOKE_FADE_FRAMES = 64;
+    // length of the ramp when the gain of a playing voice changes, short enough to
+    // follow a fader but long enough to avoid zipper noise
+    static nframes_t const GAIN_RAMP_FRAMES = 256;
 
-    struct PlayingChunk {
-        AudioChunkConstPtr chunk;
+    struct Voice {
+        AudioChunk const *chunk;
+        SampleBank::Handle sample;
         nframes_t offset;
         nframes_t pos;
         float volume;
+        float gain;             // current sample gain times master volume
+        float gain_target;
+        float gain_step;
+        nframes_t gain_ramp;    // remaining frames until gain reaches gain_target
+        int type;
+        int choke_group;
+        unsigned int serial;    // increases with each voice started
+        nframes_t choke_offset; // offset into the current period where the fade-out starts
+        nframes_t release;      // remaining frames of the fade-out, zero if not choked
     };
 
-    typedef std::array<PlayingChunk, MAX_PLAYING_CHUNKS> ChunkArray;
+    typedef std::vector<Voice> VoiceVector;
+    typedef std::vector<std::size_t> IndexVector;
+
+    std::size_t allocate_voice(int type);
+    void choke_voices(int choke_group, nframes_t offset);
+    bool process_voice(Voice & v, sample_t *buffer, nframes_t nframes);
+    // mix length frames of the voice, ramping its gain if necessary
+    void mix_voice(Voice & v, sample_t *dest, nframes_t pos, nframes_t length);
+
+    // all voices, allocated once
+    VoiceVector _voices;
+
+    // indices of playing voices, only the first _nactive elements are valid
+    IndexVector _active;
+    std::size_t _nactive;
+
+    // indices of unused voices, only the first _nfree elements are valid
+    IndexVector _free;
+    std::size_t _nfree;
 
-    ChunkArray _chunks;
-    int _next_chunk;
+    unsigned int _serial;
+    StealPolicy _steal_policy;
+
+    SampleBank _samples;
+
+    std::atomic<Processor *> _next_processor;
+    Processor * _processor;
+    std::atomic<std::uint64_t> _periods;
     float _volume;
 };
 
@@ -83,9 +185,14 @@ class AudioInterfaceTransport
 {
   public:
 
-    typedef std::function<void (position_t *)> TimebaseCallback;
+    AudioInterfaceTransport(std::size_t nvoices)
+      : AudioInterface(nvoices)
+    {
+    }
 
-    virtual void set_timebase_callback(TimebaseCallback cb) = 0;
+    // become timebase master, calling the current processor's timebase_callback()
+    virtual void set_timebase_master(bool master) = 0;
+    virtual bool timebase_master() const = 0;
 
 
     virtual bool transport_rolling() const = 0;
@@ -93,10 +200,6 @@ class AudioInterfaceTransport
     virtual nframes_t frame() const = 0;
     virtual bool set_position(position_t const &) = 0;
     virtual bool set_frame(nframes_t) = 0;
-
-  protected:
-
-    TimebaseCallback _timebase_cb;
 };
 
 
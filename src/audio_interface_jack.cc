@@ -21,8 +21,11 @@
 #include "util/debug.hh"
 
 
-AudioInterfaceJack::AudioInterfaceJack(std::string const & name)
-  : _shutdown(false)
+AudioInterfaceJack::AudioInterfaceJack(std::string const & name, std::size_t nvoices)
+  : AudioInterfaceTransport(nvoices)
+  , _timebase_master(false)
+  , _transport_next(0)
+  , _shutdown(false)
 {
     if ((_client = jack_client_open(name.c_str(), JackNullOption, NULL)) == 0) {
         throw AudioError("can't connect to jack server");
@@ -72,18 +75,20 @@ bool AudioInterfaceJack::is_shutdown() const
 }
 
 
-void AudioInterfaceJack::set_timebase_callback(TimebaseCallback cb)
+void AudioInterfaceJack::set_timebase_master(bool master)
 {
-    if (cb) {
+    if (master == _timebase_master) {
+        return;
+    }
+
+    if (master) {
         if (jack_set_timebase_callback(_client, 0, &timebase_callback_, static_cast<void*>(this)) != 0) {
             throw AudioError("failed to become jack transport master");
         }
     } else {
-        if (_timebase_cb) {
-            jack_release_timebase(_client);
-        }
+        jack_release_timebase(_client);
     }
-    _timebase_cb = cb;
+    _timebase_master = master;
 }
 
 
@@ -174,11 +179,16 @@ int AudioInterfaceJack::process_callback_(nframes_t nframes, void *arg)
 
     std::memset(buffer, 0, nframes * sizeof(sample_t));
 
-    if (this_->_process_cb) {
-        this_->_process_cb(buffer, nframes);
-    }
+    // query the transport only once, and give everyone the same view of this period
+    TransportState transport;
+    transport.available = true;
+    transport.rolling = (jack_transport_query(this_->_client, &transport.position) == JackTransportRolling);
+
+    // jack's frame counter wraps around after 2^32 frames, ours doesn't
+    transport.frame = unwrap_frame(this_->_transport_next, transport.position.frame);
+    this_->_transport_next = transport.frame + (transport.rolling ? nframes : 0);
 
-    this_->process_mix(buffer, nframes);
+    this_->process(buffer, nframes, transport);
 
     return 0;
 }
@@ -189,8 +199,9 @@ void AudioInterfaceJack::timebase_callback_(jack_transport_state_t /*state*/, nf
 {
     AudioInterfaceJack *this_ = static_cast<AudioInterfaceJack*>(arg);
 
-    if (this_->_timebase_cb) {
-        this_->_timebase_cb(pos);
+    // jack calls this after the process callback, so use the same processor
+    if (this_->processor()) {
+        this_->processor()->timebase_callback(pos);
     }
 }
 
@@ -26,10 +26,11 @@ class AudioInterfaceJack
 {
   public:
 
-    AudioInterfaceJack(std::string const & name);
+    AudioInterfaceJack(std::string const & name, std::size_t nvoices = DEFAULT_VOICES);
     virtual ~AudioInterfaceJack();
 
-    virtual void set_timebase_callback(TimebaseCallback cb);
+    virtual void set_timebase_master(bool master);
+    virtual bool timebase_master() const { return _timebase_master; }
 
     // get JACK client name
     std::string client_name() const;
@@ -61,6 +62,11 @@ class AudioInterfaceJack
     jack_client_t *_client;
     jack_port_t *_output_port;
 
+    bool _timebase_master;
+
+    // transport frame at which the next period is expected to start, in 64 bits
+    framepos_t _transport_next;
+
     volatile bool _shutdown;
 };
 
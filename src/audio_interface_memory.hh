@@ -0,0 +1,48 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_AUDIO_INTERFACE_MEMORY_HH
+#define KLICK_AUDIO_INTERFACE_MEMORY_HH
+
+#include "audio_interface.hh"
+
+
+/*
+ * offline backend that renders audio into a buffer supplied by the caller
+ */
+class AudioInterfaceMemory
+  : public AudioInterface
+{
+  public:
+
+    AudioInterfaceMemory(nframes_t samplerate, std::size_t nvoices = DEFAULT_VOICES)
+      : AudioInterface(nvoices)
+      , _samplerate(samplerate)
+    {
+    }
+
+    // run the processor and mix the next nframes frames into the buffer, optionally
+    // following a simulated transport
+    void process(sample_t *buffer, nframes_t nframes, TransportState const & transport = TransportState()) {
+        AudioInterface::process(buffer, nframes, transport);
+    }
+
+    nframes_t samplerate() const { return _samplerate; }
+    bool is_shutdown() const { return false; }
+    bool is_realtime() const { return false; }
+
+  private:
+
+    nframes_t _samplerate;
+};
+
+
+#endif // KLICK_AUDIO_INTERFACE_MEMORY_HH
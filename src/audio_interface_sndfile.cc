@@ -19,8 +19,10 @@
 #include "util/string.hh"
 
 
-AudioInterfaceSndfile::AudioInterfaceSndfile(std::string const & filename, nframes_t samplerate)
-  : _samplerate(samplerate)
+AudioInterfaceSndfile::AudioInterfaceSndfile(std::string const & filename, nframes_t samplerate,
+                                             std::size_t nvoices)
+  : AudioInterface(nvoices)
+  , _samplerate(samplerate)
 {
     SF_INFO sfinfo;
     std::memset(&sfinfo, 0, sizeof(sfinfo));
@@ -60,10 +62,8 @@ void AudioInterfaceSndfile::process(std::size_t buffer_size)
     sample_t buffer[buffer_size];
     std::fill(buffer, buffer+buffer_size, 0.0f);
 
-    // run process callback (metronome)
-    _process_cb(buffer, buffer_size);
-    // mix audio data to buffer
-    process_mix(buffer, buffer_size);
+    // run metronome and mix audio data to buffer
+    AudioInterface::process(buffer, buffer_size);
 
     // write to output file
     sf_writef_float(_sndfile.get(), buffer, buffer_size);
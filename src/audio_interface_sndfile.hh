@@ -24,12 +24,14 @@ class AudioInterfaceSndfile
 {
   public:
 
-    AudioInterfaceSndfile(std::string const & filename, nframes_t samplerate);
+    AudioInterfaceSndfile(std::string const & filename, nframes_t samplerate,
+                          std::size_t nvoices = DEFAULT_VOICES);
 
     void process(std::size_t buffer_size);
 
     nframes_t samplerate() const { return _samplerate; }
     bool is_shutdown() const { return false; }
+    bool is_realtime() const { return false; }
 
   private:
 
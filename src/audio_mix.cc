@@ -0,0 +1,262 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "audio_mix.hh"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define HAVE_X86_KERNELS
+  #include <immintrin.h>
+#endif
+
+
+namespace audio_mix {
+
+namespace {
+
+
+struct Kernels {
+    char const *name;
+    void (*mix)(sample_t *, sample_t const *, nframes_t, float);
+    void (*mix_ramp)(sample_t *, sample_t const *, nframes_t, float, float);
+    void (*scale)(sample_t *, nframes_t, float);
+};
+
+
+/*
+ * portable implementation, also used for the remaining samples of the vectorized kernels
+ */
+void mix_scalar(sample_t *dest, sample_t const *src, nframes_t length, float volume)
+{
+    for (sample_t *end = dest + length; dest < end; ++dest, ++src) {
+        *dest += *src * volume;
+    }
+}
+
+void mix_ramp_scalar(sample_t *dest, sample_t const *src, nframes_t length, float volume, float step)
+{
+    for (nframes_t i = 0; i < length; ++i) {
+        dest[i] += src[i] * (volume + i * step);
+    }
+}
+
+void scale_scalar(sample_t *buffer, nframes_t length, float volume)
+{
+    for (sample_t *end = buffer + length; buffer < end; ++buffer) {
+        *buffer *= volume;
+    }
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+/*
+ * SSE2. unaligned loads and stores are used throughout, since voices start at arbitrary
+ * offsets into both the chunk and the output buffer
+ */
+__attribute__((target("sse2")))
+void mix_sse2(sample_t *dest, sample_t const *src, nframes_t length, float volume)
+{
+    __m128 v = _mm_set1_ps(volume);
+    nframes_t i = 0;
+    for ( ; i + 4 <= length; i += 4) {
+        __m128 d = _mm_loadu_ps(dest + i);
+        __m128 s = _mm_loadu_ps(src + i);
+        _mm_storeu_ps(dest + i, _mm_add_ps(d, _mm_mul_ps(s, v)));
+    }
+    mix_scalar(dest + i, src + i, length - i, volume);
+}
+
+__attribute__((target("sse2")))
+void mix_ramp_sse2(sample_t *dest, sample_t const *src, nframes_t length, float volume, float step)
+{
+    __m128 v = _mm_add_ps(_mm_set1_ps(volume), _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 1, 2, 3)));
+    __m128 dv = _mm_set1_ps(step * 4);
+    nframes_t i = 0;
+    for ( ; i + 4 <= length; i += 4) {
+        __m128 d = _mm_loadu_ps(dest + i);
+        __m128 s = _mm_loadu_ps(src + i);
+        _mm_storeu_ps(dest + i, _mm_add_ps(d, _mm_mul_ps(s, v)));
+        v = _mm_add_ps(v, dv);
+    }
+    mix_ramp_scalar(dest + i, src + i, length - i, volume + i * step, step);
+}
+
+__attribute__((target("sse2")))
+void scale_sse2(sample_t *buffer, nframes_t length, float volume)
+{
+    __m128 v = _mm_set1_ps(volume);
+    nframes_t i = 0;
+    for ( ; i + 4 <= length; i += 4) {
+        _mm_storeu_ps(buffer + i, _mm_mul_ps(_mm_loadu_ps(buffer + i), v));
+    }
+    scale_scalar(buffer + i, length - i, volume);
+}
+
+
+/*
+ * AVX2 + FMA
+ */
+__attribute__((target("avx2,fma")))
+void mix_avx2(sample_t *dest, sample_t const *src, nframes_t length, float volume)
+{
+    __m256 v = _mm256_set1_ps(volume);
+    nframes_t i = 0;
+    for ( ; i + 8 <= length; i += 8) {
+        __m256 d = _mm256_loadu_ps(dest + i);
+        __m256 s = _mm256_loadu_ps(src + i);
+        _mm256_storeu_ps(dest + i, _mm256_fmadd_ps(s, v, d));
+    }
+    mix_scalar(dest + i, src + i, length - i, volume);
+}
+
+__attribute__((target("avx2,fma")))
+void mix_ramp_avx2(sample_t *dest, sample_t const *src, nframes_t length, float volume, float step)
+{
+    __m256 v = _mm256_fmadd_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7),
+                               _mm256_set1_ps(volume));
+    __m256 dv = _mm256_set1_ps(step * 8);
+    nframes_t i = 0;
+    for ( ; i + 8 <= length; i += 8) {
+        __m256 d = _mm256_loadu_ps(dest + i);
+        __m256 s = _mm256_loadu_ps(src + i);
+        _mm256_storeu_ps(dest + i, _mm256_fmadd_ps(s, v, d));
+        v = _mm256_add_ps(v, dv);
+    }
+    mix_ramp_scalar(dest + i, src + i, length - i, volume + i * step, step);
+}
+
+__attribute__((target("avx2,fma")))
+void scale_avx2(sample_t *buffer, nframes_t length, float volume)
+{
+    __m256 v = _mm256_set1_ps(volume);
+    nframes_t i = 0;
+    for ( ; i + 8 <= length; i += 8) {
+        _mm256_storeu_ps(buffer + i, _mm256_mul_ps(_mm256_loadu_ps(buffer + i), v));
+    }
+    scale_scalar(buffer + i, length - i, volume);
+}
+
+
+/*
+ * AVX-512. the remaining samples are handled with a masked operation instead of the scalar loop
+ */
+__attribute__((target("avx512f")))
+void mix_avx512(sample_t *dest, sample_t const *src, nframes_t length, float volume)
+{
+    __m512 v = _mm512_set1_ps(volume);
+    nframes_t i = 0;
+    for ( ; i + 16 <= length; i += 16) {
+        __m512 d = _mm512_loadu_ps(dest + i);
+        __m512 s = _mm512_loadu_ps(src + i);
+        _mm512_storeu_ps(dest + i, _mm512_fmadd_ps(s, v, d));
+    }
+    if (i < length) {
+        __mmask16 m = static_cast<__mmask16>((1u << (length - i)) - 1);
+        __m512 d = _mm512_maskz_loadu_ps(m, dest + i);
+        __m512 s = _mm512_maskz_loadu_ps(m, src + i);
+        _mm512_mask_storeu_ps(dest + i, m, _mm512_fmadd_ps(s, v, d));
+    }
+}
+
+__attribute__((target("avx512f")))
+void mix_ramp_avx512(sample_t *dest, sample_t const *src, nframes_t length, float volume, float step)
+{
+    __m512 v = _mm512_fmadd_ps(_mm512_set1_ps(step),
+                               _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+                               _mm512_set1_ps(volume));
+    __m512 dv = _mm512_set1_ps(step * 16);
+    nframes_t i = 0;
+    for ( ; i + 16 <= length; i += 16) {
+        __m512 d = _mm512_loadu_ps(dest + i);
+        __m512 s = _mm512_loadu_ps(src + i);
+        _mm512_storeu_ps(dest + i, _mm512_fmadd_ps(s, v, d));
+        v = _mm512_add_ps(v, dv);
+    }
+    if (i < length) {
+        __mmask16 m = static_cast<__mmask16>((1u << (length - i)) - 1);
+        __m512 d = _mm512_maskz_loadu_ps(m, dest + i);
+        __m512 s = _mm512_maskz_loadu_ps(m, src + i);
+        _mm512_mask_storeu_ps(dest + i, m, _mm512_fmadd_ps(s, v, d));
+    }
+}
+
+__attribute__((target("avx512f")))
+void scale_avx512(sample_t *buffer, nframes_t length, float volume)
+{
+    __m512 v = _mm512_set1_ps(volume);
+    nframes_t i = 0;
+    for ( ; i + 16 <= length; i += 16) {
+        _mm512_storeu_ps(buffer + i, _mm512_mul_ps(_mm512_loadu_ps(buffer + i), v));
+    }
+    if (i < length) {
+        __mmask16 m = static_cast<__mmask16>((1u << (length - i)) - 1);
+        _mm512_mask_storeu_ps(buffer + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, buffer + i), v));
+    }
+}
+
+#endif // HAVE_X86_KERNELS
+
+
+Kernels select_kernels()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")) {
+        Kernels k = { "avx512", &mix_avx512, &mix_ramp_avx512, &scale_avx512 };
+        return k;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        Kernels k = { "avx2", &mix_avx2, &mix_ramp_avx2, &scale_avx2 };
+        return k;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        Kernels k = { "sse2", &mix_sse2, &mix_ramp_sse2, &scale_sse2 };
+        return k;
+    }
+#endif
+    Kernels k = { "scalar", &mix_scalar, &mix_ramp_scalar, &scale_scalar };
+    return k;
+}
+
+
+// selected during static initialization, before any audio processing starts
+Kernels const kernels = select_kernels();
+
+
+} // namespace
+
+
+void mix(sample_t *dest, sample_t const *src, nframes_t length, float volume)
+{
+    kernels.mix(dest, src, length, volume);
+}
+
+
+void mix_ramp(sample_t *dest, sample_t const *src, nframes_t length, float volume, float step)
+{
+    kernels.mix_ramp(dest, src, length, volume, step);
+}
+
+
+void scale(sample_t *buffer, nframes_t length, float volume)
+{
+    kernels.scale(buffer, length, volume);
+}
+
+
+char const * implementation()
+{
+    return kernels.name;
+}
+
+
+} // namespace audio_mix
@@ -0,0 +1,39 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_AUDIO_MIX_HH
+#define KLICK_AUDIO_MIX_HH
+
+#include "audio.hh"
+
+
+/*
+ * sample processing kernels. the fastest implementation supported by the CPU
+ * is selected once at startup, the scalar one is used as a fallback
+ */
+namespace audio_mix {
+
+// dest[i] += src[i] * volume
+void mix(sample_t *dest, sample_t const *src, nframes_t length, float volume);
+
+// dest[i] += src[i] * (volume + i * step)
+void mix_ramp(sample_t *dest, sample_t const *src, nframes_t length, float volume, float step);
+
+// buffer[i] *= volume
+void scale(sample_t *buffer, nframes_t length, float volume);
+
+// name of the selected implementation
+char const * implementation();
+
+} // namespace audio_mix
+
+
+#endif // KLICK_AUDIO_MIX_HH
@@ -0,0 +1,49 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_CLICK_TRACK_HH
+#define KLICK_CLICK_TRACK_HH
+
+#include "audio.hh"
+#include "render_buffer.hh"
+
+#include <boost/noncopyable.hpp>
+
+
+/*
+ * pre-rendered click track. emphasized and normal clicks are rendered at unit gain into
+ * separate stems, which are mixed during playback, so that the volume of each sound can
+ * still be changed without rendering the track again
+ */
+struct ClickTrack
+  : boost::noncopyable
+{
+    ClickTrack(framepos_t length, unsigned int version)
+      : version(version)
+      , emphasis(length)
+      , normal(length)
+    {
+    }
+
+    framepos_t length() const { return emphasis.length(); }
+    bool file_backed() const { return emphasis.file_backed(); }
+    bool locked() const { return emphasis.locked() && normal.locked(); }
+
+    // timeline version of the metronome this track was rendered for,
+    // see MetronomeMap::timeline_version()
+    unsigned int version;
+
+    RenderBuffer emphasis;
+    RenderBuffer normal;
+};
+
+
+#endif // KLICK_CLICK_TRACK_HH
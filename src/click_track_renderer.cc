@@ -0,0 +1,182 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "click_track_renderer.hh"
+#include "audio_interface_memory.hh"
+#include "metronome_map.hh"
+#include "render_buffer.hh"
+#include "click_track.hh"
+
+#include <stdexcept>
+#include <algorithm>
+
+#include "util/string.hh"
+#include "main.hh"
+
+
+nframes_t const ClickTrackRenderer::BUFFER_SIZE;
+
+
+ClickTrackRenderer::ClickTrackRenderer(nframes_t samplerate)
+  : _samplerate(samplerate)
+  , _serial(0)
+  , _quit(false)
+{
+    _thread = std::thread(&ClickTrackRenderer::run, this);
+}
+
+
+ClickTrackRenderer::~ClickTrackRenderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+        // abandon whatever is being rendered right now
+        _serial++;
+    }
+    _cond.notify_one();
+    _thread.join();
+}
+
+
+void ClickTrackRenderer::render(Job const & job)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job.reset(new Job(job));
+        _result.reset();
+        _serial++;
+    }
+    _cond.notify_one();
+}
+
+
+void ClickTrackRenderer::cancel()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _job.reset();
+    _result.reset();
+    _serial++;
+}
+
+
+bool ClickTrackRenderer::poll(Result & result)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_result) {
+        return false;
+    }
+
+    result = *_result;
+    _result.reset();
+    return true;
+}
+
+
+void ClickTrackRenderer::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (;;) {
+        _cond.wait(lock, [this]{ return _quit || _job; });
+        if (_quit) {
+            return;
+        }
+
+        std::unique_ptr<Job> job(std::move(_job));
+        unsigned int serial = _serial;
+
+        lock.unlock();
+
+        Result r;
+        try {
+            r.track = render_track(*job, serial);
+        }
+        catch (std::runtime_error const & e) {
+            r.error = das::make_string() << "can't render click track: " << e.what();
+        }
+
+        lock.lock();
+
+        // only keep the result if no other job has been queued in the meantime
+        if (serial == _serial && (r.track || !r.error.empty())) {
+            _result.reset(new Result(r));
+        }
+    }
+}
+
+
+std::shared_ptr<ClickTrack> ClickTrackRenderer::render_track(Job const & job, unsigned int serial)
+{
+    std::shared_ptr<ClickTrack> track;
+
+    if (!render_stem(job, serial, true, track) || !render_stem(job, serial, false, track)) {
+        return std::shared_ptr<ClickTrack>();
+    }
+
+    logv << "rendered click track: " << track->length() << " frames"
+         << (track->file_backed() ? " (file-backed)" : "") << std::endl;
+
+    return track;
+}
+
+
+bool ClickTrackRenderer::render_stem(Job const & job, unsigned int serial, bool emphasis,
+                                     std::shared_ptr<ClickTrack> & track)
+{
+    // render offline, using the same sounds and settings as the realtime metronome.
+    // both sounds are played in each pass, so choke groups and voice stealing work the
+    // same way, but only one of them is heard. (the quietest voice is chosen by its gain,
+    // which makes a difference only if the metronome runs out of voices)
+    AudioInterfaceMemory audio(_samplerate, job.voices);
+    audio.set_steal_policy(job.steal_policy);
+
+    audio.samples().set({ { 0, job.emphasis }, { 1, job.normal } });
+    audio.samples().set_gain(0, emphasis ? 1.0f : 0.0f);
+    audio.samples().set_gain(1, emphasis ? 0.0f : 1.0f);
+
+    MetronomeMap metro(audio,
+                       job.map,
+                       job.tempo_multiplier,
+                       false,
+                       job.preroll,
+                       job.start_label);
+    metro.set_sound(0, 1);
+    metro.set_choke(job.choke);
+
+    if (!track) {
+        nframes_t tail = 0;
+        for (AudioChunkConstPtr const & chunk : { job.emphasis, job.normal }) {
+            if (chunk) {
+                tail = std::max(tail, chunk->length());
+            }
+        }
+        // leave room for the last click to ring out
+        track.reset(new ClickTrack(metro.total_frames() + tail, job.version));
+    }
+
+    RenderBuffer & stem = emphasis ? track->emphasis : track->normal;
+
+    audio.set_processor(&metro);
+    metro.start();
+
+    for (framepos_t f = 0; f < stem.length(); f += BUFFER_SIZE) {
+        if (_serial.load(std::memory_order_relaxed) != serial) {
+            // superseded by a newer job
+            return false;
+        }
+        audio.process(stem.data() + f, static_cast<nframes_t>(std::min<framepos_t>(BUFFER_SIZE, stem.length() - f)));
+    }
+
+    audio.set_processor(NULL);
+    return true;
+}
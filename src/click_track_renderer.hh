@@ -0,0 +1,101 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_CLICK_TRACK_RENDERER_HH
+#define KLICK_CLICK_TRACK_RENDERER_HH
+
+#include "audio.hh"
+#include "audio_chunk.hh"
+#include "audio_interface.hh"
+#include "tempomap.hh"
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <boost/noncopyable.hpp>
+
+
+struct ClickTrack;
+
+
+/*
+ * renders tempomaps into click tracks in a separate thread, so that long tempomaps
+ * don't hold up the main loop or the osc thread
+ */
+class ClickTrackRenderer
+  : boost::noncopyable
+{
+  public:
+
+    // everything the click track depends on, so the renderer doesn't have to look at
+    // klick's state while it's running
+    struct Job {
+        TempoMapConstPtr map;
+        float tempo_multiplier;
+        int preroll;
+        std::string start_label;
+        bool choke;
+        std::size_t voices;
+        AudioInterface::StealPolicy steal_policy;
+        AudioChunkConstPtr emphasis;
+        AudioChunkConstPtr normal;
+        // passed on to the click track
+        unsigned int version;
+    };
+
+    struct Result {
+        std::shared_ptr<ClickTrack> track;
+        // empty if the track was rendered successfully
+        std::string error;
+    };
+
+    ClickTrackRenderer(nframes_t samplerate);
+    ~ClickTrackRenderer();
+
+    // render a new click track. any job that's still queued or being rendered is
+    // abandoned, only the result of the most recent one is ever returned
+    void render(Job const & job);
+    // abandon the current job, if any
+    void cancel();
+
+    // get the finished click track. returns false if there is none
+    bool poll(Result & result);
+
+  private:
+
+    static nframes_t const BUFFER_SIZE = 1024;
+
+    void run();
+    // NULL if the job was abandoned while rendering
+    std::shared_ptr<ClickTrack> render_track(Job const & job, unsigned int serial);
+    // render the clicks that use one of the sounds into a stem of the track, which is
+    // allocated by the first call. false if the job was abandoned
+    bool render_stem(Job const & job, unsigned int serial, bool emphasis, std::shared_ptr<ClickTrack> & track);
+
+    nframes_t _samplerate;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::unique_ptr<Job> _job;
+    std::unique_ptr<Result> _result;
+
+    // incremented by each call to render() or cancel()
+    std::atomic<unsigned int> _serial;
+
+    bool _quit;
+    std::thread _thread;
+};
+
+
+#endif // KLICK_CLICK_TRACK_RENDERER_HH
@@ -14,6 +14,8 @@
 #include "audio_interface_jack.hh"
 #include "audio_interface_sndfile.hh"
 #include "audio_chunk.hh"
+#include "audio_mix.hh"
+#include "sample_cache.hh"
 
 #ifdef ENABLE_OSC
   #include "osc_handler.hh"
@@ -21,11 +23,18 @@
 #ifdef ENABLE_TERMINAL
   #include "terminal_handler.hh"
 #endif
+#ifdef ENABLE_INOTIFY
+  #include "tempomap_watcher.hh"
+#endif
 
 #include "tempomap.hh"
 #include "metronome_map.hh"
 #include "metronome_jack.hh"
 #include "metronome_simple.hh"
+#include "click_track.hh"
+#include "sample_loader.hh"
+#include "click_track_renderer.hh"
+#include "position.hh"
 
 #include <string>
 #include <iostream>
@@ -36,6 +45,7 @@
 
 #include "util/debug.hh"
 #include "util/string.hh"
+#include "util/lexical_cast.hh"
 #include "util/logstream.hh"
 #include "util/garbage_collector.hh"
 
@@ -48,6 +58,8 @@ Klick::Klick(int argc, char *argv[])
     _options->parse(argc, argv);
     logv.enable(_options->verbose);
 
+    logv << "mixing kernels: " << audio_mix::implementation() << std::endl;
+
     // determine client name
     if (_options->client_name.empty()) {
         _options->client_name = "klick";
@@ -57,15 +69,61 @@ Klick::Klick(int argc, char *argv[])
         load_tempomap();
     }
 
+    if (!_options->compile_filename.empty()) {
+        compile_tempomap();
+        throw Exit(EXIT_SUCCESS);
+    }
+
     if (_options->output_filename.empty()) {
         setup_jack();
     } else {
         setup_sndfile();
     }
 
-    load_samples();
+    if (_map) {
+        cache_timeline();
+    }
+
+    std::string cache_dir = SampleCache::default_directory();
+    if (!cache_dir.empty()) {
+        logv << "sample cache directory: " << cache_dir << std::endl;
+    }
+    _sample_cache.reset(new SampleCache(_audio->samplerate(), SampleCache::DEFAULT_MAX_BYTES, cache_dir));
+
+    _audio->samples().set_gain(SAMPLE_EMPHASIS, _options->volume_emphasis);
+    _audio->samples().set_gain(SAMPLE_NORMAL, _options->volume_normal);
+    // start quickly with the fastest converter, and switch to the chosen quality once
+    // the sounds have been converted again in the background. if nothing needs to be
+    // resampled, the quality makes no difference and the sounds are only loaded once
+    std::string emphasis, normal;
+    std::tie(emphasis, normal) = sample_filenames(_options->click_sample, _options->emphasis_mode);
+
+    bool upgrade = _options->output_filename.empty()
+                && _options->resample_quality < AudioChunk::QUALITY_FASTEST
+                && (_sample_cache->converts(emphasis, _options->pitch_emphasis) ||
+                    _sample_cache->converts(normal, _options->pitch_normal));
+
+    load_samples(upgrade);
+
+    if (_options->output_filename.empty()) {
+        _renderer.reset(new ClickTrackRenderer(_audio->samplerate()));
+    }
+
     load_metronome();
 
+    if (_options->output_filename.empty()) {
+        // from now on, samples are loaded without blocking the caller
+        _loader.reset(new SampleLoader(*_sample_cache, _audio->samplerate()));
+
+        if (upgrade) {
+            load_samples();
+        }
+    }
+
+    if (_options->output_filename.empty()) {
+        watch_tempomap();
+    }
+
 #ifdef ENABLE_OSC
     if (_options->use_osc) {
         // yuck!
@@ -89,7 +147,8 @@ Klick::~Klick()
 
 void Klick::setup_jack()
 {
-    std::unique_ptr<AudioInterfaceJack> audio(new AudioInterfaceJack(_options->client_name));
+    std::unique_ptr<AudioInterfaceJack> audio(new AudioInterfaceJack(_options->client_name, _options->voices));
+    audio->set_steal_policy(_options->steal_policy);
 
     logv << "jack client name: " << audio->client_name() << std::endl;
 
@@ -114,7 +173,8 @@ void Klick::setup_jack()
 
 void Klick::setup_sndfile()
 {
-    _audio.reset(new AudioInterfaceSndfile(_options->output_filename, _options->output_samplerate));
+    _audio.reset(new AudioInterfaceSndfile(_options->output_filename, _options->output_samplerate, _options->voices));
+    _audio->set_steal_policy(_options->steal_policy);
 
     logv << "output filename: " << _options->output_filename << std::endl;
 }
@@ -145,12 +205,38 @@ void Klick::load_tempomap()
         }
     }
 
-    if (!_options->output_filename.empty() && _map->entries().back().bars == -1) {
+    if (!_options->output_filename.empty() && _map->infinite()) {
         throw std::runtime_error("can't export tempo map of infinite length");
     }
 }
 
 
+void Klick::compile_tempomap()
+{
+    Position pos(_map, _options->output_samplerate, 1.0f);
+    _map->set_timeline(pos.timeline());
+    _map->write_binary(_options->compile_filename);
+
+    logv << "compiled tempo map to '" << _options->compile_filename << "'" << std::endl;
+}
+
+
+void Klick::cache_timeline()
+{
+    // calculate the timeline once and store it in the cache, so the next time this
+    // tempomap is loaded at the same samplerate, Position doesn't have to
+    if (_map->cache_filename().empty() || _map->timeline(_audio->samplerate())) {
+        return;
+    }
+
+    Position pos(_map, _audio->samplerate(), 1.0f);
+    _map->set_timeline(pos.timeline());
+    _map->update_cache();
+
+    logv << "updated tempo map cache '" << _map->cache_filename() << "'" << std::endl;
+}
+
+
 std::tuple<std::string, std::string> Klick::sample_filenames(int n, Options::EmphasisMode emphasis_mode)
 {
     std::string emphasis, normal;
@@ -199,30 +285,14 @@ std::tuple<std::string, std::string> Klick::sample_filenames(int n, Options::Emp
 }
 
 
-AudioChunkPtr Klick::load_sample(std::string const & filename, float volume, float pitch)
+AudioChunkConstPtr Klick::load_sample(std::string const & filename, float pitch, AudioChunk::Quality quality)
 {
-    AudioChunkPtr p;
-
-    if (!filename.empty()) {
-        p.reset(new AudioChunk(filename, _audio->samplerate()));
-    } else {
-        p.reset(new AudioChunk(_audio->samplerate()));
-    }
-    _gc->manage(p);
-
-    if (volume != 1.0f) {
-        p->adjust_volume(volume);
-    }
-
-    if (pitch != 1.0f) {
-        p->adjust_pitch(pitch);
-    }
-
-    return p;
+    // files are only loaded and converted again if nothing matching is cached
+    return _sample_cache->get(filename, pitch, quality);
 }
 
 
-void Klick::load_samples()
+void Klick::load_samples(bool fast)
 {
     std::string emphasis, normal;
     std::tie(emphasis, normal) = sample_filenames(_options->click_sample, _options->emphasis_mode);
@@ -231,8 +301,58 @@ void Klick::load_samples()
          << "  emphasis: " << emphasis << "\n"
          << "  normal:   " << normal << std::endl;
 
-    _click_emphasis = load_sample(emphasis, _options->volume_emphasis, _options->pitch_emphasis);
-    _click_normal = load_sample(normal, _options->volume_normal, _options->pitch_normal);
+    AudioChunk::Quality quality = fast ? AudioChunk::QUALITY_FASTEST : _options->resample_quality;
+
+    if (_loader) {
+        SampleLoader::Job job = { emphasis, normal, _options->pitch_emphasis, _options->pitch_normal, quality, false };
+        _loader->load(job);
+        return;
+    }
+
+    _audio->samples().set({ { SAMPLE_EMPHASIS, load_sample(emphasis, _options->pitch_emphasis, quality) },
+                            { SAMPLE_NORMAL, load_sample(normal, _options->pitch_normal, quality) } });
+
+    update_click_track();
+}
+
+
+void Klick::finish_loading_samples()
+{
+    SampleLoader::Result r;
+    bool loaded = false;
+
+    while (_loader->poll(r)) {
+        if (!r.error_emphasis.empty()) {
+            std::cerr << r.error_emphasis << std::endl;
+            if (r.job.custom && _options->click_filename_emphasis == r.job.emphasis) {
+                _options->click_filename_emphasis = "";
+            }
+        }
+        if (!r.error_normal.empty()) {
+            std::cerr << r.error_normal << std::endl;
+            if (r.job.custom && _options->click_filename_normal == r.job.normal) {
+                _options->click_filename_normal = "";
+            }
+        }
+
+        // both sounds change at the same time
+        _audio->samples().set({ { SAMPLE_EMPHASIS, r.emphasis }, { SAMPLE_NORMAL, r.normal } });
+        loaded = true;
+
+        logv << "loaded samples '" << r.job.emphasis << "', '" << r.job.normal << "' at "
+             << AudioChunk::quality_name(r.job.quality) << " quality" << std::endl;
+
+#ifdef ENABLE_OSC
+        if (_osc && r.job.custom) {
+            _osc->sound_loaded(r.job.emphasis, r.job.normal,
+                               r.error_emphasis.empty(), r.error_normal.empty());
+        }
+#endif
+    }
+
+    if (loaded) {
+        update_click_track();
+    }
 }
 
 
@@ -244,7 +364,6 @@ void Klick::set_sound(int n)
     _options->click_sample = n;
 
     load_samples();
-    _metro->set_sound(_click_emphasis, _click_normal);
 }
 
 
@@ -258,27 +377,32 @@ void Klick::set_sound_custom(std::string const & emphasis, std::string const & n
          << "  emphasis: " << emphasis << "\n"
          << "  normal:   " << normal << std::endl;
 
+    if (_loader) {
+        SampleLoader::Job job = { emphasis, normal, _options->pitch_emphasis, _options->pitch_normal,
+                                  _options->resample_quality, true };
+        _loader->load(job);
+        return;
+    }
+
     try {
-        _click_emphasis = load_sample(emphasis, _options->volume_emphasis, _options->pitch_emphasis);
+        _audio->samples().set(SAMPLE_EMPHASIS, load_sample(emphasis, _options->pitch_emphasis, _options->resample_quality));
     }
     catch (std::runtime_error const & e) {
         std::cerr << e.what() << std::endl;
-        _click_emphasis.reset(new AudioChunk(_audio->samplerate()));
-        _gc->manage(_click_emphasis);
+        _audio->samples().set(SAMPLE_EMPHASIS, std::make_shared<AudioChunk>(_audio->samplerate()));
         _options->click_filename_emphasis = "";
     }
 
     try {
-        _click_normal = load_sample(normal, _options->volume_normal, _options->pitch_normal);
+        _audio->samples().set(SAMPLE_NORMAL, load_sample(normal, _options->pitch_normal, _options->resample_quality));
     }
     catch (std::runtime_error const & e) {
         std::cerr << e.what() << std::endl;
-        _click_normal.reset(new AudioChunk(_audio->samplerate()));
-        _gc->manage(_click_normal);
+        _audio->samples().set(SAMPLE_NORMAL, std::make_shared<AudioChunk>(_audio->samplerate()));
         _options->click_filename_normal = "";
     }
 
-    _metro->set_sound(_click_emphasis, _click_normal);
+    update_click_track();
 }
 
 
@@ -291,8 +415,21 @@ void Klick::set_sound_volume(float emphasis, float normal)
     _options->volume_emphasis = emphasis;
     _options->volume_normal = normal;
 
+    // voices that are already playing follow the new gain, and so does the click track
+    _audio->samples().set_gain(SAMPLE_EMPHASIS, emphasis);
+    _audio->samples().set_gain(SAMPLE_NORMAL, normal);
+}
+
+
+void Klick::set_resample_quality(AudioChunk::Quality quality)
+{
+    if (quality == _options->resample_quality) {
+        return;
+    }
+
+    _options->resample_quality = quality;
+
     load_samples();
-    _metro->set_sound(_click_emphasis, _click_normal);
 }
 
 
@@ -306,7 +443,6 @@ void Klick::set_sound_pitch(float emphasis, float normal)
     _options->pitch_normal = normal;
 
     load_samples();
-    _metro->set_sound(_click_emphasis, _click_normal);
 }
 
 
@@ -319,8 +455,6 @@ void Klick::set_metronome(Options::MetronomeType type)
 
 void Klick::load_metronome()
 {
-    using namespace std::placeholders;
-
     Metronome * m = NULL;
 
     switch (_options->type) {
@@ -337,25 +471,49 @@ void Klick::load_metronome()
                              _options->tempo_multiplier,
                              _options->transport_enabled,
                              _options->preroll,
-                             _options->start_label);
+                             _options->start_label,
+                             _options->lookahead);
         break;
     }
 
-    // store metronome in shared_ptr with custom deleter
-    _metro.reset(m);
-    _gc->manage(_metro);
+    std::shared_ptr<Metronome> metro(m);
+
+    // set up the new metronome completely before the audio thread gets to see it
+    metro->set_sound(SAMPLE_EMPHASIS, SAMPLE_NORMAL);
+    metro->set_choke(_options->choke);
 
-    _metro->set_sound(_click_emphasis, _click_normal);
-    _audio->set_process_callback(std::bind(&Metronome::process_callback, _metro, _1, _2));
+    auto mm = std::dynamic_pointer_cast<MetronomeMap>(metro);
+    if (mm && !_options->loop.empty()) {
+        try {
+            apply_loop(*mm, _options->loop);
+        } catch (std::runtime_error const & e) {
+            std::cerr << "can't loop '" << _options->loop << "': " << e.what() << std::endl;
+            _options->loop.clear();
+        }
+    }
+
+    // the new metronome plays clicks in realtime until its own click track is ready
+    drop_click_track();
+
+    // switch to the new metronome at the next period boundary
+    _audio->set_processor(metro.get());
+
+    if (_metro) {
+        retire(_metro);
+    }
+    _metro = metro;
+
+    if (use_click_track()) {
+        render_click_track();
+    }
 
     if (_options->transport_master) {
-        auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
         auto a = dynamic_cast<AudioInterfaceTransport*>(&*_audio);
 
-        // register timebase callback if supported by both the metronome and the audio backend
-        if (m && a) {
+        // become timebase master if supported by both the metronome and the audio backend
+        if (a && std::dynamic_pointer_cast<MetronomeMap>(_metro)) {
             try {
-                a->set_timebase_callback(std::bind(&Metronome::timebase_callback, m, _1));
+                a->set_timebase_master(true);
             } catch (AudioInterface::AudioError const & e) {
                 std::cerr << e.what() << std::endl;
             }
@@ -364,15 +522,359 @@ void Klick::load_metronome()
 }
 
 
+bool Klick::use_click_track() const
+{
+    if (!_options->prerender || _options->type != Options::METRONOME_TYPE_MAP) {
+        return false;
+    }
+
+    // infinite tempo maps can't be rendered, and the file export renders offline anyway.
+    // as transport master, the tempo map position is still needed for the timebase info.
+    // loops are played by the scheduler
+    return !_map->infinite()
+        && _options->output_filename.empty()
+        && !_options->transport_master
+        && _options->loop.empty();
+}
+
+
+void Klick::render_click_track()
+{
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    if (!_renderer || !m) {
+        return;
+    }
+
+    // the sounds and settings the realtime metronome uses right now
+    SampleBank & samples = _audio->samples();
+
+    ClickTrackRenderer::Job job = {
+        _map,
+        _options->tempo_multiplier,
+        _options->preroll,
+        _options->start_label,
+        _options->choke,
+        _options->voices,
+        _options->steal_policy,
+        samples.chunk(SAMPLE_EMPHASIS),
+        samples.chunk(SAMPLE_NORMAL),
+        m->timeline_version()
+    };
+
+    _renderer->render(job);
+}
+
+
+void Klick::update_click_track()
+{
+    // re-render with the new sounds, without restarting the metronome
+    if (use_click_track() && std::dynamic_pointer_cast<MetronomeMap>(_metro)) {
+        render_click_track();
+    }
+}
+
+
+void Klick::drop_click_track()
+{
+    if (_renderer) {
+        _renderer->cancel();
+    }
+
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    if (m) {
+        m->set_click_track(NULL);
+    }
+
+    if (_click_track) {
+        retire(_click_track);
+        _click_track.reset();
+    }
+}
+
+
+void Klick::finish_rendering()
+{
+    ClickTrackRenderer::Result r;
+
+    if (!_renderer || !_renderer->poll(r)) {
+        return;
+    }
+
+    if (!r.error.empty()) {
+        std::cerr << r.error << std::endl;
+        return;
+    }
+
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    if (!m || r.track->version != m->timeline_version()) {
+        // the timeline has changed again while rendering
+        return;
+    }
+
+    if (!r.track->locked()) {
+        std::cerr << "can't lock click track in memory, playback may drop out when it's paged out" << std::endl;
+    }
+
+    m->set_click_track(r.track.get());
+
+    if (_click_track) {
+        retire(_click_track);
+    }
+    _click_track = r.track;
+}
+
+
+void Klick::retire(std::shared_ptr<void> p)
+{
+    // the audio thread may still be using the object until the current period is over
+    AudioInterface *a = _audio.get();
+    std::uint64_t n = a->periods();
+    _gc->manage(p, [a, n]{ return a->periods() >= n + 2; });
+}
+
+
 void Klick::set_tempomap_filename(std::string const & filename)
 {
     _options->filename = filename;
     load_tempomap();
+    cache_timeline();
 
     load_metronome();
+    watch_tempomap();
+}
+
+
+void Klick::insert_tempomap_entry(std::size_t n, TempoMap::Entry const & e)
+{
+    if (n > _map->size()) {
+        throw std::runtime_error(das::make_string() << "no entry " << n << " in tempo map");
+    }
+
+    auto map = std::make_shared<TempoMap>(*_map);
+    edit_tempomap(map, map->insert(n, e));
+}
+
+
+void Klick::remove_tempomap_entry(std::size_t n)
+{
+    if (n >= _map->size()) {
+        throw std::runtime_error(das::make_string() << "no entry " << n << " in tempo map");
+    }
+    if (_map->size() == 1) {
+        throw std::runtime_error("can't remove the only entry in tempo map");
+    }
+
+    auto map = std::make_shared<TempoMap>(*_map);
+    edit_tempomap(map, map->remove(n));
+}
+
+
+void Klick::replace_tempomap_entry(std::size_t n, TempoMap::Entry const & e)
+{
+    if (n >= _map->size()) {
+        throw std::runtime_error(das::make_string() << "no entry " << n << " in tempo map");
+    }
+
+    auto map = std::make_shared<TempoMap>(*_map);
+    edit_tempomap(map, map->replace(n, e));
+}
+
+
+void Klick::edit_tempomap(TempoMapPtr map, TempoMap::Diff const & diff)
+{
+    if (_options->start_label.length() && !map->entry(_options->start_label)) {
+        throw std::runtime_error(das::make_string()
+                    << "label '" << _options->start_label << "' is needed as start label");
+    }
+
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+
+    if (m) {
+        // keep playing, only the positions following the edit are recalculated
+        m->set_tempomap(map, diff);
+        map->set_timeline(m->timeline());
+    }
+
+    _map = map;
+
+    if (m) {
+        // the old click track is played until the metronome switches to the edited tempomap,
+        // and realtime clicks after that until the new one has been rendered in the background
+        if (use_click_track()) {
+            render_click_track();
+        } else {
+            // the tempomap may be infinite now
+            drop_click_track();
+        }
+    }
 }
 
 
+void Klick::locate_tempomap(int bar, int beat)
+{
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    if (!m) {
+        return;
+    }
+
+    framepos_t frame;
+    if (!m->bar_frame(bar - 1, beat - 1, frame)) {
+        throw std::runtime_error(das::make_string()
+                    << "no beat " << beat << " in bar " << bar << " of tempo map");
+    }
+    seek_tempomap(*m, frame);
+}
+
+
+void Klick::locate_tempomap(std::string const & label, int bar, int beat)
+{
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    if (!m) {
+        return;
+    }
+
+    framepos_t frame;
+    if (!m->label_frame(label, bar - 1, beat - 1, frame)) {
+        throw std::runtime_error(das::make_string()
+                    << "no beat " << beat << " in bar " << bar << " of label '" << label << "'");
+    }
+    seek_tempomap(*m, frame);
+}
+
+
+int Klick::tempomap_bar() const
+{
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    return m ? m->current_bar() + 1 : 0;
+}
+
+
+// bars [first, end) of one end of a loop region, given as bar number or label
+static void loop_bars(MetronomeMap const & m, std::string const & s, int & first, int & end)
+{
+    if (!s.empty() && s.find_first_not_of("0123456789") == std::string::npos) {
+        int bar = das::lexical_cast<int>(s, std::runtime_error("invalid bar number"));
+        if (bar < 1) {
+            throw std::runtime_error("invalid bar number");
+        }
+        first = bar - 1;
+        end = bar;
+    }
+    else if (!m.label_bars(s, first, end)) {
+        throw std::runtime_error(das::make_string() << "label '" << s << "' not found in tempo map");
+    }
+}
+
+
+void Klick::apply_loop(MetronomeMap & m, std::string const & loop)
+{
+    std::size_t comma = loop.find(',');
+
+    int first, end, unused;
+    loop_bars(m, loop.substr(0, comma), first, unused);
+    loop_bars(m, comma != std::string::npos ? loop.substr(comma + 1) : loop.substr(0, comma), unused, end);
+
+    if (end <= first) {
+        throw std::runtime_error("loop must end after it starts");
+    }
+    if (!m.set_loop(first, end)) {
+        throw std::runtime_error(das::make_string()
+                    << "no bars " << first + 1 << " to " << end << " in tempo map");
+    }
+}
+
+
+void Klick::set_tempomap_loop(std::string const & loop)
+{
+    if (!loop.empty() && _options->transport_enabled) {
+        throw std::runtime_error("can't loop while following jack transport");
+    }
+
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+
+    if (m) {
+        if (loop.empty()) {
+            m->clear_loop();
+        } else {
+            apply_loop(*m, loop);
+        }
+    }
+
+    _options->loop = loop;
+
+    if (m) {
+        // the click track can't loop, and is only used without one
+        if (use_click_track()) {
+            if (!_click_track) {
+                render_click_track();
+            }
+        } else {
+            drop_click_track();
+        }
+    }
+}
+
+
+void Klick::seek_tempomap(MetronomeMap & m, framepos_t frame)
+{
+    auto a = dynamic_cast<AudioInterfaceTransport*>(&*_audio);
+
+    if (_options->transport_enabled && a) {
+        // the metronome follows jack transport, move that instead
+        a->set_frame(static_cast<nframes_t>(frame));
+    } else {
+        m.seek(frame);
+    }
+}
+
+
+void Klick::watch_tempomap()
+{
+#ifdef ENABLE_INOTIFY
+    _watcher.reset();
+
+    if (_options->watch_map && !_options->filename.empty()) {
+        _watcher.reset(new TempoMapWatcher(_options->filename));
+        logv << "watching tempo map file '" << _options->filename << "'" << std::endl;
+    }
+#endif
+}
+
+
+#ifdef ENABLE_INOTIFY
+void Klick::reload_tempomap()
+{
+    TempoMap::Diff diff;
+
+    try {
+        TempoMapPtr map = _watcher->poll();
+        if (!map) {
+            return;
+        }
+
+        diff = TempoMap::diff(*_map, *map);
+        if (diff.empty()) {
+            return;
+        }
+
+        edit_tempomap(map, diff);
+    }
+    catch (std::runtime_error const & e) {
+        std::cerr << "can't reload tempo map, keeping the previous one: " << e.what() << std::endl;
+        return;
+    }
+
+    logv << "reloaded tempo map, " << diff.old_end - diff.begin << " entries replaced by "
+         << diff.new_end - diff.begin << " at entry " << diff.begin << std::endl;
+
+    // the watcher has updated the cache, but without the timeline
+    if (_map->timeline(_audio->samplerate())) {
+        _map->update_cache();
+    }
+}
+#endif
+
+
 void Klick::set_tempomap_preroll(int bars)
 {
     _options->preroll = bars;
@@ -382,8 +884,20 @@ void Klick::set_tempomap_preroll(int bars)
 
 void Klick::set_tempomap_multiplier(float mult)
 {
+    if (mult <= 0.0f) {
+        throw std::runtime_error("tempo multiplier must be greater than zero");
+    }
+
     _options->tempo_multiplier = mult;
-    load_metronome();
+
+    auto m = std::dynamic_pointer_cast<MetronomeMap>(_metro);
+    if (m) {
+        // keep playing, at the same bar and beat. the old click track keeps playing until
+        // the metronome has moved to the new timeline, and realtime clicks until the new
+        // one is rendered
+        m->set_tempo_multiplier(mult);
+        update_click_track();
+    }
 }
 
 
@@ -424,7 +938,14 @@ void Klick::run_jack()
         ::timespec ts = { 0, 10000000 };
         ::nanosleep(&ts, NULL);
 
+        // keep osc messages out while the main loop is at work
+        std::lock_guard<std::mutex> lock(_mutex);
+
         _gc->collect();
+        _audio->samples().collect();
+
+        finish_loading_samples();
+        finish_rendering();
 
 #ifdef ENABLE_TERMINAL
         if (_term) {
@@ -432,6 +953,12 @@ void Klick::run_jack()
         }
 #endif
 
+#ifdef ENABLE_INOTIFY
+        if (_watcher) {
+            reload_tempomap();
+        }
+#endif
+
 #ifdef ENABLE_OSC
         if (_osc) {
             _osc->update();
@@ -462,7 +989,7 @@ void Klick::run_sndfile()
 
     m->start();
     while (m->current_frame() < m->total_frames() && !_quit) {
-        a->process(std::min(BUFFER_SIZE, m->total_frames() - m->current_frame()));
+        a->process(std::min<framepos_t>(BUFFER_SIZE, m->total_frames() - m->current_frame()));
     }
 }
 
@@ -16,17 +16,24 @@
 #include <csignal>
 #include <memory>
 #include <tuple>
+#include <mutex>
 #include <boost/noncopyable.hpp>
 
 #include "audio.hh"
 #include "options.hh"
+#include "tempomap.hh"
 
 
 class AudioInterface;
-class TempoMap;
 class Metronome;
+class MetronomeMap;
+struct ClickTrack;
 class OSCHandler;
 class TerminalHandler;
+class TempoMapWatcher;
+class SampleCache;
+class SampleLoader;
+class ClickTrackRenderer;
 namespace das { class garbage_collector; }
 
 
@@ -41,6 +48,10 @@ class Klick
     void run();
     void signal_quit();
 
+    // the main loop and the osc thread both change klick's state. each of them holds
+    // this mutex while doing so
+    std::mutex & mutex() { return _mutex; }
+
     std::shared_ptr<Metronome> metronome() const { return _metro; }
 
     void set_metronome(Options::MetronomeType type);
@@ -49,6 +60,7 @@ class Klick
     void set_sound_custom(std::string const &, std::string const &);
     void set_sound_volume(float, float);
     void set_sound_pitch(float, float);
+    void set_resample_quality(AudioChunk::Quality quality);
 
     int sound() const {
         return _options->click_sample;
@@ -62,11 +74,31 @@ class Klick
     std::tuple<float, float> sound_pitch() const {
         return std::make_tuple(_options->pitch_emphasis, _options->pitch_normal);
     }
+    AudioChunk::Quality resample_quality() const {
+        return _options->resample_quality;
+    }
 
     void set_tempomap_filename(std::string const & filename);
     void set_tempomap_preroll(int bars);
     void set_tempomap_multiplier(float mult);
 
+    // edit the tempomap while playing, without reloading it. entries are numbered from zero
+    void insert_tempomap_entry(std::size_t n, TempoMap::Entry const & e);
+    void remove_tempomap_entry(std::size_t n);
+    void replace_tempomap_entry(std::size_t n, TempoMap::Entry const & e);
+
+    // continue playback at a bar and beat, counted from one from the start of playback,
+    // or from the start of the entry with the given label
+    void locate_tempomap(int bar, int beat);
+    void locate_tempomap(std::string const & label, int bar, int beat);
+    // bar currently being played, counted from one
+    int tempomap_bar() const;
+    // play part of the tempomap repeatedly, given as START[,END] where each is a bar number
+    // (counting from one) or a label. an empty string stops looping
+    void set_tempomap_loop(std::string const & loop);
+    std::string const & tempomap_loop() const { return _options->loop; }
+
+    TempoMapConstPtr tempomap() const { return _map; }
     std::string const & tempomap_filename() const { return _options->filename; }
     int tempomap_preroll() const { return _options->preroll; }
     float tempomap_multiplier() const { return _options->tempo_multiplier; }
@@ -77,11 +109,45 @@ class Klick
     void setup_jack();
     void setup_sndfile();
     void load_tempomap();
-    void load_samples();
+    // write the tempomap to the file given by --compile-map
+    void compile_tempomap();
+    // add a timeline for the current samplerate to the tempomap's cache file
+    void cache_timeline();
+    // load the click sounds, in the background once klick is running.
+    // if fast is true, the fastest samplerate converter is used
+    void load_samples(bool fast = false);
+    // publish sounds that have been loaded in the background.
+    // called from the main loop, with the mutex held
+    void finish_loading_samples();
     void load_metronome();
+    // switch to an edited copy of the tempomap
+    void edit_tempomap(TempoMapPtr map, TempoMap::Diff const & diff);
+    // watch the tempomap file if requested, and switch to the new version when it changes
+    void watch_tempomap();
+#ifdef ENABLE_INOTIFY
+    void reload_tempomap();
+#endif
+    // move the metronome or jack transport to a frame of the tempomap
+    void seek_tempomap(MetronomeMap & m, framepos_t frame);
+    // set the metronome's loop, throws if there's no such part of the tempomap
+    void apply_loop(MetronomeMap & m, std::string const & loop);
+
+    // render the tempo map into a click track in the background, and let the metronome
+    // play that once it's finished
+    bool use_click_track() const;
+    void render_click_track();
+    void update_click_track();
+    // go back to scheduling clicks in realtime
+    void drop_click_track();
+    // publish a click track that has been rendered in the background.
+    // called from the main loop, with the mutex held
+    void finish_rendering();
+
+    // free an object once the audio thread is guaranteed to be done with it
+    void retire(std::shared_ptr<void> p);
 
     std::tuple<std::string, std::string> sample_filenames(int n, Options::EmphasisMode emphasis_mode);
-    AudioChunkPtr load_sample(std::string const & filename, float volume, float pitch);
+    AudioChunkConstPtr load_sample(std::string const & filename, float pitch, AudioChunk::Quality quality);
 
     void run_jack();
     void run_sndfile();
@@ -91,16 +157,28 @@ class Klick
     std::unique_ptr<das::garbage_collector> _gc;
 
     std::unique_ptr<AudioInterface> _audio;
+    std::unique_ptr<SampleCache> _sample_cache;
+    std::unique_ptr<SampleLoader> _loader;
+    std::unique_ptr<ClickTrackRenderer> _renderer;
 
-    AudioChunkPtr _click_emphasis;
-    AudioChunkPtr _click_normal;
+    // sample bank slots used for the click sounds
+    enum {
+        SAMPLE_EMPHASIS,
+        SAMPLE_NORMAL
+    };
 
     std::shared_ptr<TempoMap> _map;
 
     std::unique_ptr<OSCHandler> _osc;
     std::unique_ptr<TerminalHandler> _term;
+#ifdef ENABLE_INOTIFY
+    std::unique_ptr<TempoMapWatcher> _watcher;
+#endif
 
     std::shared_ptr<Metronome> _metro;
+    std::shared_ptr<ClickTrack> _click_track;
+
+    std::mutex _mutex;
 
     volatile std::sig_atomic_t _quit;
 };
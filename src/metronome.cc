@@ -17,7 +17,10 @@
 
 Metronome::Metronome(AudioInterface & audio)
   : _audio(audio)
+  , _click_emphasis(0)
+  , _click_normal(0)
   , _active(false)
+  , _choke(false)
 {
 }
 
@@ -29,11 +32,11 @@ void Metronome::set_active(bool b)
         do_stop();
     }
 
-    _active = b;
+    _active.store(b, std::memory_order_release);
 }
 
 
-void Metronome::set_sound(AudioChunkConstPtr emphasis, AudioChunkConstPtr normal)
+void Metronome::set_sound(SampleBank::Handle emphasis, SampleBank::Handle normal)
 {
     _click_emphasis = emphasis;
     _click_normal = normal;
@@ -42,10 +45,9 @@ void Metronome::set_sound(AudioChunkConstPtr emphasis, AudioChunkConstPtr normal
 
 void Metronome::play_click(bool emphasis, nframes_t offset, float volume)
 {
-    ASSERT(_click_emphasis);
-    ASSERT(_click_normal);
+    SampleBank::Handle click = emphasis ? _click_emphasis : _click_normal;
 
-    AudioChunkConstPtr click = emphasis ? _click_emphasis : _click_normal;
-
-    _audio.play(click, offset, volume);
+    _audio.play(click, offset, volume,
+                emphasis ? VOICE_EMPHASIS : VOICE_NORMAL,
+                _choke ? CHOKE_GROUP_CLICKS : 0);
 }
@@ -16,6 +16,7 @@
 #include "audio_chunk.hh"
 #include "main.hh"
 
+#include <atomic>
 #include <boost/noncopyable.hpp>
 
 
@@ -23,41 +24,54 @@
  * abstract metronome base class
  */
 class Metronome
-  : boost::noncopyable
+  : public AudioInterface::Processor
+  , boost::noncopyable
 {
   public:
 
     Metronome(AudioInterface & audio);
     virtual ~Metronome() { }
 
-    void set_sound(AudioChunkConstPtr emphasis, AudioChunkConstPtr normal);
+    // set the sample bank slots containing the sounds to be played
+    void set_sound(SampleBank::Handle emphasis, SampleBank::Handle normal);
+
+    // if enabled, each click cuts off the previous one
+    void set_choke(bool b) { _choke = b; }
 
     void set_active(bool b);
     void start() { set_active(true); }
     void stop() { set_active(false); }
 
-    bool active() const { return _active; }
+    bool active() const { return _active.load(std::memory_order_acquire); }
 
     virtual void do_start() { }
     virtual void do_stop() { }
 
-    virtual void process_callback(sample_t *, nframes_t) REALTIME = 0;
+    virtual void process_callback(sample_t *, nframes_t, AudioInterface::TransportState const &) REALTIME = 0;
     virtual void timebase_callback(position_t *) REALTIME { }
 
     virtual bool running() const = 0;
 
   protected:
 
-    void play_click(bool emphasis, nframes_t offset, float volume = 1.0f);
+    void play_click(bool emphasis, nframes_t offset, float volume = 1.0f) REALTIME;
 
     AudioInterface & _audio;
 
-    AudioChunkConstPtr _click_emphasis;
-    AudioChunkConstPtr _click_normal;
+    SampleBank::Handle _click_emphasis;
+    SampleBank::Handle _click_normal;
 
   private:
 
-    bool _active;
+    // voice types and choke group used for clicks
+    enum {
+        VOICE_EMPHASIS = 1,
+        VOICE_NORMAL = 2,
+        CHOKE_GROUP_CLICKS = 1
+    };
+
+    std::atomic<bool> _active;
+    bool _choke;
 };
 
 
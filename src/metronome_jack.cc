@@ -21,7 +21,7 @@
 
 MetronomeJack::MetronomeJack(AudioInterfaceJack & audio)
   : Metronome(audio)
-  , _audio(audio)
+  , _samplerate(audio.samplerate())
   , _last_click_frame(0)
 {
 }
@@ -32,13 +32,14 @@ MetronomeJack::~MetronomeJack()
 }
 
 
-void MetronomeJack::process_callback(sample_t * /*buffer*/, nframes_t nframes)
+void MetronomeJack::process_callback(sample_t * /*buffer*/, nframes_t nframes,
+                                     AudioInterface::TransportState const & transport)
 {
-    if (!active() || !_audio.transport_rolling()) {
+    if (!active() || !transport.rolling) {
         return;
     }
 
-    jack_position_t pos = _audio.position();
+    jack_position_t const & pos = transport.position;
 
     if (!(pos.valid & JackPositionBBT)) {
         // not much we can do
@@ -53,13 +54,13 @@ void MetronomeJack::process_callback(sample_t * /*buffer*/, nframes_t nframes)
     ASSERT(pos.tick >= 0 && pos.tick < pos.ticks_per_beat);
 
     // convert BBT position to a frame number in this period
-    double frames_per_beat = _audio.samplerate() * 60.0 / pos.beats_per_minute;
+    double frames_per_beat = _samplerate * 60.0 / pos.beats_per_minute;
     nframes_t offset = static_cast<nframes_t>(frames_per_beat * (1.0 - (pos.tick / pos.ticks_per_beat)));
     bool emphasis;
 
     // avoid playing the same click twice due to rounding errors
-    if (_last_click_frame && (pos.frame >= _last_click_frame) &&
-        (pos.frame < _last_click_frame + MIN_FRAMES_DIFF)) {
+    if (_last_click_frame && (transport.frame >= _last_click_frame) &&
+        (transport.frame < _last_click_frame + MIN_FRAMES_DIFF)) {
         return;
     }
 
@@ -74,14 +75,14 @@ void MetronomeJack::process_callback(sample_t * /*buffer*/, nframes_t nframes)
             emphasis = true;
         }
 
-        _last_click_frame = pos.frame;
+        _last_click_frame = transport.frame;
     }
     else if (offset < nframes) {
         // click starts somewhere during this period. since pos is the position at the start
         // of the period, the click played is actually at "pos + 1"
         emphasis = (pos.beat == static_cast<int>(pos.beats_per_bar));
 
-        _last_click_frame = pos.frame + offset;
+        _last_click_frame = transport.frame + offset;
     }
     else {
         // no click in this period
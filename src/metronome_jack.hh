@@ -30,14 +30,14 @@ class MetronomeJack
         return true;
     }
 
-    virtual void process_callback(sample_t *, nframes_t);
+    virtual void process_callback(sample_t *, nframes_t, AudioInterface::TransportState const &);
 
   private:
     static nframes_t const MIN_FRAMES_DIFF = 64;
 
-    AudioInterfaceJack & _audio;
+    nframes_t _samplerate;
 
-    nframes_t _last_click_frame;
+    framepos_t _last_click_frame;
 };
 
 
@@ -11,41 +11,84 @@
 
 #include "metronome_map.hh"
 #include "options.hh"
-#include "audio_interface_jack.hh"
 #include "audio_chunk.hh"
+#include "audio_mix.hh"
+#include "click_track.hh"
 #include "tempomap.hh"
 
+#include <algorithm>
+
 #include <jack/jack.h>
 #include <jack/transport.h>
 
 #include "util/debug.hh"
 
 
+namespace {
+
+// mix a stem of the click track, with the gain changing by step per frame
+void mix_stem(sample_t *buffer, sample_t const *stem, nframes_t n, float gain, float step) REALTIME
+{
+    if (step == 0.0f) {
+        audio_mix::mix(buffer, stem, n, gain);
+    } else {
+        audio_mix::mix_ramp(buffer, stem, n, gain, step);
+    }
+}
+
+}
+
+
 MetronomeMap::MetronomeMap(
     AudioInterface & audio,
     TempoMapConstPtr tempomap,
     float tempo_multiplier,
     bool transport,
     int preroll,
-    std::string const & start_label
+    std::string const & start_label,
+    float lookahead
 )
   : Metronome(audio)
   , _frame(0)
+  , _playback_frame(0)
   , _pos(tempomap, audio.samplerate(), tempo_multiplier)
+  , _start_label(start_label)
+  , _preroll(preroll)
+  , _loop_first(-1)
+  , _loop_end(-1)
+  , _timeline_version(0)
   , _transport_enabled(transport)
+  , _restart(false)
+  , _start_frame(0)
+  , _late_frame(0)
+  , _catching_up(false)
+  , _have_current(false)
+  , _end(false)
+  , _click_track(NULL)
+  , _version(0)
+  , _mixing_track(false)
+  , _track_gain_emphasis(0.0f)
+  , _track_gain_normal(0.0f)
+  , _track_step_emphasis(0.0f)
+  , _track_step_normal(0.0f)
 {
     ASSERT(tempomap);
     ASSERT(tempomap->size() > 0);
     ASSERT(tempo_multiplier > 0.0f);
 
     // set start label
-    if (!start_label.empty()) {
-        _pos.set_start_label(start_label);
+    if (!_start_label.empty()) {
+        _pos.set_start_label(_start_label);
     }
     // add preroll
-    if (preroll != Options::PREROLL_NONE) {
-        _pos.add_preroll(preroll);
+    if (_preroll != Options::PREROLL_NONE) {
+        _pos.add_preroll(_preroll);
     }
+
+    // offline backends can't wait for another thread, so they calculate ticks on demand
+    _scheduler.reset(new TickScheduler(_pos, audio.samplerate(),
+                                       static_cast<nframes_t>(lookahead * audio.samplerate()),
+                                       audio.is_realtime()));
 }
 
 
@@ -56,8 +99,16 @@ MetronomeMap::~MetronomeMap()
 
 void MetronomeMap::do_start()
 {
-    _pos.locate(0);
-    _frame = 0;
+    _start_frame = 0;
+    if (_loop_first != -1) {
+        bar_frame(_loop_first, 0, _start_frame);
+    }
+
+    _scheduler->relocate(_start_frame);
+    _restart = true;
+
+    // give the scheduler a chance to queue the first ticks before playback starts
+    _scheduler->wait_ready(1.0f);
 }
 
 
@@ -69,124 +120,399 @@ void MetronomeMap::do_stop()
 bool MetronomeMap::running() const
 {
     // if transport is enabled, we never quit, even at the end of the tempomap
-    return _transport_enabled ? true : !_pos.end();
+    if (_transport_enabled) {
+        return true;
+    }
+
+    // the click track may still be ringing out after the end of the tempomap
+    ClickTrack const *track = _click_track.load(std::memory_order_acquire);
+    return !_end || (track && current_frame() < track->length());
+}
+
+
+framepos_t MetronomeMap::current_frame() const
+{
+    return _playback_frame.load(std::memory_order_acquire);
+}
+
+
+framepos_t MetronomeMap::total_frames() const
+{
+    return static_cast<framepos_t>(_pos.total_frames());
+}
+
+
+void MetronomeMap::set_click_track(ClickTrack const * track)
+{
+    _click_track.store(track, std::memory_order_release);
+}
+
+
+void MetronomeMap::set_tempomap(TempoMapConstPtr tempomap, TempoMap::Diff const & diff)
+{
+    ASSERT(tempomap);
+    ASSERT(tempomap->size() > 0);
+
+    Position pos(_pos, tempomap, diff);
+
+    if (!_start_label.empty()) {
+        pos.set_start_label(_start_label);
+    }
+    if (_preroll != Options::PREROLL_NONE) {
+        pos.add_preroll(_preroll);
+    }
+
+    _pos = pos;
+    // any click track is out of date, even if the edit only changed later bars
+    _timeline_version++;
+
+    TickScheduler::LoopPtr loop = make_loop(_pos);
+    if (!loop) {
+        // the looped bars are gone
+        _loop_first = _loop_end = -1;
+    }
+
+    _scheduler->set_position(_pos, diff, _timeline_version, loop);
+}
+
+
+void MetronomeMap::set_tempo_multiplier(float mult)
+{
+    ASSERT(mult > 0.0f);
+
+    // the timeline is shared, only the scale changes
+    _pos.set_multiplier(mult);
+    _timeline_version++;
+
+    TempoMap::Diff unchanged = { 0, 0, 0 };
+    _scheduler->set_position(_pos, unchanged, _timeline_version, make_loop(_pos));
 }
 
 
-nframes_t MetronomeMap::current_frame() const
+bool MetronomeMap::set_loop(int first, int end)
 {
-    return _frame;
+    int prev_first = _loop_first, prev_end = _loop_end;
+    _loop_first = first;
+    _loop_end = end;
+
+    TickScheduler::LoopPtr loop = make_loop(_pos);
+    if (!loop) {
+        _loop_first = prev_first;
+        _loop_end = prev_end;
+        return false;
+    }
+
+    TempoMap::Diff unchanged = { 0, 0, 0 };
+    _scheduler->set_position(_pos, unchanged, _timeline_version, loop);
+    return true;
 }
 
 
-nframes_t MetronomeMap::total_frames() const
+void MetronomeMap::clear_loop()
 {
-    return static_cast<nframes_t>(_pos.total_frames());
+    _loop_first = _loop_end = -1;
+
+    TempoMap::Diff unchanged = { 0, 0, 0 };
+    _scheduler->set_position(_pos, unchanged, _timeline_version);
 }
 
 
-void MetronomeMap::process_callback(sample_t * /*buffer*/, nframes_t nframes)
+TickScheduler::LoopPtr MetronomeMap::make_loop(Position const & pos) const
+{
+    if (_loop_first < 0 || _loop_end <= _loop_first || _loop_end > pos.total_bars()) {
+        return TickScheduler::LoopPtr();
+    }
+
+    Position start(pos);
+    if (!start.locate_bar(_loop_first, 0)) {
+        return TickScheduler::LoopPtr();
+    }
+
+    // the end of the loop is the start of the next bar, or the end of the tempomap
+    int end_beat = pos.total_beats();
+    Position::float_frames_t end = pos.total_frames();
+    Position next(pos);
+    if (next.locate_bar(_loop_end, 0)) {
+        end_beat = next.beat_total();
+        end = next.frame();
+    }
+
+    return std::make_shared<TickScheduler::Loop>(TickScheduler::Loop { start, end_beat, end });
+}
+
+
+bool MetronomeMap::bar_frame(int bar, int beat, framepos_t & frame) const
+{
+    Position pos(_pos);
+    if (!pos.locate_bar(bar, beat)) {
+        return false;
+    }
+    // the tick at this beat is rounded down the same way
+    frame = static_cast<framepos_t>(pos.frame());
+    return true;
+}
+
+
+bool MetronomeMap::label_frame(std::string const & label, int bar, int beat, framepos_t & frame) const
+{
+    Position pos(_pos);
+    if (!pos.locate_label(label, bar, beat)) {
+        return false;
+    }
+    frame = static_cast<framepos_t>(pos.frame());
+    return true;
+}
+
+
+int MetronomeMap::current_bar() const
+{
+    Position pos(_pos);
+    pos.locate(current_frame());
+    return pos.bar_total();
+}
+
+
+void MetronomeMap::seek(framepos_t frame)
+{
+    _scheduler->seek(frame);
+}
+
+
+void MetronomeMap::process_callback(sample_t *buffer, nframes_t nframes,
+                                    AudioInterface::TransportState const & transport)
+{
+    process(buffer, nframes, transport);
+
+    _playback_frame.store(_frame, std::memory_order_release);
+}
+
+
+void MetronomeMap::process(sample_t *buffer, nframes_t nframes,
+                           AudioInterface::TransportState const & transport)
 {
     if (!active()) {
         return;
     }
 
-    AudioInterfaceJack *a = dynamic_cast<AudioInterfaceJack *>(&_audio);
+    if (_restart.exchange(false, std::memory_order_acquire)) {
+        // the scheduler has already been relocated by do_start()
+        _frame = _start_frame;
+        _late_frame = _start_frame;
+        _catching_up = true;
+        _mixing_track = false;
+        _have_current = false;
+        _end = false;
+    }
 
-    if (_transport_enabled && a) {
-        if (!a->transport_rolling()) return;
+    framepos_t seek;
+    if (_scheduler->seek_ready(seek)) {
+        // the first tick after the seek is already queued, and plays at its exact frame
+        _frame = seek;
+        _catching_up = false;
+        _mixing_track = false;
+        _have_current = false;
+        _end = false;
+    }
 
-        nframes_t p = a->frame();
+    ClickTrack const *track = _click_track.load(std::memory_order_acquire);
+
+    if (!track || track->version != _version) {
+        // no click track for the timeline we're in, e.g. after a tempo change
+        _mixing_track = false;
+    }
+
+    if (_transport_enabled && transport.available) {
+        framepos_t p = transport.frame;
 
         if (p != _frame) {
-            // position changed since last period, need to relocate
+            // position changed since last period, need to relocate.
+            // this is also done while transport is stopped, so the scheduler is ready when it starts
             _frame = p;
-            _pos.locate(p);
+            relocate(p);
         }
+
+        if (!transport.rolling) return;
     } else {
-        if (_pos.end()) return;
+        // the click track may still be ringing out after the end of the tempomap
+        if (_end.load() && !(track && _frame < track->length())) return;
     }
 
-    // check if a new tick starts in this period
-    if (_frame + nframes > _pos.next_frame()) {
-        // move position to next tick.
-        // loop just in case two beats are less than one period apart (which we don't really handle)
-        do { _pos.advance(); } while (_pos.frame() < _frame);
+    framepos_t end = _frame + nframes;
+    _scheduler->progress(end);
 
-        Position::Tick tick = _pos.tick();
+    // frames at the start of this period that come before frame 0 of the tempomap,
+    // after jumping back to the start of it
+    framepos_t lead = 0;
 
-        //std::cout << tick.frame << ": " << (tick.type == TempoMap::BEAT_EMPHASIS) << std::endl;
+    // the click track follows the sample gains, ramping to new ones over the period
+    float gain_emphasis = _audio.samples().gain(_click_emphasis) * _audio.volume();
+    float gain_normal = _audio.samples().gain(_click_normal) * _audio.volume();
+    if (!_mixing_track) {
+        _track_gain_emphasis = gain_emphasis;
+        _track_gain_normal = gain_normal;
+    }
+    _track_step_emphasis = (gain_emphasis - _track_gain_emphasis) / nframes;
+    _track_step_normal = (gain_normal - _track_gain_normal) / nframes;
+
+    // offset into this period from which the click track is mixed, up to the next jump
+    nframes_t mix_from = _mixing_track ? 0 : nframes;
+
+    // play all ticks that start in this period, each at its exact offset
+    TickScheduler::Event const *e;
+    while ((e = _scheduler->front()) && e->frame < end) {
+        if (e->jump) {
+            // continue in the edited tempomap, at the same offset into this period.
+            // with transport, the next period relocates to the transport frame instead
+            framepos_t offset = lead + (e->tick.frame > _frame ? e->tick.frame - _frame : 0);
+
+            if (_mixing_track) {
+                mix_track(*track, buffer, mix_from, static_cast<nframes_t>(offset), lead);
+
+                if (e->version != _version) {
+                    // the click track doesn't match the new timeline. jumps are at the next
+                    // tick, so the track is cut off where its next click would have started
+                    _mixing_track = false;
+                }
+            }
+            _version = e->version;
+            mix_from = _mixing_track ? static_cast<nframes_t>(offset) : nframes;
+
+            if (e->jump_to >= offset) {
+                _frame = e->jump_to - offset;
+                lead = 0;
+            } else {
+                _frame = 0;
+                lead = offset - e->jump_to;
+            }
+            end = _frame + nframes - lead;
+            _catching_up = false;
+            _have_current = false;
+            _scheduler->pop();
+            _scheduler->progress(end);
+            continue;
+        }
+
+        _current = *e;
+        _have_current = true;
+        _scheduler->pop();
+
+        // apart from jumps, the version only changes right after relocating, when the
+        // click track isn't being mixed
+        _version = _current.version;
 
-        if (tick.type != TempoMap::BEAT_SILENT) {
-            // start playing the click sample
-            play_click(tick.type == TempoMap::BEAT_EMPHASIS, tick.frame - _frame, tick.volume);
+        if (_current.end) {
+            _end = true;
+            break;
         }
+
+        Position::Tick const & tick = _current.tick;
+
+        // skip ticks that were due before the start of the period, unless they were
+        // only queued too late after relocating
+        bool late = _catching_up && tick.frame >= _late_frame && tick.frame < _frame;
+
+        if (_current.play && (tick.frame >= _frame || late) && tick.type != TempoMap::BEAT_SILENT) {
+            nframes_t offset = late ? 0 : static_cast<nframes_t>(lead + tick.frame - _frame);
+
+            if (track && track->version == _version && !late) {
+                // the click track takes over from here. clicks that are already playing
+                // aren't mixed again from the track
+                if (!_mixing_track) {
+                    _mixing_track = true;
+                    mix_from = offset;
+                }
+            } else {
+                // start playing the click sample
+                play_click(tick.type == TempoMap::BEAT_EMPHASIS, offset, tick.volume);
+            }
+        }
+    }
+
+    if (_mixing_track) {
+        mix_track(*track, buffer, mix_from, nframes, lead);
     }
 
-    _frame += nframes;
+    _track_gain_emphasis = gain_emphasis;
+    _track_gain_normal = gain_normal;
+
+    if (e || _end) {
+        // the scheduler has caught up with playback
+        _catching_up = false;
+    }
+
+    _frame = end;
+}
+
+
+void MetronomeMap::mix_track(ClickTrack const & track, sample_t *buffer, nframes_t from, nframes_t to, framepos_t lead)
+{
+    // nothing to play before frame 0
+    from = static_cast<nframes_t>(std::max<framepos_t>(from, lead));
+    framepos_t f = _frame + from - lead;
+
+    if (from >= to || f >= track.length()) {
+        return;
+    }
+
+    nframes_t n = static_cast<nframes_t>(std::min<framepos_t>(to - from, track.length() - f));
+
+    mix_stem(buffer + from, track.emphasis.data() + f, n, _track_gain_emphasis + _track_step_emphasis * from, _track_step_emphasis);
+    mix_stem(buffer + from, track.normal.data() + f, n, _track_gain_normal + _track_step_normal * from, _track_step_normal);
+}
+
+
+void MetronomeMap::relocate(framepos_t frame)
+{
+    _scheduler->relocate(frame);
+    _late_frame = frame;
+    _catching_up = true;
+    _mixing_track = false;
+    _have_current = false;
+    _end = false;
 }
 
 
 void MetronomeMap::timebase_callback(position_t *p)
 {
-    if (p->frame != _frame) {
+    if (p->frame != static_cast<nframes_t>(_frame)) {
         // current position doesn't match jack transport frame.
-        // assume we're wrong and jack is right ;)
-        _frame = p->frame;
-        _pos.locate(p->frame);
+        // assume we're wrong and jack is right ;) this is a relocation, so the frame
+        // is taken literally
+        _frame = unwrap_frame(_frame, p->frame);
+        relocate(_frame);
     }
 
-    if (_pos.end()) {
-        // end of tempomap, no valid position
+    if (_end || !_have_current) {
+        // end of tempomap, or the scheduler hasn't caught up yet. no valid position
         p->valid = (jack_position_bits_t)0;
         return;
     }
 
-    // get the current tempomap entry
-    TempoMap::Entry const & e = _pos.current_entry();
+    // the current tick, as calculated by the scheduler
+    TickScheduler::Event const & e = _current;
 
     p->valid = JackPositionBBT;
 
-    p->bar = _pos.bar_total() + 1;  // jack counts from 1
-    p->beat = _pos.beat() + 1;
+    p->bar = e.bar_total + 1;  // jack counts from 1
+    p->beat = e.beat + 1;
 
     // get the distance from current to next beat, and calculate current tick
-    double d = _pos.dist_to_next();
+    double d = e.dist;
     if (d) {
-        p->tick = (_frame - _pos.frame()) * TICKS_PER_BEAT / d;
+        p->tick = (_frame - e.frame) * TICKS_PER_BEAT / d;
     } else {
         p->tick = 0;
     }
 
-    p->bar_start_tick = (_pos.beat_total() - _pos.beat()) * TICKS_PER_BEAT;
+    p->bar_start_tick = (e.beat_total - e.beat) * TICKS_PER_BEAT;
     p->beats_per_bar = e.beats;
     p->beat_type = e.denom;
     p->ticks_per_beat = TICKS_PER_BEAT;
-
-    // NOTE: jack's notion of bpm is different from ours.
-    // all tempo values are converted from "quarters per minute"
-    // to the actual beats per minute used by jack
-    if (e.tempo && (!e.tempo2 || d == 0.0)) {
-        // constant tempo, and/or start of tempomap
-        p->beats_per_minute = e.tempo * e.denom / 4.0;
-    }
-    else if (e.tempo2 && _pos.end()) {
-        // end of tempomap, last entry had tempo change, so use tempo2
-        p->beats_per_minute = e.tempo2 * e.denom / 4.0;
-    }
-    else if (e.tempo2) {
-        // tempo change, use average tempo for this beat
-        p->beats_per_minute = _audio.samplerate() * 60.0 / d;
-    }
-    else if (!e.tempo) {
-        // tempo per beat
-        std::size_t n = _pos.bar() * e.beats + _pos.beat();
-        p->beats_per_minute = e.tempi[n];
-    }
+    p->beats_per_minute = e.bpm;
 
     if (p->tick >= TICKS_PER_BEAT) {
-        // already at the next beat, but _pos.advance() won't be called until the next process cycle.
-        // adjust bar, beat and tick accordingly
+        // already at the next beat, but the next event won't be taken from the queue until the
+        // next process cycle. adjust bar, beat and tick accordingly
         p->tick -= TICKS_PER_BEAT;
         p->bar_start_tick += e.beats * TICKS_PER_BEAT;
         p->beat++;
@@ -15,8 +15,13 @@
 #include "metronome.hh"
 #include "tempomap.hh"
 #include "position.hh"
+#include "tick_scheduler.hh"
 
 #include <string>
+#include <memory>
+#include <atomic>
+
+struct ClickTrack;
 
 /*
  * plays a click track using a predefined tempomap
@@ -25,13 +30,17 @@ class MetronomeMap
   : public Metronome
 {
   public:
+    // how far ahead of playback ticks are scheduled, in seconds
+    static float constexpr DEFAULT_LOOKAHEAD = 0.25f;
+
     MetronomeMap(
         AudioInterface & audio,
         TempoMapConstPtr tempomap,
         float tempo_multiplier,
         bool transport,
         int preroll,
-        std::string const & start_label
+        std::string const & start_label,
+        float lookahead = DEFAULT_LOOKAHEAD
     );
     virtual ~MetronomeMap();
 
@@ -40,22 +49,117 @@ class MetronomeMap
 
     bool running() const;
 
-    nframes_t current_frame() const;
-    nframes_t total_frames() const;
+    framepos_t current_frame() const;
+    framepos_t total_frames() const;
+
+    // play a pre-rendered click track instead of scheduling clicks in realtime, or go back
+    // to realtime if track is NULL. the previous track is used until the end of the current
+    // period, and must be kept alive until then. the stems of the track are mixed with the
+    // gains of the sample bank slots set by set_sound().
+    // the track is only played while playback is in the timeline version it was rendered
+    // for. after a tempo change, clicks are scheduled in realtime until a new track is set
+    void set_click_track(ClickTrack const * track) NONREALTIME;
+
+    // changes whenever the frames at which beats are played change, see set_click_track()
+    unsigned int timeline_version() const { return _timeline_version; }
+
+    // replace the tempomap by an edited copy. while playing, the switch happens at the next
+    // beat that hasn't been scheduled yet, and playback continues at the same entry, bar and beat
+    void set_tempomap(TempoMapConstPtr tempomap, TempoMap::Diff const & diff) NONREALTIME;
+
+    // change the tempo multiplier, at the next beat that hasn't been scheduled yet.
+    // playback continues at the same bar and beat
+    void set_tempo_multiplier(float mult) NONREALTIME;
+
+    // frame at which a bar and beat is played, counted from zero from the start of playback,
+    // or from the start of the entry with the given label. false if there's no such beat
+    bool bar_frame(int bar, int beat, framepos_t & frame) const;
+    bool label_frame(std::string const & label, int bar, int beat, framepos_t & frame) const;
+
+    // continue playback at the given frame. the seek is applied at the start of a period,
+    // as soon as the ticks from there on have been scheduled
+    void seek(framepos_t frame) NONREALTIME;
+
+    // bar that is currently being played, counted from zero
+    int current_bar() const;
+
+    // play bars [first, end) repeatedly, counted from zero from the start of playback.
+    // playback continues until the end of the loop, and starts at its beginning.
+    // returns false if there are no such bars
+    bool set_loop(int first, int end) NONREALTIME;
+    void clear_loop() NONREALTIME;
+
+    // bars of the entry with the given label, see Position::label_bars()
+    bool label_bars(std::string const & label, int & first, int & end) const {
+        return _pos.label_bars(label, first, end);
+    }
+    int total_bars() const { return _pos.total_bars(); }
+
+    // start frames of all entries and beats of the tempomap
+    std::shared_ptr<TempoMap::Timeline const> timeline() const { return _pos.timeline(); }
 
-    virtual void process_callback(sample_t *, nframes_t);
+    virtual void process_callback(sample_t *, nframes_t, AudioInterface::TransportState const &);
     virtual void timebase_callback(position_t *);
 
   private:
     static int const TICKS_PER_BEAT = 1920;
 
-    // transport position
-    nframes_t _frame;
+    void process(sample_t *, nframes_t, AudioInterface::TransportState const &) REALTIME;
 
-    // position in tempomap
+    void relocate(framepos_t frame) REALTIME;
+
+    // mix the click track into offsets [from, to) of the period, at the current frame
+    void mix_track(ClickTrack const & track, sample_t *buffer, nframes_t from, nframes_t to, framepos_t lead) REALTIME;
+
+    // the loop in the given position's tempomap, NULL if there is none
+    TickScheduler::LoopPtr make_loop(Position const & pos) const;
+
+    // transport position, only used in the audio thread
+    framepos_t _frame;
+    // copy of _frame for other threads, stored at the end of each period
+    std::atomic<framepos_t> _playback_frame;
+
+    // tempomap, only used to set up the scheduler
     Position _pos;
+    std::string _start_label;
+    int _preroll;
+
+    // bars to be looped, -1 if none
+    int _loop_first;
+    int _loop_end;
+
+    // incremented by each change to the timeline
+    unsigned int _timeline_version;
 
     bool _transport_enabled;
+
+    std::unique_ptr<TickScheduler> _scheduler;
+
+    // set by do_start(), handled at the beginning of the next period
+    std::atomic<bool> _restart;
+    framepos_t _start_frame;
+
+    // after relocating, ticks from _late_frame on that the scheduler couldn't queue in
+    // time are still played, at the start of the period in which they arrive
+    framepos_t _late_frame;
+    bool _catching_up;
+
+    // the most recent event from the scheduler, and whether it's valid
+    TickScheduler::Event _current;
+    bool _have_current;
+    std::atomic<bool> _end;
+
+    // pre-rendered click track, if any
+    std::atomic<ClickTrack const *> _click_track;
+    // timeline version of the events taken from the scheduler, only used in the audio thread
+    unsigned int _version;
+    // true while the click track is played instead of scheduling clicks in realtime
+    bool _mixing_track;
+    // gains of the stems at the start of the period, and their change per frame
+    float _track_gain_emphasis;
+    float _track_gain_normal;
+    float _track_step_emphasis;
+    float _track_step_normal;
 };
 
 
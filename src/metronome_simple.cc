@@ -21,18 +21,28 @@
 
 MetronomeSimple::MetronomeSimple(AudioInterface & audio, TempoMap::Entry const * params)
   : Metronome(audio)
-  , _tempo(120.0)
-  , _tempo_increment(0.0)
-  , _tempo_start(0.0)
-  , _tempo_limit(0.0)
-  , _current_tempo(0.0)
-  , _beats(4)
-  , _denom(4)
+  , _control()
+  , _current_tempo(0.0f)
+  , _reported_tempo(0.0f)
+  , _start_serial(0)
+  , _tempo_serial(0)
+  , _tap_serial(0)
   , _frame(0)
   , _next(0)
   , _beat(0)
+  , _anchor(0)
+  , _anchor_beats(0)
+  , _interval(0.0)
+  , _prev(0)
   , _tapped(false)
 {
+    _control.tempo = 120.0f;
+    _control.meter.beats = 4;
+    _control.meter.denom = 4;
+    _meter = _control.meter;
+
+    publish();
+
     if (params) {
         set_all(*params);
     }
@@ -44,48 +54,80 @@ MetronomeSimple::~MetronomeSimple()
 }
 
 
+void MetronomeSimple::publish()
+{
+    _params.write(_control);
+}
+
+
 void MetronomeSimple::set_tempo(float tempo)
 {
-    _tempo = tempo;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _control.tempo = tempo;
     if (active()) {
-        _current_tempo = _tempo;
+        ++_control.tempo_serial;
     }
+    publish();
 }
 
 
 void MetronomeSimple::set_tempo_increment(float tempo_increment)
 {
-    _tempo_increment = tempo_increment;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _control.tempo_increment = tempo_increment;
+    publish();
 }
 
 
 void MetronomeSimple::set_tempo_start(float tempo_start)
 {
-    _tempo_start = tempo_start;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _control.tempo_start = tempo_start;
+    publish();
 }
 
 
 void MetronomeSimple::set_tempo_limit(float tempo_limit)
 {
-    _tempo_limit = tempo_limit;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _control.tempo_limit = tempo_limit;
+    publish();
 }
 
 
 void MetronomeSimple::set_meter(int beats, int denom)
 {
-    if (beats != _beats && _pattern.size()) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (beats != _control.meter.beats) {
         // TODO: handle this properly
-        _pattern.clear();
+        _control.meter.pattern_size = 0;
     }
 
-    _beats = beats;
-    _denom = denom;
+    _control.meter.beats = beats;
+    _control.meter.denom = denom;
+    publish();
 }
 
 
 void MetronomeSimple::set_pattern(TempoMap::Pattern const & pattern)
 {
-    _pattern = pattern;
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    int size = static_cast<int>(pattern.size());
+
+    if (size > MAX_PATTERN || (size && size != std::max(1, _control.meter.beats))) {
+        // can't use this pattern, fall back to the default
+        size = 0;
+    }
+
+    std::copy(pattern.begin(), pattern.begin() + size, _control.meter.pattern.begin());
+    _control.meter.pattern_size = size;
+    publish();
 }
 
 
@@ -97,28 +139,77 @@ void MetronomeSimple::set_all(TempoMap::Entry const & params)
 }
 
 
-void MetronomeSimple::do_start()
+float MetronomeSimple::tempo() const
 {
-    _beat = 0;
-    _next = 0;
-    _frame = 0;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _control.tempo;
+}
 
-    if (_tempo_increment && _tempo_start) {
-        _current_tempo = _tempo_start;
-    } else {
-        _current_tempo = _tempo;
-    }
+
+float MetronomeSimple::tempo_increment() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _control.tempo_increment;
+}
+
+
+float MetronomeSimple::tempo_start() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _control.tempo_start;
+}
+
+
+float MetronomeSimple::tempo_limit() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _control.tempo_limit;
+}
+
+
+int MetronomeSimple::beats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _control.meter.beats;
 }
 
 
-void MetronomeSimple::do_stop()
+int MetronomeSimple::denom() const
 {
-    _current_tempo = 0.0f;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _control.meter.denom;
+}
+
+
+TempoMap::Pattern MetronomeSimple::pattern() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return TempoMap::Pattern(_control.meter.pattern.begin(),
+                             _control.meter.pattern.begin() + _control.meter.pattern_size);
+}
+
+
+float MetronomeSimple::current_tempo() const
+{
+    return active() ? _reported_tempo.load(std::memory_order_relaxed) : 0.0f;
+}
+
+
+void MetronomeSimple::do_start()
+{
+    // the audio thread resets its state when it sees the new serial.
+    // this is published before the metronome becomes active
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    ++_control.start_serial;
+    publish();
 }
 
 
 void MetronomeSimple::tap(double now)
 {
+    std::lock_guard<std::mutex> lock(_mutex);
+
     if (_taps.size() && now < _taps.back()) {
         // distortion in space-time continuum
         _taps.clear();
@@ -138,11 +229,11 @@ void MetronomeSimple::tap(double now)
     );
 
     if (_taps.size() > 1) {
-        _tempo = 60.0f * (_taps.size() - 1) / (_taps.back() - _taps.front());
+        _control.tempo = 60.0f * (_taps.size() - 1) / (_taps.back() - _taps.front());
         if (active()) {
-            _current_tempo = _tempo;
-            _tapped = true;
+            ++_control.tap_serial;
         }
+        publish();
     }
 }
 
@@ -157,8 +248,49 @@ void MetronomeSimple::tap()
 }
 
 
-void MetronomeSimple::process_callback(sample_t * /*buffer*/, nframes_t nframes)
+void MetronomeSimple::process_callback(sample_t * /*buffer*/, nframes_t nframes,
+                                       AudioInterface::TransportState const & /*transport*/)
 {
+    // check the active state before picking up new parameters, so a restart
+    // published by do_start() is always seen together with the active flag
+    bool active = this->active();
+
+    _params.update();
+    Params const & p = _params.read();
+
+    if (p.start_serial != _start_serial) {
+        _start_serial = p.start_serial;
+        _tempo_serial = p.tempo_serial;
+        _tap_serial = p.tap_serial;
+
+        _beat = 0;
+        _next = 0;
+        _frame = 0;
+        _anchor = 0;
+        _anchor_beats = 0;
+        _interval = 0.0;
+        _tapped = false;
+
+        if (p.tempo_increment && p.tempo_start) {
+            _current_tempo = p.tempo_start;
+        } else {
+            _current_tempo = p.tempo;
+        }
+    }
+
+    if (p.tempo_serial != _tempo_serial) {
+        _tempo_serial = p.tempo_serial;
+        _current_tempo = p.tempo;
+    }
+
+    if (p.tap_serial != _tap_serial) {
+        _tap_serial = p.tap_serial;
+        _current_tempo = p.tempo;
+        _tapped = true;
+    }
+
+    _reported_tempo.store(_current_tempo, std::memory_order_relaxed);
+
     if (_tapped) {
         // TODO: this is crap. read user's mind instead
         nframes_t delta = static_cast<nframes_t>(TAP_DIFF * _audio.samplerate());
@@ -171,46 +303,62 @@ void MetronomeSimple::process_callback(sample_t * /*buffer*/, nframes_t nframes)
             _next = _frame;
         }
 
+        _anchor = _next;
+        _anchor_beats = 0;
+
         _tapped = false;
     }
 
-    if (!active()) {
+    if (!active) {
         return;
     }
 
     if (_frame + nframes > _next)
     {
         // offset in current period
-        nframes_t offset = _next - _frame;
+        nframes_t offset = static_cast<nframes_t>(_next - _frame);
 
-        if (_pattern.size()) {
+        if (_beat == 0) {
+            // meter and pattern changes take effect at the start of a bar
+            _meter = p.meter;
+        }
+
+        if (_meter.pattern_size) {
             // play click, user-defined pattern
-            ASSERT(static_cast<int>(_pattern.size()) == std::max(1, _beats));
-            if (_pattern[_beat] != TempoMap::BEAT_SILENT) {
-                bool emphasis = (_pattern[_beat] == TempoMap::BEAT_EMPHASIS);
+            ASSERT(_meter.pattern_size == std::max(1, _meter.beats));
+            if (_meter.pattern[_beat] != TempoMap::BEAT_SILENT) {
+                bool emphasis = (_meter.pattern[_beat] == TempoMap::BEAT_EMPHASIS);
                 play_click(emphasis, offset);
             }
         } else {
             // play click, default pattern
-            play_click(_beat == 0 && _beats > 0, offset);
+            play_click(_beat == 0 && _meter.beats > 0, offset);
         }
 
         // speed trainer
-        if (_frame && _tempo_increment) {
-            _current_tempo += _tempo_increment / std::max(_beats, 1);
-            if (_tempo_limit) {
-                _current_tempo = _tempo_increment > 0.0f ? std::min(_current_tempo, _tempo_limit)
-                                                         : std::max(_current_tempo, _tempo_limit);
-            } else if (_tempo_start) {
-                _current_tempo = _tempo_increment > 0.0f ? std::min(_current_tempo, _tempo)
-                                                         : std::max(_current_tempo, _tempo);
+        if (_frame && p.tempo_increment) {
+            _current_tempo += p.tempo_increment / std::max(_meter.beats, 1);
+            if (p.tempo_limit) {
+                _current_tempo = p.tempo_increment > 0.0f ? std::min(_current_tempo, p.tempo_limit)
+                                                          : std::max(_current_tempo, p.tempo_limit);
+            } else if (p.tempo_start) {
+                _current_tempo = p.tempo_increment > 0.0f ? std::min(_current_tempo, p.tempo)
+                                                          : std::max(_current_tempo, p.tempo);
             }
+            _reported_tempo.store(_current_tempo, std::memory_order_relaxed);
         }
 
         _prev = _next;
-        _next += static_cast<nframes_t>(_audio.samplerate() * 240.0 / (_current_tempo * _denom));
 
-        if (++_beat >= _beats) {
+        double interval = _audio.samplerate() * 240.0 / (_current_tempo * _meter.denom);
+        if (interval != _interval) {
+            _interval = interval;
+            _anchor = _next;
+            _anchor_beats = 0;
+        }
+        _next = _anchor + static_cast<framepos_t>(++_anchor_beats * _interval);
+
+        if (++_beat >= _meter.beats) {
             _beat = 0;
         }
     }
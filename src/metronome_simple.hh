@@ -15,9 +15,13 @@
 #include "audio.hh"
 #include "metronome.hh"
 #include "tempomap.hh"
+#include "util/triple_buffer.hh"
 
 #include <vector>
 #include <deque>
+#include <array>
+#include <atomic>
+#include <mutex>
 
 
 class MetronomeSimple
@@ -25,11 +29,17 @@ class MetronomeSimple
 {
   public:
 
+    // longest pattern that can be used, longer patterns are replaced by the default one
+    static int const MAX_PATTERN = 64;
+
     MetronomeSimple(AudioInterface & audio, TempoMap::Entry const * params = NULL);
     virtual ~MetronomeSimple();
 
     virtual bool running() const { return true; }
 
+    // all setters can be called from any non-realtime thread. tempo changes take effect
+    // with the next beat, meter and pattern changes at the start of the next bar
+
     void set_tempo(float);
     void set_tempo_increment(float);
     void set_tempo_start(float);
@@ -42,19 +52,20 @@ class MetronomeSimple
     void tap(double now);
     void tap();
 
-    float tempo() const { return _tempo; }
-    float tempo_increment() const { return _tempo_increment; }
-    float tempo_start() const { return _tempo_start; }
-    float tempo_limit() const { return _tempo_limit; }
-    float current_tempo() const { return _current_tempo; }
-    int beats() const { return _beats; }
-    int denom() const { return _denom; }
-    TempoMap::Pattern const & pattern() const { return _pattern; }
+    float tempo() const;
+    float tempo_increment() const;
+    float tempo_start() const;
+    float tempo_limit() const;
+    int beats() const;
+    int denom() const;
+    TempoMap::Pattern pattern() const;
+
+    // the tempo the audio thread is currently playing at
+    float current_tempo() const;
 
-    virtual void do_start();
-    virtual void do_stop();
+    virtual void do_start() NONREALTIME;
 
-    virtual void process_callback(sample_t *, nframes_t);
+    virtual void process_callback(sample_t *, nframes_t, AudioInterface::TransportState const &) REALTIME;
 
   private:
 
@@ -62,21 +73,57 @@ class MetronomeSimple
     static float constexpr MAX_TAP_AGE = 3.0f;
     static float constexpr TAP_DIFF = 0.2f;
 
-    float _tempo;
-    float _tempo_increment;
-    float _tempo_start;
-    float _tempo_limit;
+    struct Meter {
+        int beats;
+        int denom;
+        int pattern_size;   // zero if default
+        std::array<TempoMap::BeatType, MAX_PATTERN> pattern;
+    };
+
+    // everything the audio thread needs to know, copied as a whole
+    struct Params {
+        float tempo;
+        float tempo_increment;
+        float tempo_start;
+        float tempo_limit;
+        Meter meter;
+
+        // incremented to tell the audio thread to restart, to jump to the new tempo,
+        // or to resync to a tap
+        unsigned int start_serial;
+        unsigned int tempo_serial;
+        unsigned int tap_serial;
+    };
+
+    void publish() NONREALTIME;
+
+    // non-realtime side. the mutex only serializes the control threads,
+    // the audio thread never touches it
+    mutable std::mutex _mutex;
+    Params _control;
+    std::deque<double> _taps;
+
+    das::triple_buffer<Params> _params;
+
+    // realtime side
+    Meter _meter;           // meter of the current bar
     float _current_tempo;
-    int _beats;
-    int _denom;
-    TempoMap::Pattern _pattern;
+    std::atomic<float> _reported_tempo;
+
+    unsigned int _start_serial;
+    unsigned int _tempo_serial;
+    unsigned int _tap_serial;
 
-    nframes_t _frame;
-    nframes_t _next;
+    framepos_t _frame;
+    framepos_t _next;
     int _beat;
 
-    std::deque<double> _taps;
-    nframes_t _prev;
+    // beats are counted from the last tempo change, so rounding errors don't accumulate
+    framepos_t _anchor;
+    std::uint64_t _anchor_beats;
+    double _interval;
+
+    framepos_t _prev;
     bool _tapped;
 };
 
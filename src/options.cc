@@ -11,6 +11,7 @@
 
 #include "options.hh"
 #include "main.hh"
+#include "metronome_map.hh"
 
 #include <string>
 #include <iostream>
@@ -34,6 +35,7 @@ Options::Options()
   , follow_transport(false)
   , preroll(PREROLL_NONE)
   , tempo_multiplier(1.0)
+  , watch_map(false)
   , output_samplerate(48000)
   , click_sample(0)
   , emphasis_mode(EMPHASIS_MODE_NORMAL)
@@ -41,6 +43,12 @@ Options::Options()
   , volume_normal(1.0)
   , pitch_emphasis(1.0)
   , pitch_normal(1.0)
+  , resample_quality(AudioChunk::QUALITY_BEST)
+  , voices(AudioInterface::DEFAULT_VOICES)
+  , steal_policy(AudioInterface::STEAL_OLDEST)
+  , choke(false)
+  , prerender(false)
+  , lookahead(MetronomeMap::DEFAULT_LOOKAHEAD)
   , transport_enabled(false)
   , transport_master(false)
   , delay(0.0f)
@@ -62,12 +70,15 @@ void Options::print_usage()
         << "    klick [options] [bars] [meter] tempo[-tempo2/accel] [pattern]\n"
         << " OR klick [options] --tempo-map=FILENAME\n"
 #ifdef ENABLE_TERMINAL
-        << " OR klick [options] --interactive\n"
+        << " OR klick [options] --interactive [--tempo-map=FILENAME]\n"
 #endif
         << " OR klick [options] --accompany-transport\n"
         << "\n"
         << "All Options:\n"
         << "  -f, --tempo-map=FILENAME      load tempo map from file (- for stdin)\n"
+#ifdef ENABLE_INOTIFY
+        << "  -F, --watch-map               reload the tempo map file whenever it changes\n"
+#endif
         << "  -j, --accompany-transport     follow jack transport BBT info (no tempo map)\n"
         << "  -n, --client-name=NAME        set jack client name (default: klick)\n"
         << "  -p, --connect=PORT...         jack port(s) to connect to\n"
@@ -80,6 +91,8 @@ void Options::print_usage()
 #endif
         << "  -W, --output-file=FILENAME    export click track to file (wav, flac, ogg)\n"
         << "  -r, --sample-rate=SAMPLERATE  sample rate of export (default: 48000)\n"
+        << "  -m, --compile-map=FILENAME    compile tempo map into a binary file for the\n"
+        << "                                sample rate given by -r, and exit\n"
         << "  -s, --sound=NUMBER            use built-in sounds:\n"
         << "                                    0: square wave (default)\n"
         << "                                    1: sine wave\n"
@@ -90,11 +103,21 @@ void Options::print_usage()
         << "  -E, --emphasis-only           emphasize all beats\n"
         << "  -v, --volume=MULT,[MULT]      adjust playback volume (default: 1.0)\n"
         << "  -w, --pitch=MULT[,MULT]       adjust playback pitch (default: 1.0)\n"
+        << "  -q, --quality=QUALITY         samplerate converter quality for the sounds:\n"
+        << "                                best (default), medium, fastest, linear\n"
+        << "  -u, --voices=NUMBER[,POLICY]  number of clicks that can play simultaneously\n"
+        << "                                (default: 16), and which one to cut off when\n"
+        << "                                all are in use: oldest (default), quietest, type\n"
+        << "  -C, --choke                   each click cuts off the previous one\n"
+        << "  -b, --prerender               render the whole tempo map before playback\n"
+        << "  -a, --lookahead=SECONDS       schedule clicks ahead of playback (default: 0.25)\n"
         << "  -t, --transport               enable jack transport\n"
         << "  -T, --transport-master        become transport master (implies -t)\n"
         << "  -d, --start-delay=SECONDS     delay before starting playback\n"
         << "  -c, --pre-roll=BARS           pre-roll. use -c 0 for 2 beats\n"
         << "  -l, --start-label=LABEL       start playback at the given label\n"
+        << "  -g, --loop=START[,END]        play the bars from START to END repeatedly.\n"
+        << "                                each is a bar number or a label\n"
         << "  -x, --speed=MULTIPLIER        multiply tempo by the given factor\n"
         << "  -h, --help                    show this help\n"
         << "  -V, --version                 print klick version\n"
@@ -108,11 +131,12 @@ void Options::print_usage()
 void Options::parse(int argc, char *argv[])
 {
     int c;
-    char optstring[] = "+f:jn:p:Po:R:iW:r:s:S:eEv:w:tTd:c:l:x:hVL";
+    char optstring[] = "+f:Fjn:p:Po:R:iW:r:m:s:S:eEv:w:q:u:Cba:tTd:c:l:g:x:hVL";
 
 #ifdef ENABLE_GETOPT_LONG
     ::option longopts[] = {
         { "tempo-map",            required_argument,  NULL, 'f' },
+        { "watch-map",            no_argument,        NULL, 'F' },
         { "accompany-transport",  no_argument,        NULL, 'j' },
         { "client-name",          required_argument,  NULL, 'n' },
         { "connect",              required_argument,  NULL, 'p' },
@@ -121,17 +145,24 @@ void Options::parse(int argc, char *argv[])
         { "interactive",          no_argument,        NULL, 'i' },
         { "output-file",          required_argument,  NULL, 'W' },
         { "sample-rate",          required_argument,  NULL, 'r' },
+        { "compile-map",          required_argument,  NULL, 'm' },
         { "sound",                required_argument,  NULL, 's' },
         { "sound-file",           required_argument,  NULL, 'S' },
         { "no-emphasis",          no_argument,        NULL, 'e' },
         { "emphasis-only",        no_argument,        NULL, 'E' },
         { "volume",               required_argument,  NULL, 'v' },
         { "pitch",                required_argument,  NULL, 'w' },
+        { "quality",              required_argument,  NULL, 'q' },
+        { "voices",               required_argument,  NULL, 'u' },
+        { "choke",                no_argument,        NULL, 'C' },
+        { "prerender",            no_argument,        NULL, 'b' },
+        { "lookahead",            required_argument,  NULL, 'a' },
         { "transport",            no_argument,        NULL, 't' },
         { "transport-master",     no_argument,        NULL, 'T' },
         { "start-delay",          required_argument,  NULL, 'd' },
         { "pre-roll",             required_argument,  NULL, 'c' },
         { "start-label",          required_argument,  NULL, 'l' },
+        { "loop",                 required_argument,  NULL, 'g' },
         { "speed",                required_argument,  NULL, 'x' },
         { "help",                 no_argument,        NULL, 'h' },
         { "version",              no_argument,        NULL, 'V' }
@@ -156,6 +187,12 @@ void Options::parse(int argc, char *argv[])
                 filename = std::string(::optarg);
                 break;
 
+#ifdef ENABLE_INOTIFY
+            case 'F':
+                watch_map = true;
+                break;
+#endif
+
             case 'j':
                 follow_transport = true;
                 break;
@@ -203,6 +240,10 @@ void Options::parse(int argc, char *argv[])
                 output_samplerate = das::lexical_cast<nframes_t>(::optarg, InvalidArgument(c, "samplerate"));
                 break;
 
+            case 'm':
+                compile_filename = ::optarg;
+                break;
+
             case 's':
                 click_sample = das::lexical_cast<int>(::optarg, -1);
                 if (click_sample < 0 || click_sample > 3) {
@@ -261,6 +302,43 @@ void Options::parse(int argc, char *argv[])
                 }
               } break;
 
+            case 'q':
+                if (!AudioChunk::quality_from_name(::optarg, resample_quality)) {
+                    throw InvalidArgument(c, "quality");
+                }
+                break;
+
+            case 'u':
+              { std::string str(::optarg);
+                char_sep sep(",");
+                tokenizer tok(str, sep);
+                auto i = tok.begin();
+                if (i == tok.end()) throw InvalidArgument(c, "voices");
+                int n = das::lexical_cast<int>(*i, InvalidArgument(c, "voices"));
+                if (n < 1) throw InvalidArgument(c, "voices");
+                voices = n;
+                if (++i != tok.end()) {
+                    if (*i == "oldest") steal_policy = AudioInterface::STEAL_OLDEST;
+                    else if (*i == "quietest") steal_policy = AudioInterface::STEAL_QUIETEST;
+                    else if (*i == "type") steal_policy = AudioInterface::STEAL_SAME_TYPE;
+                    else throw InvalidArgument(c, "voice stealing policy");
+                    if (++i != tok.end()) throw InvalidArgument(c, "voices");
+                }
+              } break;
+
+            case 'C':
+                choke = true;
+                break;
+
+            case 'b':
+                prerender = true;
+                break;
+
+            case 'a':
+                lookahead = das::lexical_cast<float>(::optarg, InvalidArgument(c, "lookahead"));
+                if (lookahead <= 0.0f) throw InvalidArgument(c, "lookahead");
+                break;
+
             case 't':
                 transport_enabled = true;
                 break;
@@ -284,6 +362,11 @@ void Options::parse(int argc, char *argv[])
                 start_label = std::string(::optarg);
                 break;
 
+            case 'g':
+                loop = std::string(::optarg);
+                if (loop.empty()) throw InvalidArgument(c, "loop");
+                break;
+
             case 'x':
                 tempo_multiplier = das::lexical_cast<float>(::optarg, InvalidArgument(c, "tempo multiplier"));
                 if (tempo_multiplier <= 0) throw InvalidArgument(c, "tempo multiplier");
@@ -320,6 +403,18 @@ void Options::parse(int argc, char *argv[])
     if (!output_filename.empty() && filename.empty() && cmdline.empty()) {
         throw CmdlineError("need a tempo map to export to audio file");
     }
+    if (!compile_filename.empty() && filename.empty() && cmdline.empty()) {
+        throw CmdlineError("need a tempo map to compile");
+    }
+    if (watch_map && (filename == "-" || (filename.empty() && !use_osc))) {
+        throw CmdlineError("need a tempo map file to watch");
+    }
+    if (!loop.empty() && !output_filename.empty()) {
+        throw CmdlineError("can't loop when exporting to audio file");
+    }
+    if (!loop.empty() && transport_enabled) {
+        throw CmdlineError("can't loop while following jack transport");
+    }
 
     if (!use_osc) {
         if (follow_transport && (filename.length() || cmdline.length())) {
@@ -345,8 +440,12 @@ void Options::parse(int argc, char *argv[])
 
     // determine metronome type
     type = output_filename.length() ? METRONOME_TYPE_MAP :
-           interactive ? METRONOME_TYPE_SIMPLE :
+           interactive ? (filename.length() ? METRONOME_TYPE_MAP : METRONOME_TYPE_SIMPLE) :
            use_osc ? METRONOME_TYPE_SIMPLE :
            follow_transport ? METRONOME_TYPE_JACK :
            METRONOME_TYPE_MAP;
+
+    if (!loop.empty() && type != METRONOME_TYPE_MAP && !use_osc) {
+        throw CmdlineError("need a tempo map to loop");
+    }
 }
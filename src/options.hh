@@ -13,6 +13,8 @@
 #define KLICK_OPTIONS_HH
 
 #include "audio.hh"
+#include "audio_interface.hh"
+#include "audio_chunk.hh"
 
 #include <string>
 #include <vector>
@@ -58,6 +60,12 @@ class Options
     int preroll;
     std::string start_label;
     float tempo_multiplier;
+    // part of the tempomap to be played repeatedly: START[,END], each a bar number or label
+    std::string loop;
+    // write compiled tempomap to this file and exit
+    std::string compile_filename;
+    // reload the tempomap file whenever it changes
+    bool watch_map;
 
     // export settings
     std::string output_filename;
@@ -81,6 +89,18 @@ class Options
     float volume_normal;
     float pitch_emphasis;
     float pitch_normal;
+    // samplerate converter used for the sounds
+    AudioChunk::Quality resample_quality;
+
+    // voice settings
+    std::size_t voices;
+    AudioInterface::StealPolicy steal_policy;
+    bool choke;
+
+    // render finite tempo maps in advance
+    bool prerender;
+    // how far ahead ticks are scheduled, in seconds
+    float lookahead;
 
     // jack transport options
     bool transport_enabled;
@@ -18,6 +18,7 @@
 #include "metronome_jack.hh"
 #include "audio_interface_jack.hh"
 #include "tempomap.hh"
+#include "audio_chunk.hh"
 
 #include <iostream>
 #include <functional>
@@ -25,6 +26,7 @@
 
 #include "util/debug.hh"
 #include "util/logstream.hh"
+#include "util/string.hh"
 
 
 OSCHandler::OSCHandler(std::string const & port,
@@ -52,6 +54,7 @@ OSCHandler::OSCHandler(std::string const & port,
     add_method("/klick/config/set_sound", "ss", &OSCHandler::on_config_set_sound_custom);
     add_method("/klick/config/set_sound_volume", "ff", &OSCHandler::on_config_set_sound_volume);
     add_method("/klick/config/set_sound_pitch", "ff", &OSCHandler::on_config_set_sound_pitch);
+    add_method("/klick/config/set_resample_quality", "s", &OSCHandler::on_config_set_resample_quality);
     add_method("/klick/config/set_volume", "f", &OSCHandler::on_config_set_volume);
     add_method("/klick/config/connect", NULL, &OSCHandler::on_config_connect);
     add_method("/klick/config/autoconnect", "", &OSCHandler::on_config_autoconnect);
@@ -81,6 +84,21 @@ OSCHandler::OSCHandler(std::string const & port,
     add_method<MetronomeMap>("/klick/map/load_file", "s", &OSCHandler::on_map_load_file);
     add_method<MetronomeMap>("/klick/map/set_preroll", "i", &OSCHandler::on_map_set_preroll);
     add_method<MetronomeMap>("/klick/map/set_tempo_multiplier", "f", &OSCHandler::on_map_set_tempo_multiplier);
+    add_method<MetronomeMap>("/klick/map/insert_entry", "is", &OSCHandler::on_map_insert_entry);
+    add_method<MetronomeMap>("/klick/map/insert_entry", "ss", &OSCHandler::on_map_insert_entry);
+    add_method<MetronomeMap>("/klick/map/remove_entry", "i", &OSCHandler::on_map_remove_entry);
+    add_method<MetronomeMap>("/klick/map/remove_entry", "s", &OSCHandler::on_map_remove_entry);
+    add_method<MetronomeMap>("/klick/map/set_entry", "is", &OSCHandler::on_map_set_entry);
+    add_method<MetronomeMap>("/klick/map/set_entry", "ss", &OSCHandler::on_map_set_entry);
+    add_method<MetronomeMap>("/klick/map/locate", "i", &OSCHandler::on_map_locate);
+    add_method<MetronomeMap>("/klick/map/locate", "ii", &OSCHandler::on_map_locate);
+    add_method<MetronomeMap>("/klick/map/locate", "s", &OSCHandler::on_map_locate);
+    add_method<MetronomeMap>("/klick/map/locate", "si", &OSCHandler::on_map_locate);
+    add_method<MetronomeMap>("/klick/map/locate", "sii", &OSCHandler::on_map_locate);
+    add_method<MetronomeMap>("/klick/map/set_loop", "s", &OSCHandler::on_map_set_loop);
+    add_method<MetronomeMap>("/klick/map/set_loop", "ss", &OSCHandler::on_map_set_loop);
+    add_method<MetronomeMap>("/klick/map/set_loop", "ii", &OSCHandler::on_map_set_loop);
+    add_method<MetronomeMap>("/klick/map/clear_loop", "", &OSCHandler::on_map_clear_loop);
     add_method<MetronomeMap>("/klick/map/query", "", &OSCHandler::on_map_query);
     add_method<MetronomeMap>("/klick/map/query", "s", &OSCHandler::on_map_query);
 
@@ -119,6 +137,20 @@ void OSCHandler::update()
 }
 
 
+void OSCHandler::sound_loaded(std::string const & emphasis, std::string const & normal,
+                              bool emphasis_ok, bool normal_ok)
+{
+    _osc->send(_clients, "/klick/config/sound", emphasis_ok ? emphasis : "", normal_ok ? normal : "");
+
+    if (!emphasis_ok) {
+        _osc->send(_clients, "/klick/config/sound_loading_failed", emphasis);
+    }
+    if (!normal_ok) {
+        _osc->send(_clients, "/klick/config/sound_loading_failed", normal);
+    }
+}
+
+
 void OSCHandler::add_method(char const *path, char const *types, MessageHandler func)
 {
     _osc->add_method(path, types, std::bind(&OSCHandler::generic_callback,
@@ -136,6 +168,8 @@ void OSCHandler::add_method(char const *path, char const *types, MessageHandler
 
 void OSCHandler::generic_callback(MessageHandler func, Message const & msg)
 {
+    std::lock_guard<std::mutex> lock(_klick.mutex());
+
     try {
         (this->*func)(msg);
     }
@@ -148,6 +182,8 @@ void OSCHandler::generic_callback(MessageHandler func, Message const & msg)
 template <typename M>
 void OSCHandler::type_specific_callback(MessageHandler func, Message const & msg)
 {
+    std::lock_guard<std::mutex> lock(_klick.mutex());
+
     try {
         if (std::dynamic_pointer_cast<M>(metro())) {
             (this->*func)(msg);
@@ -246,22 +282,8 @@ void OSCHandler::on_config_set_sound(Message const & msg)
 
 void OSCHandler::on_config_set_sound_custom(Message const & msg)
 {
-    std::string emphasis = boost::get<std::string>(msg.args[0]);
-    std::string normal = boost::get<std::string>(msg.args[1]);
-
-    _klick.set_sound_custom(emphasis, normal);
-
-    std::string res_emphasis, res_normal;
-    std::tie(res_emphasis, res_normal) = _klick.sound_custom();
-
-    _osc->send(_clients, "/klick/config/sound", res_emphasis, res_normal);
-
-    if (res_emphasis != emphasis) {
-        _osc->send(_clients, "/klick/config/sound_loading_failed", emphasis);
-    }
-    if (res_normal != normal) {
-        _osc->send(_clients, "/klick/config/sound_loading_failed", normal);
-    }
+    // the files are loaded in the background, see sound_loaded()
+    _klick.set_sound_custom(boost::get<std::string>(msg.args[0]), boost::get<std::string>(msg.args[1]));
 }
 
 
@@ -281,6 +303,21 @@ void OSCHandler::on_config_set_sound_pitch(Message const & msg)
 }
 
 
+void OSCHandler::on_config_set_resample_quality(Message const & msg)
+{
+    std::string name = boost::get<std::string>(msg.args[0]);
+    AudioChunk::Quality quality;
+
+    if (!AudioChunk::quality_from_name(name, quality)) {
+        std::cerr << msg.path << ": invalid samplerate converter quality '" << name << "'" << std::endl;
+        return;
+    }
+
+    _klick.set_resample_quality(quality);
+    _osc->send(_clients, "/klick/config/resample_quality", std::string(AudioChunk::quality_name(_klick.resample_quality())));
+}
+
+
 void OSCHandler::on_config_set_volume(Message const & msg)
 {
     _audio.set_volume(boost::get<float>(msg.args[0]));
@@ -340,6 +377,7 @@ void OSCHandler::on_config_query(Message const & msg)
                                                    std::get<1>(_klick.sound_volume()));
     _osc->send(addr, "/klick/config/sound_pitch", std::get<0>(_klick.sound_pitch()),
                                                   std::get<1>(_klick.sound_pitch()));
+    _osc->send(addr, "/klick/config/resample_quality", std::string(AudioChunk::quality_name(_klick.resample_quality())));
     _osc->send(addr, "/klick/config/volume", _audio.volume());
 }
 
@@ -509,17 +547,129 @@ void OSCHandler::on_map_set_preroll(Message const & msg)
 
 void OSCHandler::on_map_set_tempo_multiplier(Message const & msg)
 {
-    _klick.set_tempomap_multiplier(boost::get<float>(msg.args[0]));
+    try {
+        _klick.set_tempomap_multiplier(boost::get<float>(msg.args[0]));
+    } catch (std::runtime_error const & e) {
+        std::cerr << msg.path << ": " << e.what() << std::endl;
+        return;
+    }
     _osc->send(_clients, "/klick/map/tempo_multiplier", _klick.tempomap_multiplier());
 }
 
 
+void OSCHandler::on_map_insert_entry(Message const & msg)
+{
+    try {
+        std::size_t n = map_entry_index(msg);
+        _klick.insert_tempomap_entry(n, TempoMap::parse_entry(boost::get<std::string>(msg.args[1])));
+    } catch (std::runtime_error const & e) {
+        std::cerr << msg.path << ": " << e.what() << std::endl;
+        return;
+    }
+    _osc->send(_clients, "/klick/map/entries", static_cast<int>(_klick.tempomap()->size()));
+}
+
+
+void OSCHandler::on_map_remove_entry(Message const & msg)
+{
+    try {
+        _klick.remove_tempomap_entry(map_entry_index(msg));
+    } catch (std::runtime_error const & e) {
+        std::cerr << msg.path << ": " << e.what() << std::endl;
+        return;
+    }
+    _osc->send(_clients, "/klick/map/entries", static_cast<int>(_klick.tempomap()->size()));
+}
+
+
+void OSCHandler::on_map_set_entry(Message const & msg)
+{
+    try {
+        std::size_t n = map_entry_index(msg);
+        _klick.replace_tempomap_entry(n, TempoMap::parse_entry(boost::get<std::string>(msg.args[1])));
+    } catch (std::runtime_error const & e) {
+        std::cerr << msg.path << ": " << e.what() << std::endl;
+        return;
+    }
+    _osc->send(_clients, "/klick/map/entries", static_cast<int>(_klick.tempomap()->size()));
+}
+
+
+void OSCHandler::on_map_locate(Message const & msg)
+{
+    // bar and beat default to the first one
+    std::size_t first = msg.types[0] == 's' ? 1 : 0;
+    int bar = msg.args.size() > first ? boost::get<int>(msg.args[first]) : 1;
+    int beat = msg.args.size() > first + 1 ? boost::get<int>(msg.args[first + 1]) : 1;
+
+    try {
+        if (first) {
+            _klick.locate_tempomap(boost::get<std::string>(msg.args[0]), bar, beat);
+        } else {
+            _klick.locate_tempomap(bar, beat);
+        }
+    } catch (std::runtime_error const & e) {
+        std::cerr << msg.path << ": " << e.what() << std::endl;
+    }
+}
+
+
+void OSCHandler::on_map_set_loop(Message const & msg)
+{
+    std::string loop;
+    if (msg.types == "ii") {
+        loop = das::make_string() << boost::get<int>(msg.args[0]) << "," << boost::get<int>(msg.args[1]);
+    } else {
+        loop = boost::get<std::string>(msg.args[0]);
+        if (msg.args.size() > 1) {
+            loop += "," + boost::get<std::string>(msg.args[1]);
+        }
+    }
+
+    try {
+        _klick.set_tempomap_loop(loop);
+    } catch (std::runtime_error const & e) {
+        std::cerr << msg.path << ": " << e.what() << std::endl;
+        return;
+    }
+    _osc->send(_clients, "/klick/map/loop", _klick.tempomap_loop());
+}
+
+
+void OSCHandler::on_map_clear_loop(Message const & /*msg*/)
+{
+    _klick.set_tempomap_loop("");
+    _osc->send(_clients, "/klick/map/loop", _klick.tempomap_loop());
+}
+
+
+std::size_t OSCHandler::map_entry_index(Message const & msg)
+{
+    if (msg.types[0] == 'i') {
+        int n = boost::get<int>(msg.args[0]);
+        if (n < 0) {
+            throw std::runtime_error("invalid entry index");
+        }
+        return n;
+    }
+
+    std::string const & label = boost::get<std::string>(msg.args[0]);
+    int n = _klick.tempomap()->index(label);
+    if (n == -1) {
+        throw std::runtime_error(das::make_string() << "label '" << label << "' not found in tempo map");
+    }
+    return n;
+}
+
+
 void OSCHandler::on_map_query(Message const & msg)
 {
     auto addr = optional_address(msg);
     _osc->send(addr, "/klick/map/filename", _klick.tempomap_filename());
     _osc->send(addr, "/klick/map/preroll", _klick.tempomap_preroll());
     _osc->send(addr, "/klick/map/tempo_multiplier", _klick.tempomap_multiplier());
+    _osc->send(addr, "/klick/map/entries", static_cast<int>(_klick.tempomap()->size()));
+    _osc->send(addr, "/klick/map/loop", _klick.tempomap_loop());
 }
 
 
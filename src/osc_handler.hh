@@ -35,6 +35,10 @@ class OSCHandler
     void start();
     void update();
 
+    // reply to /klick/config/set_sound ,ss once the files have been loaded
+    void sound_loaded(std::string const & emphasis, std::string const & normal,
+                      bool emphasis_ok, bool normal_ok);
+
   private:
     typedef OSCInterface::Message Message;
     typedef void (OSCHandler::*MessageHandler)(Message const &);
@@ -74,6 +78,7 @@ class OSCHandler
     void on_config_set_sound_custom(Message const &);
     void on_config_set_sound_volume(Message const &);
     void on_config_set_sound_pitch(Message const &);
+    void on_config_set_resample_quality(Message const &);
     void on_config_set_volume(Message const &);
     void on_config_connect(Message const &);
     void on_config_autoconnect(Message const &);
@@ -98,8 +103,17 @@ class OSCHandler
     void on_map_load_file(Message const &);
     void on_map_set_preroll(Message const &);
     void on_map_set_tempo_multiplier(Message const &);
+    void on_map_insert_entry(Message const &);
+    void on_map_remove_entry(Message const &);
+    void on_map_set_entry(Message const &);
+    void on_map_locate(Message const &);
+    void on_map_set_loop(Message const &);
+    void on_map_clear_loop(Message const &);
     void on_map_query(Message const &);
 
+    // index of the tempomap entry given by the first argument, either as index or label
+    std::size_t map_entry_index(Message const & msg);
+
     void on_jack_query(Message const &);
 
     void fallback(Message const &);
@@ -14,20 +14,61 @@
 
 #include <algorithm>
 #include <iterator>
-#include <numeric>
 #include <limits>
 #include <cmath>
+#include <type_traits>
 
 #include "util/debug.hh"
 
 
+std::size_t const Position::NO_INDEX;
+
+static_assert(std::is_same<Position::float_frames_t, double>::value,
+              "TempoMap::Timeline must be able to hold frame positions");
+
+
 Position::Position(TempoMapConstPtr tempomap, float_frames_t samplerate, float multiplier)
   : _tempomap(tempomap),
     _samplerate(samplerate),
-    _multiplier(multiplier)
+    _multiplier(multiplier),
+    _first(0),
+    _has_preroll(false)
 {
     reset();
-    calculate_entry_positions();
+
+    _timeline = _tempomap->timeline(_samplerate);
+    if (!_timeline) {
+        calculate_entry_positions();
+    }
+
+    update_offsets();
+}
+
+
+Position::Position(Position const & prev, TempoMapConstPtr tempomap, TempoMap::Diff const & diff)
+  : _tempomap(tempomap),
+    _samplerate(prev._samplerate),
+    _multiplier(prev._multiplier),
+    _first(0),
+    _has_preroll(false)
+{
+    ASSERT(diff.old_end <= prev._timeline->segments.size());
+    ASSERT(diff.new_end <= _tempomap->size());
+
+    reset();
+    calculate_entry_positions(prev._timeline.get(), diff.begin);
+    update_offsets();
+}
+
+
+void Position::set_multiplier(float multiplier)
+{
+    ASSERT(multiplier > 0.0f);
+
+    _multiplier = multiplier;
+
+    reset();
+    update_offsets();
 }
 
 
@@ -42,23 +83,71 @@ void Position::reset()
 }
 
 
-void Position::calculate_entry_positions()
+void Position::calculate_entry_positions(TempoMap::Timeline const *prev, std::size_t changed)
 {
-    _start_frames.clear();
-    _start_bars.clear();
-    _start_beats.clear();
+    auto t = std::make_shared<TempoMap::Timeline>();
+    t->compile(_tempomap->entries());
+    t->samplerate = _samplerate;
 
     float_frames_t frame = 0.0;
     int bar = 0;
     int beat = 0;
 
-    // calculate first frame of each tempomap entry
-    for (auto & e : _tempomap->entries()) {
-        _start_frames.push_back(frame);
-        _start_bars.push_back(bar);
-        _start_beats.push_back(beat);
+    if (prev) {
+        // nothing changes up to the start of the first changed entry
+        t->start_frames.assign(prev->start_frames.begin(), prev->start_frames.begin() + changed);
+        t->start_bars.assign(prev->start_bars.begin(), prev->start_bars.begin() + changed);
+        t->start_beats.assign(prev->start_beats.begin(), prev->start_beats.begin() + changed);
+        t->beat_index.assign(prev->beat_index.begin(), prev->beat_index.begin() + changed);
+
+        // keep the beat tables of those entries, which precede all others
+        auto i = std::find_if(prev->beat_index.begin() + changed, prev->beat_index.end(),
+                              [](std::uint64_t index) { return index != TempoMap::Timeline::NO_BEATS; });
+        std::size_t nframes = (i != prev->beat_index.end()) ? static_cast<std::size_t>(*i) : prev->beat_frames.size();
+        t->beat_frames.assign(prev->beat_frames.begin(), prev->beat_frames.begin() + nframes);
+
+        frame = prev->start_frames[changed];
+        bar = prev->start_bars[changed];
+        beat = prev->start_beats[changed];
+    }
+
+    // calculate first frame of each remaining tempomap entry
+    for (auto k = t->segments.begin() + changed; k != t->segments.end(); ++k) {
+        TempoMap::Segment const & e = *k;
+
+        t->start_frames.push_back(frame);
+        t->start_bars.push_back(bar);
+        t->start_beats.push_back(beat);
+
+        if (e.bars != -1 && e.type != TempoMap::Segment::CONSTANT) {
+            // build table of beat offsets, so seeking within this entry doesn't
+            // need to add up all previous beats
+            int nbeats = e.bars * e.beats;
+            std::size_t index = t->beat_frames.size();
+
+            t->beat_index.push_back(index);
+            t->beat_frames.push_back(0.0);
+
+            double secs = 0.0;
+            for (int n = 1; n <= nbeats; ++n) {
+                if (e.type == TempoMap::Segment::RAMP) {
+                    t->beat_frames.push_back(beat_secs(e, 0, n) * _samplerate);
+                } else {
+                    secs += 240.0 / (t->tempi[e.tempi + n - 1] * e.denom);
+                    t->beat_frames.push_back(secs * _samplerate);
+                }
+            }
+
+            frame += t->beat_frames[index + nbeats];
+        } else {
+            t->beat_index.push_back(TempoMap::Timeline::NO_BEATS);
+
+            if (e.bars != -1) {
+                frame += beat_secs(e, 0, e.bars * e.beats) * _samplerate;
+            }
+        }
+
         if (e.bars != -1) {
-            frame += frame_dist(e, 0, e.bars * e.beats);
             bar += e.bars;
             beat += e.bars * e.beats;
         } else {
@@ -70,54 +159,110 @@ void Position::calculate_entry_positions()
     }
 
     // add end of tempomap
-    _start_frames.push_back(frame);
-    _start_bars.push_back(bar);
-    _start_beats.push_back(beat);
+    t->start_frames.push_back(frame);
+    t->start_bars.push_back(bar);
+    t->start_beats.push_back(beat);
 
-//    for (std::size_t n = 0; n != _start_frames.size(); ++n) {
-//        std::cout << std::fixed << "entry " << n << " starts at frame " << _start_frames[n] << ", bar " << _start_bars[n] << ", beat " << _start_beats[n] << std::endl;
-//    }
+    _timeline = t;
 }
 
 
-void Position::set_start_label(std::string const & start_label)
+void Position::update_offsets()
 {
-    auto map = std::make_shared<TempoMap>();
+    float_frames_t preroll_frames = 0.0;
+    int preroll_bars = 0;
+    int preroll_beats = 0;
+
+    if (_has_preroll) {
+        preroll_frames = frame_dist(_preroll, 0, _preroll.bars * _preroll.beats);
+        preroll_bars = _preroll.bars;
+        preroll_beats = _preroll.bars * _preroll.beats;
+    }
 
-    // remove everything before the start label
-    auto i = _tempomap->entries().begin();
-    while (i->label != start_label) ++i;
-    for ( ; i != _tempomap->entries().end(); ++i) map->add(*i);
-    _tempomap = map;
+    _offset_frames = preroll_frames - _timeline->start_frames[_first] / _multiplier;
+    _offset_bars = preroll_bars - _timeline->start_bars[_first];
+    _offset_beats = preroll_beats - _timeline->start_beats[_first];
+}
+
+
+void Position::set_start_label(std::string const & start_label)
+{
+    // skip everything before the start label
+    _first = _tempomap->index(start_label);
+    ASSERT(_first != -1);
 
     reset();
-    calculate_entry_positions();
+    update_offsets();
 }
 
 
 void Position::add_preroll(int nbars)
 {
-    TempoMap::Entry const & e = (*_tempomap)[0];
-
-    TempoMapPtr preroll;
+    TempoMap::Segment const & s = _timeline->segments[_first];
+
+    // create a segment for preroll, at the first entry's initial tempo
+    _preroll = TempoMap::Segment();
+    _preroll.type = TempoMap::Segment::CONSTANT;
+    _preroll.bars = nbars;
+    _preroll.beats = s.beats;
+    _preroll.denom = s.denom;
+    _preroll.tempo = s.tempo;
+    _preroll.volume = 0.66f;
+    _preroll.default_pattern = s.default_pattern;
+    _preroll.pattern = 0;
+
+    _preroll_patterns.clear();
+    if (!s.default_pattern) {
+        auto p = _timeline->patterns.begin() + s.pattern;
+        _preroll_patterns.assign(p, p + (s.beats + 31) / 32);
+    }
 
-    // create a new tempomap for preroll
     if (nbars == Options::PREROLL_2_BEATS) {
-        std::vector<TempoMap::BeatType> pattern(2, TempoMap::BEAT_NORMAL);
-        preroll = TempoMap::new_simple(1, e.tempo, 2, e.denom, pattern, 0.66f);
-    } else {
-        preroll = TempoMap::new_simple(nbars, e.tempo, e.beats, e.denom, e.pattern, 0.66f);
+        _preroll.bars = 1;
+        _preroll.beats = 2;
+        _preroll.default_pattern = false;
+        _preroll_patterns.assign(1, TempoMap::BEAT_NORMAL | TempoMap::BEAT_NORMAL << 2);
     }
 
-    // join preroll and our actual tempomap
-    _tempomap = TempoMap::join(preroll, _tempomap);
+    _has_preroll = true;
 
     reset();
-    calculate_entry_positions();
+    update_offsets();
+}
+
+
+Position::float_frames_t Position::start_frame(int entry) const
+{
+    if (is_preroll(entry)) {
+        return 0.0;
+    }
+    float_frames_t f = _timeline->start_frames[map_index(entry)];
+    // the end of an infinite tempomap is infinitely far away, regardless of the offset
+    return f == std::numeric_limits<float_frames_t>::max() ? f : f / _multiplier + _offset_frames;
 }
 
 
-void Position::locate(nframes_t f)
+int Position::start_bar(int entry) const
+{
+    if (is_preroll(entry)) {
+        return 0;
+    }
+    int b = _timeline->start_bars[map_index(entry)];
+    return b == std::numeric_limits<int>::max() ? b : b + _offset_bars;
+}
+
+
+int Position::start_beat(int entry) const
+{
+    if (is_preroll(entry)) {
+        return 0;
+    }
+    int b = _timeline->start_beats[map_index(entry)];
+    return b == std::numeric_limits<int>::max() ? b : b + _offset_beats;
+}
+
+
+void Position::locate(framepos_t f)
 {
     reset();
 
@@ -126,63 +271,215 @@ void Position::locate(nframes_t f)
         return;
     }
 
-    // find the tempomap entry f is in
-    _entry = std::distance(_start_frames.begin(),
-                           std::upper_bound(_start_frames.begin(), _start_frames.end(), f) - 1);
+    // find the last entry that starts at or before f
+    int lo = 0, hi = size();
+    while (lo < hi) {
+        int mid = hi - (hi - lo) / 2;
+        if (start_frame(mid) <= f) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    _entry = lo;
 
-    if (_entry == static_cast<int>(_tempomap->size())) {
+    if (_entry == size()) {
         // end of tempomap
+        _entry--;
         _end = true;
         return;
     }
 
-    TempoMap::Entry const & e = current_entry();
+    TempoMap::Segment const & e = current_segment();
 
     // difference between start of entry and desired position
-    float_frames_t diff = f - _start_frames[_entry];
-    double secs = diff / _samplerate * _multiplier;
+    float_frames_t start = start_frame(_entry);
+    float_frames_t diff = f - start;
+    int nbeats;
+
+    std::size_t table = beat_table(_entry);
 
-    if (e.tempo && !e.tempo2) {
+    if (table == NO_INDEX) {
         // constant tempo
-        int nbeats = static_cast<int>((secs / 240.0 * e.tempo * e.denom));
+        double secs = diff / _samplerate * _multiplier;
+        nbeats = static_cast<int>((secs / 240.0 * e.tempo * e.denom));
+    } else {
+        // gradual tempo change or tempo per beat, find the beat in the table
+        auto begin = _timeline->beat_frames.begin() + table;
+        auto end = begin + e.bars * e.beats + 1;
+        auto i = std::upper_bound(begin, end, diff, [this](float_frames_t d, float_frames_t b) {
+            return d < b / _multiplier;
+        });
+        nbeats = static_cast<int>(std::distance(begin, i) - 1);
+    }
+
+    _bar  = nbeats / e.beats;
+    _beat = nbeats % e.beats;
 
-        _bar  = nbeats / e.beats;
-        _beat = nbeats % e.beats;
+    _frame = start + beat_offset(_entry, nbeats);
+    _bar_total = start_bar(_entry) + _bar;
+    _beat_total = start_beat(_entry) + nbeats;
 
-        _frame = _start_frames[_entry] + frame_dist(e, 0, _bar * e.beats + _beat);
-        _bar_total = _start_bars[_entry] + _bar;
-        _beat_total = _start_beats[_entry] + _bar * e.beats + _beat;
+    // make sure we don't miss the first beat if it starts at f
+    _init = (_frame == f);
+}
+
+
+void Position::locate_beat(int beat)
+{
+    reset();
+
+    // find the last entry that starts at or before the beat
+    int lo = 0, hi = size();
+    while (lo < hi) {
+        int mid = hi - (hi - lo) / 2;
+        if (start_beat(mid) <= beat) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
     }
-    else if (e.tempo && e.tempo2) {
-        // gradual tempo change
-        double tdiff_beat = (e.tempo2 - e.tempo) / (e.bars * e.beats);
 
-        // this is the reverse of the formula from frame_dist().
-        // it's good to have a CAS that can figure this stuff out...
-        int nbeats = ((e.tempo * std::exp(tdiff_beat * secs * e.denom / 240.0)) - e.tempo) / tdiff_beat;
+    locate_entry(lo, beat - start_beat(lo));
+}
 
-        _bar  = nbeats / e.beats;
-        _beat = nbeats % e.beats;
 
-        _frame = _start_frames[_entry] + frame_dist(e, 0, _bar * e.beats + _beat);
-        _bar_total = _start_bars[_entry] + _bar;
-        _beat_total = _start_beats[_entry] + _bar * e.beats + _beat;
+bool Position::locate_bar(int bar, int beat)
+{
+    if (bar < 0) {
+        return false;
     }
-    else if (!e.tempo) {
-        // tempo per beat
-        _bar = _beat = 0;
-        _frame = _start_frames[_entry];
-        _bar_total = _start_bars[_entry];
-        _beat_total = _start_beats[_entry];
 
-        // terribly inefficient, but who uses tempo per beat anyway...?
-        while (_frame + dist_to_next() <= f && !_end) {
-            advance();
+    // find the last entry that starts at or before the bar
+    int lo = 0, hi = size() - 1;
+    while (lo < hi) {
+        int mid = hi - (hi - lo) / 2;
+        if (start_bar(mid) <= bar) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
     }
 
-    // make sure we don't miss the first beat if it starts at f
-    _init = (_frame == f);
+    return locate_entry_bar(lo, bar - start_bar(lo), beat);
+}
+
+
+bool Position::locate_label(std::string const & label, int bar, int beat)
+{
+    int n = _tempomap->index(label);
+
+    if (n < _first) {
+        // no such entry, or it isn't played
+        return false;
+    }
+
+    return locate_entry_bar(n - _first + (_has_preroll ? 1 : 0), bar, beat);
+}
+
+
+bool Position::label_bars(std::string const & label, int & first, int & end) const
+{
+    int n = _tempomap->index(label);
+
+    if (n < _first) {
+        return false;
+    }
+
+    int entry = n - _first + (_has_preroll ? 1 : 0);
+    first = start_bar(entry);
+    end = start_bar(entry + 1);
+    return true;
+}
+
+
+bool Position::locate_entry_bar(int entry, int bar, int beat)
+{
+    TempoMap::Segment const & s = segment_at(entry);
+
+    if (bar < 0 || beat < 0 || beat >= s.beats || (bar >= s.bars && s.bars != -1) ||
+            bar > std::numeric_limits<int>::max() / s.beats - 1) {
+        return false;
+    }
+
+    reset();
+    locate_entry(entry, bar * s.beats + beat);
+    return true;
+}
+
+
+void Position::locate_edited(Position const & prev, TempoMap::Diff const & diff)
+{
+    if (prev._end || prev.is_preroll(prev._entry)) {
+        locate_beat(prev._beat_total);
+        return;
+    }
+
+    std::size_t i = prev.map_index(prev._entry);
+    std::string const & label = prev._tempomap->entry(i).label;
+    int n;
+
+    if (i < diff.begin) {
+        n = static_cast<int>(i);
+    } else if (i >= diff.old_end) {
+        n = static_cast<int>(i - diff.old_end + diff.new_end);
+    } else if (_tempomap->index(label) != -1) {
+        n = _tempomap->index(label);
+    } else if (diff.old_end - diff.begin == diff.new_end - diff.begin) {
+        // entries were replaced one by one
+        n = static_cast<int>(i);
+    } else {
+        n = -1;
+    }
+
+    if (n < _first) {
+        // no such entry, or it isn't played
+        locate_beat(prev._beat_total);
+        return;
+    }
+
+    reset();
+
+    int entry = n - _first + (_has_preroll ? 1 : 0);
+    TempoMap::Segment const & s = segment_at(entry);
+
+    int bar = prev._bar;
+    int beat = prev._beat;
+
+    if (beat >= s.beats) {
+        // fewer beats per bar now, continue with the next bar
+        beat = 0;
+        bar++;
+    }
+    if (bar >= s.bars && s.bars != -1) {
+        // the entry has become shorter, continue with the next one
+        locate_entry(entry + 1, 0);
+    } else {
+        locate_entry(entry, bar * s.beats + beat);
+    }
+}
+
+
+void Position::locate_entry(int entry, int nbeats)
+{
+    _entry = entry;
+
+    if (_entry == size()) {
+        // end of tempomap
+        _entry--;
+        _end = true;
+        _frame = total_frames();
+        return;
+    }
+
+    TempoMap::Segment const & e = current_segment();
+
+    _bar  = nbeats / e.beats;
+    _beat = nbeats % e.beats;
+
+    _frame = start_frame(_entry) + beat_offset(_entry, nbeats);
+    _bar_total = start_bar(_entry) + _bar;
+    _beat_total = start_beat(_entry) + nbeats;
 }
 
 
@@ -193,9 +490,7 @@ void Position::advance()
         return;
     }
 
-    _frame += dist_to_next();
-
-    TempoMap::Entry const & e = current_entry();
+    TempoMap::Segment const & e = current_segment();
 
     // move to next beat
     if (++_beat >= e.beats) {
@@ -204,7 +499,7 @@ void Position::advance()
         if (++_bar >= e.bars && e.bars != -1) {
             _bar = 0;
             // move to next entry
-            if (++_entry >= static_cast<int>(_tempomap->size())) {
+            if (++_entry >= size()) {
                 _entry--;       // no such entry
                 _end = true;
             }
@@ -212,6 +507,16 @@ void Position::advance()
         _bar_total++;
     }
     _beat_total++;
+
+    TempoMap::Segment const & n = current_segment();
+
+    // calculate the new frame from the start of the entry,
+    // so rounding errors don't accumulate over long tempomaps
+    if (_end) {
+        _frame = total_frames();
+    } else {
+        _frame = start_frame(_entry) + beat_offset(_entry, _bar * n.beats + _beat);
+    }
 }
 
 
@@ -221,14 +526,40 @@ Position::float_frames_t Position::dist_to_next() const
     if (_init) return 0.0;
     if (_end) return std::numeric_limits<float_frames_t>::max();
 
-    TempoMap::Entry const & e = current_entry();
+    TempoMap::Segment const & e = current_segment();
+    int beat = _bar * e.beats + _beat;
 
-    return frame_dist(e, _bar * e.beats + _beat,
-                         _bar * e.beats + _beat + 1);
+    if (beat_table(_entry) == NO_INDEX) {
+        return frame_dist(e, beat, beat + 1);
+    } else {
+        return beat_offset(_entry, beat + 1) - beat_offset(_entry, beat);
+    }
 }
 
 
-Position::float_frames_t Position::frame_dist(TempoMap::Entry const & e, int start, int end) const
+Position::float_frames_t Position::beat_offset(int entry, int beat) const
+{
+    std::size_t i = beat_table(entry);
+
+    if (i == NO_INDEX) {
+        return frame_dist(segment_at(entry), 0, beat);
+    } else {
+        return _timeline->beat_frames[i + beat] / _multiplier;
+    }
+}
+
+
+std::size_t Position::beat_table(int entry) const
+{
+    if (is_preroll(entry)) {
+        return NO_INDEX;
+    }
+    std::uint64_t i = _timeline->beat_index[map_index(entry)];
+    return i != TempoMap::Timeline::NO_BEATS ? static_cast<std::size_t>(i) : NO_INDEX;
+}
+
+
+double Position::beat_secs(TempoMap::Segment const & s, int start, int end) const
 {
     if (start == end) {
         return 0.0;
@@ -239,29 +570,29 @@ Position::float_frames_t Position::frame_dist(TempoMap::Entry const & e, int sta
     int nbeats = end - start;
     double secs = 0.0;
 
-    if ((e.tempo && !e.tempo2) || (e.tempo && e.tempo == e.tempo2)) {
-        // constant tempo
-        secs = nbeats * 240.0 / (e.tempo * e.denom);
-    }
-    else if (e.tempo && e.tempo2) {
-        // gradual tempo change
-        double tdiff = e.tempo2 - e.tempo;
+    switch (s.type) {
+      case TempoMap::Segment::CONSTANT:
+        secs = nbeats * 240.0 / (s.tempo * s.denom);
+        break;
+
+      case TempoMap::Segment::RAMP:
+      { double tdiff = s.tempo2 - s.tempo;
 
-        double t1 = static_cast<double>(e.tempo) + tdiff * (static_cast<double>(start) / (e.bars * e.beats));
-        double t2 = static_cast<double>(e.tempo) + tdiff * (static_cast<double>(end)   / (e.bars * e.beats));
+        double t1 = static_cast<double>(s.tempo) + tdiff * (static_cast<double>(start) / (s.bars * s.beats));
+        double t2 = static_cast<double>(s.tempo) + tdiff * (static_cast<double>(end)   / (s.bars * s.beats));
 
         double avg_tempo = (t1 - t2) / (std::log(t1) - std::log(t2));
-        secs = (nbeats * 240.0) / (avg_tempo * e.denom);
-    }
-    else if (!e.tempo) {
-        // different tempo for each beat
-        secs = std::accumulate(e.tempi.begin() + start,
-                               e.tempi.begin() + end,
-                               0.0,
-                               [=](float acc, float t){ return acc + 240.0 / (t * e.denom); });
+        secs = (nbeats * 240.0) / (avg_tempo * s.denom);
+      } break;
+
+      case TempoMap::Segment::PER_BEAT:
+        for (int n = start; n < end; ++n) {
+            secs += 240.0 / (_timeline->tempi[s.tempi + n] * s.denom);
+        }
+        break;
     }
 
-    return secs * _samplerate / _multiplier;
+    return secs;
 }
 
 
@@ -269,18 +600,20 @@ Position::Tick const Position::tick() const
 {
     if (_end) {
         // end of tempomap, return "nothing"
-        return (Tick) { static_cast<nframes_t>(_frame), TempoMap::BEAT_SILENT, 0 };
+        return (Tick) { static_cast<framepos_t>(_frame), TempoMap::BEAT_SILENT, 0 };
     }
 
-    TempoMap::Entry const & e = current_entry();
+    TempoMap::Segment const & s = current_segment();
+    std::uint64_t const *patterns = is_preroll(_entry) ? _preroll_patterns.data() : _timeline->patterns.data();
 
-    TempoMap::BeatType t;
-    if (e.pattern.empty()) {
-        // use default pattern
-        t = (_beat == 0) ? TempoMap::BEAT_EMPHASIS : TempoMap::BEAT_NORMAL;
-    } else {
-        // use pattern as specified in the tempomap
-        t = e.pattern[_beat];
-    }
-    return (Tick) { static_cast<nframes_t>(_frame), t, e.volume };
+    return (Tick) { static_cast<framepos_t>(_frame), s.beat_type(_beat, patterns), s.volume };
+}
+
+
+float Position::beat_tempo() const
+{
+    TempoMap::Segment const & s = current_segment();
+    ASSERT(s.type == TempoMap::Segment::PER_BEAT);
+
+    return _timeline->tempi[s.tempi + _bar * s.beats + _beat];
 }
@@ -17,10 +17,16 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 
 
 /*
- * keeps track of the position in the tempomap
+ * keeps track of the position in the tempomap.
+ * the tempomap and the positions of its entries and beats are shared by all copies of a
+ * position. a start label or preroll only changes which part of the shared tempomap is
+ * played, so neither needs to copy the tempomap or recalculate its timeline.
+ * the timeline is at the tempomap's original tempo, the tempo multiplier is applied to
+ * each position as it's read
  */
 class Position
 {
@@ -28,21 +34,40 @@ class Position
     typedef double float_frames_t;
 
     struct Tick {
-        nframes_t frame;
+        framepos_t frame;
         TempoMap::BeatType type;
         float volume;
     };
 
+    // uses the tempomap's precomputed timeline if there is one for this samplerate
     Position(TempoMapConstPtr tempomap, float_frames_t samplerate, float multiplier);
+    // position in an edited copy of prev's tempomap. only the positions of the entries
+    // from the first changed one on are recalculated.
+    // start label and preroll are not taken over
+    Position(Position const & prev, TempoMapConstPtr tempomap, TempoMap::Diff const & diff);
 
+    // start playback at the entry with the given label, which must exist
     void set_start_label(std::string const & start_label);
+    // play nbars of the first entry's tempo and meter before the tempomap
     void add_preroll(int nbars);
 
+    // change the tempo multiplier in O(1), and reset to the start of the tempomap
+    void set_multiplier(float multiplier);
+    float multiplier() const { return _multiplier; }
+
     // move to frame
-    void locate(nframes_t f);
+    void locate(framepos_t f);
+    // move to the given beat, counted from the start of playback
+    void locate_beat(int beat);
+    // move to a bar and beat counted from the start of playback, or from the start of the
+    // entry with the given label. returns false if there's no such beat
+    bool locate_bar(int bar, int beat);
+    bool locate_label(std::string const & label, int bar, int beat);
+    // move to the same bar and beat of the same entry as prev, whose tempomap was edited into
+    // this one. entries are matched by position or label, if that fails by number of beats
+    void locate_edited(Position const & prev, TempoMap::Diff const & diff);
     // move position one tick forward
     void advance();
-
     // distance from previous (current) tick to the next
     float_frames_t dist_to_next() const;
     // frame of next tick
@@ -59,24 +84,81 @@ class Position
     int beat() const { return _beat; }
     int bar_total() const { return _bar_total; }
     int beat_total() const { return _beat_total; }
+    // beat_total() of the tick that's next after advance()
+    int next_beat_total() const { return _init ? _beat_total : _beat_total + 1; }
 
     // current tempomap entry
-    TempoMap::Entry const & current_entry() const {
-        return (*_tempomap)[_entry];
+    TempoMap::Segment const & current_segment() const {
+        return segment_at(_entry);
     }
+    // tempo of the current beat, for segments with a tempo per beat
+    float beat_tempo() const;
 
     // total length of tempomap
     float_frames_t total_frames() const {
-        return _start_frames.back();
+        return start_frame(size());
+    }
+    // number of bars played, including preroll
+    int total_bars() const {
+        return start_bar(size());
     }
+    // number of beats played, including preroll
+    int total_beats() const {
+        return start_beat(size());
+    }
+    // bars [first, end) of the entry with the given label, counted from the start of
+    // playback. false if there's no such entry or it isn't played
+    bool label_bars(std::string const & label, int & first, int & end) const;
+
+    // start frames of all entries and beats of the whole tempomap, regardless of start
+    // label, preroll and tempo multiplier, for storing them in the tempomap
+    std::shared_ptr<TempoMap::Timeline const> timeline() const { return _timeline; }
 
   private:
     // reset, locate at start of tempomap
     void reset();
-    void calculate_entry_positions();
+    // calculate the timeline, taking the positions of all entries before 'changed'
+    // from prev if given
+    void calculate_entry_positions(TempoMap::Timeline const *prev = NULL, std::size_t changed = 0);
+    void update_offsets();
+    // move to a beat of an entry
+    void locate_entry(int entry, int nbeats);
+    // move to a bar and beat of an entry, if the entry has them
+    bool locate_entry_bar(int entry, int bar, int beat);
+
+    // number of entries played, including preroll
+    int size() const {
+        return static_cast<int>(_tempomap->size()) - _first + (_has_preroll ? 1 : 0);
+    }
+
+    // entries are numbered from the start of playback, including preroll.
+    // these functions translate that into the tempomap and its timeline
+    bool is_preroll(int entry) const {
+        return _has_preroll && entry == 0;
+    }
+    std::size_t map_index(int entry) const {
+        return _first + entry - (_has_preroll ? 1 : 0);
+    }
+    TempoMap::Segment const & segment_at(int entry) const {
+        return is_preroll(entry) ? _preroll : _timeline->segments[map_index(entry)];
+    }
+
+    // start of an entry, or end of the tempomap if entry == size()
+    float_frames_t start_frame(int entry) const;
+    int start_bar(int entry) const;
+    int start_beat(int entry) const;
 
     // calculate length of entry or beat(s)
-    float_frames_t frame_dist(TempoMap::Entry const & e, int start, int end) const;
+    float_frames_t frame_dist(TempoMap::Segment const & s, int start, int end) const {
+        return beat_secs(s, start, end) * _samplerate / _multiplier;
+    }
+    // length of beats in seconds, at the original tempo
+    double beat_secs(TempoMap::Segment const & s, int start, int end) const;
+
+    // offset of a beat from the start of the given entry
+    float_frames_t beat_offset(int entry, int beat) const;
+    // index of the entry's first beat in the timeline's beat table, or NO_INDEX
+    std::size_t beat_table(int entry) const;
 
     // frame position of current tick
     float_frames_t _frame;
@@ -97,10 +179,22 @@ class Position
     float_frames_t _samplerate;
     float _multiplier;
 
-    // start of each entry, measured in frames, bars, and beats from the start of the tempomap
-    std::vector<float_frames_t> _start_frames;
-    std::vector<int> _start_bars;
-    std::vector<int> _start_beats;
+    static std::size_t const NO_INDEX = static_cast<std::size_t>(-1);
+
+    std::shared_ptr<TempoMap::Timeline const> _timeline;
+
+    // first tempomap entry to be played
+    int _first;
+
+    // segment played before the tempomap, if any, and its pattern
+    bool _has_preroll;
+    TempoMap::Segment _preroll;
+    std::vector<std::uint64_t> _preroll_patterns;
+
+    // difference between positions in the timeline and positions during playback
+    float_frames_t _offset_frames;
+    int _offset_bars;
+    int _offset_beats;
 };
 
 
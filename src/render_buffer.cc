@@ -0,0 +1,79 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "render_buffer.hh"
+
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util/string.hh"
+
+
+RenderBuffer::RenderBuffer(framepos_t length)
+  : _data(NULL)
+  , _length(length)
+  , _size(std::max<std::size_t>(length, 1) * sizeof(sample_t))
+  , _file_backed(_size > FILE_THRESHOLD)
+  , _locked(false)
+{
+    void *p;
+
+    if (_file_backed) {
+        char const *tmpdir = std::getenv("TMPDIR");
+        std::string path = std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/klick-XXXXXX";
+        std::vector<char> tmpl(path.begin(), path.end());
+        tmpl.push_back('\0');
+
+        int fd = ::mkstemp(&tmpl[0]);
+        if (fd == -1) {
+            throw std::runtime_error(das::make_string() << "can't create temporary file '" << path << "': "
+                                                        << std::strerror(errno));
+        }
+        // the file disappears as soon as it's unmapped
+        ::unlink(&tmpl[0]);
+
+        if (::ftruncate(fd, _size) == -1) {
+            int e = errno;
+            ::close(fd);
+            throw std::runtime_error(das::make_string() << "can't resize temporary file: " << std::strerror(e));
+        }
+
+        p = ::mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        ::close(fd);
+    } else {
+        p = ::mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    }
+
+    if (p == MAP_FAILED) {
+        throw std::runtime_error(das::make_string() << "can't map " << _size << " bytes of memory: "
+                                                    << std::strerror(errno));
+    }
+
+    _data = static_cast<sample_t *>(p);
+
+    // otherwise the kernel may write back and drop pages of a file-backed buffer (or swap
+    // out an anonymous one), and the audio thread would have to wait for them
+    _locked = (::mlock(p, _size) == 0);
+}
+
+
+RenderBuffer::~RenderBuffer()
+{
+    ::munmap(_data, _size);
+}
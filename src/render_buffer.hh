@@ -0,0 +1,58 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_RENDER_BUFFER_HH
+#define KLICK_RENDER_BUFFER_HH
+
+#include "audio.hh"
+
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+
+
+/*
+ * zero-initialized, memory-mapped audio buffer of fixed length.
+ * large buffers are backed by an unlinked temporary file instead of swap.
+ * the audio thread plays from these buffers, so all pages are faulted in up front and
+ * locked in memory if possible
+ */
+class RenderBuffer
+  : boost::noncopyable
+{
+  public:
+
+    // buffers larger than this many bytes are mapped from a temporary file
+    static std::size_t const FILE_THRESHOLD = 64 * 1024 * 1024;
+
+    RenderBuffer(framepos_t length);
+    ~RenderBuffer();
+
+    sample_t * data() { return _data; }
+    sample_t const * data() const { return _data; }
+    framepos_t length() const { return _length; }
+
+    // true if the buffer is backed by a file
+    bool file_backed() const { return _file_backed; }
+    // false if the buffer couldn't be locked in memory, e.g. because of RLIMIT_MEMLOCK.
+    // its pages may then be paged out again
+    bool locked() const { return _locked; }
+
+  private:
+
+    sample_t *_data;
+    framepos_t _length;
+    std::size_t _size;
+    bool _file_backed;
+    bool _locked;
+};
+
+
+#endif // KLICK_RENDER_BUFFER_HH
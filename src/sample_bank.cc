@@ -0,0 +1,125 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sample_bank.hh"
+#include "audio_chunk.hh"
+
+#include "util/debug.hh"
+
+
+SampleBank::SampleBank()
+  : _version(0)
+  , _current_version(0)
+  , _frames(0)
+  , _max_period(0)
+{
+    for (auto & s : _slots) {
+        s.store(NULL);
+    }
+    _current.fill(NULL);
+    for (auto & g : _gains) {
+        g.store(1.0f);
+    }
+}
+
+
+void SampleBank::set(Handle h, AudioChunkConstPtr chunk)
+{
+    set({ std::make_pair(h, chunk) });
+}
+
+
+void SampleBank::set(std::initializer_list<std::pair<Handle, AudioChunkConstPtr>> chunks)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    unsigned int version = _version.load(std::memory_order_relaxed);
+    _version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (auto & c : chunks) {
+        Handle h = c.first;
+        ASSERT(h >= 0 && h < MAX_SAMPLES);
+
+        if (_chunks[h]) {
+            // the audio thread may still start playing the old chunk until it picks up the new one
+            Retired r = { _chunks[h], _frames.load() };
+            _retired.push_back(r);
+        }
+
+        _chunks[h] = c.second;
+        _slots[h].store(c.second.get(), std::memory_order_relaxed);
+    }
+
+    _version.store(version + 2, std::memory_order_release);
+}
+
+
+AudioChunkConstPtr SampleBank::chunk(Handle h) const
+{
+    ASSERT(h >= 0 && h < MAX_SAMPLES);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _chunks[h];
+}
+
+
+void SampleBank::collect()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::uint64_t frames = _frames.load();
+    std::uint64_t max_period = _max_period.load();
+
+    // a voice using a retired chunk may have been started up to two periods after the chunk was
+    // retired (if the audio thread had to wait for the next period to pick up the new one), at
+    // any offset into that period. it has finished once the whole chunk was played
+    for (auto i = _retired.begin(); i != _retired.end(); ) {
+        if (frames >= i->frame + i->chunk->length() + 2 * max_period) {
+            i = _retired.erase(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+
+void SampleBank::period_start()
+{
+    unsigned int version = _version.load(std::memory_order_acquire);
+    if (version == _current_version || (version & 1)) {
+        // nothing new, or currently being written
+        return;
+    }
+
+    std::array<AudioChunk const *, MAX_SAMPLES> slots;
+    for (int h = 0; h < MAX_SAMPLES; ++h) {
+        slots[h] = _slots[h].load(std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (_version.load(std::memory_order_relaxed) != version) {
+        // written in the meantime, try again next period
+        return;
+    }
+
+    _current = slots;
+    _current_version = version;
+}
+
+
+void SampleBank::period_done(nframes_t nframes)
+{
+    if (nframes > _max_period.load(std::memory_order_relaxed)) {
+        _max_period.store(nframes, std::memory_order_relaxed);
+    }
+    _frames.store(_frames.load(std::memory_order_relaxed) + nframes, std::memory_order_release);
+}
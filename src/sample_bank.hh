@@ -0,0 +1,102 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_SAMPLE_BANK_HH
+#define KLICK_SAMPLE_BANK_HH
+
+#include "audio.hh"
+#include "main.hh"
+
+#include <array>
+#include <list>
+#include <utility>
+#include <initializer_list>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <boost/noncopyable.hpp>
+
+
+/*
+ * owns all audio chunks that can be played. the realtime thread only sees plain handles
+ * and raw pointers, so it never touches a reference count. chunks that are replaced are
+ * kept alive until no voice can possibly be playing them anymore, and are then freed by
+ * a non-realtime thread. the realtime thread picks up new chunks at the start of a period
+ */
+class SampleBank
+  : boost::noncopyable
+{
+  public:
+
+    typedef int Handle;
+
+    static int const MAX_SAMPLES = 16;
+
+    SampleBank();
+
+    // replace the chunk in slot h. the previous chunk is retired
+    void set(Handle h, AudioChunkConstPtr chunk) NONREALTIME;
+    // replace the chunks in several slots at once. the audio thread switches to all of them
+    // at the start of the same period
+    void set(std::initializer_list<std::pair<Handle, AudioChunkConstPtr>> chunks) NONREALTIME;
+    // get the chunk in slot h
+    AudioChunkConstPtr chunk(Handle h) const NONREALTIME;
+
+    // free retired chunks that are no longer in use
+    void collect() NONREALTIME;
+
+    // get the chunk in slot h, NULL if the slot is empty
+    AudioChunk const * get(Handle h) const REALTIME {
+        return _current[h];
+    }
+
+    // gain applied to all voices playing slot h, including those already playing.
+    // may be called from any thread
+    void set_gain(Handle h, float gain) {
+        _gains[h].store(gain, std::memory_order_relaxed);
+    }
+    float gain(Handle h) const REALTIME {
+        return _gains[h].load(std::memory_order_relaxed);
+    }
+
+    // must be called by the audio thread at the start and at the end of each period
+    void period_start() REALTIME;
+    void period_done(nframes_t nframes) REALTIME;
+
+  private:
+
+    struct Retired {
+        AudioChunkConstPtr chunk;
+        // number of frames processed when the chunk was retired
+        std::uint64_t frame;
+    };
+
+    std::array<std::atomic<AudioChunk const *>, MAX_SAMPLES> _slots;
+    std::array<std::atomic<float>, MAX_SAMPLES> _gains;
+    // incremented before and after the slots are written, odd while they're being written
+    std::atomic<unsigned int> _version;
+
+    // realtime thread: the slots as of the start of the current period
+    std::array<AudioChunk const *, MAX_SAMPLES> _current;
+    unsigned int _current_version;
+
+    // realtime thread: frames processed so far, and largest period size seen
+    std::atomic<std::uint64_t> _frames;
+    std::atomic<nframes_t> _max_period;
+
+    // non-realtime: owning references, protected by _mutex
+    mutable std::mutex _mutex;
+    std::array<AudioChunkConstPtr, MAX_SAMPLES> _chunks;
+    std::list<Retired> _retired;
+};
+
+
+#endif // KLICK_SAMPLE_BANK_HH
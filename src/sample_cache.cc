@@ -0,0 +1,472 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sample_cache.hh"
+#include "audio_chunk.hh"
+
+#include <tuple>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "util/string.hh"
+#include "main.hh"
+
+
+int const SampleCache::PROCESSING_VERSION;
+std::size_t const SampleCache::DEFAULT_MAX_BYTES;
+std::size_t const SampleCache::DEFAULT_MAX_DISK_BYTES;
+
+
+/*
+ * cache file layout: the header, followed by the samples, zero-padded to a multiple of
+ * AudioChunk::ALIGNMENT bytes. everything is stored in native byte order
+ */
+namespace {
+
+char const MAGIC[8] = { 'K', 'L', 'I', 'C', 'K', 'S', 'M', 'P' };
+
+// increment whenever the layout or the meaning of any field changes
+std::uint32_t const FORMAT_VERSION = 1;
+std::uint32_t const BYTE_ORDER_MARK = 0x01020304;
+
+struct FileHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t key_hash;
+    std::uint64_t samplerate;
+    std::uint64_t length;
+    char padding[24];
+};
+
+// the samples are mapped right after the header, and need to be aligned
+static_assert(sizeof(FileHeader) % AudioChunk::ALIGNMENT == 0, "cache file header breaks sample alignment");
+
+
+std::uint64_t hash(std::string const & data)
+{
+    // FNV-1a, this only needs to tell different keys apart
+    std::uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : data) {
+        h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+} // namespace
+
+
+bool SampleCache::Key::operator<(Key const & k) const
+{
+    return std::tie(filename, mtime_sec, mtime_nsec, size, samplerate, pitch, quality, version)
+         < std::tie(k.filename, k.mtime_sec, k.mtime_nsec, k.size, k.samplerate, k.pitch, k.quality, k.version);
+}
+
+
+SampleCache::SampleCache(nframes_t samplerate, std::size_t max_bytes, std::string const & directory,
+                         std::size_t max_disk_bytes)
+  : _samplerate(samplerate)
+  , _max_bytes(max_bytes)
+  , _directory(directory)
+  , _max_disk_bytes(max_disk_bytes)
+  , _bytes(0)
+  , _uses(0)
+{
+}
+
+
+std::string SampleCache::default_directory()
+{
+    std::string base;
+
+    char const *xdg = std::getenv("XDG_CACHE_HOME");
+    char const *home = std::getenv("HOME");
+
+    if (xdg && *xdg == '/') {
+        base = xdg;
+    } else if (home && *home) {
+        base = std::string(home) + "/.cache";
+    } else {
+        return std::string();
+    }
+
+    std::string dir = base + "/klick";
+
+    // create the base directory too, it may not exist on a fresh system
+    for (std::string const & d : { base, dir }) {
+        if (::mkdir(d.c_str(), 0755) == -1 && errno != EEXIST) {
+            return std::string();
+        }
+    }
+
+    return dir;
+}
+
+
+AudioChunkConstPtr SampleCache::get(std::string const & filename, float pitch, AudioChunk::Quality quality)
+{
+    Key k = file_key(filename, quality);
+
+    // without a samplerate conversion, chunks loaded at any quality are the same
+    if (source_samplerate(k) == _samplerate) {
+        k.quality = AudioChunk::QUALITY_BEST;
+    }
+
+    Key pitched = k;
+    pitched.pitch = pitch;
+    if (pitch != 1.0f && AudioChunk::pitch_resamples()) {
+        pitched.quality = quality;
+    }
+
+    AudioChunkConstPtr chunk = find(pitched);
+    if (chunk) {
+        return chunk;
+    }
+
+    // the file as it is, at our samplerate. the cache isn't locked while files are
+    // loaded and converted, so other threads can still get cached chunks.
+    // only these are kept on disk, pitch-shifting a cached chunk is cheap enough, and
+    // there would be a new file for every pitch value ever used
+    chunk = find(k);
+    if (!chunk && (chunk = load(k))) {
+        chunk = insert(k, chunk);
+    }
+    if (!chunk) {
+        auto t = std::chrono::steady_clock::now();
+        chunk = insert(k, filename.empty() ? std::make_shared<AudioChunk>(_samplerate)
+                                           : std::make_shared<AudioChunk>(filename, _samplerate, quality));
+        log_time("loaded", k, t);
+        save(k, *chunk);
+    }
+
+    if (pitch != 1.0f) {
+        auto t = std::chrono::steady_clock::now();
+        auto c = std::make_shared<AudioChunk>(*chunk);
+        c->adjust_pitch(pitch, quality);
+        chunk = insert(pitched, c);
+        log_time("pitch-shifted", pitched, t);
+    }
+
+    return chunk;
+}
+
+
+bool SampleCache::converts(std::string const & filename, float pitch)
+{
+    Key k = file_key(filename, AudioChunk::QUALITY_BEST);
+
+    return source_samplerate(k) != _samplerate || (pitch != 1.0f && AudioChunk::pitch_resamples());
+}
+
+
+void SampleCache::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _chunks.clear();
+    _bytes = 0;
+}
+
+
+SampleCache::Key SampleCache::file_key(std::string const & filename, AudioChunk::Quality quality) const
+{
+    Key k = { filename, 0, 0, 0, _samplerate, 1.0f, quality, PROCESSING_VERSION };
+
+    struct ::stat st;
+    if (!filename.empty() && ::stat(filename.c_str(), &st) == 0) {
+        // a modified file is a different file
+        k.mtime_sec = st.st_mtim.tv_sec;
+        k.mtime_nsec = st.st_mtim.tv_nsec;
+        k.size = st.st_size;
+    }
+
+    return k;
+}
+
+
+nframes_t SampleCache::source_samplerate(Key const & k)
+{
+    if (k.filename.empty()) {
+        // silence
+        return _samplerate;
+    }
+
+    // only the file itself matters
+    Key f = k;
+    f.quality = AudioChunk::QUALITY_BEST;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto i = _source_samplerates.find(f);
+        if (i != _source_samplerates.end()) {
+            return i->second;
+        }
+    }
+
+    nframes_t samplerate = 0;
+    try {
+        samplerate = AudioChunk::file_samplerate(k.filename);
+    } catch (std::runtime_error const &) {
+        // reported when the file is actually loaded
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _source_samplerates[f] = samplerate;
+    return samplerate;
+}
+
+
+AudioChunkConstPtr SampleCache::find(Key const & k)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto i = _chunks.find(k);
+    if (i == _chunks.end()) {
+        return AudioChunkConstPtr();
+    }
+
+    i->second.last_used = ++_uses;
+    return i->second.chunk;
+}
+
+
+AudioChunkConstPtr SampleCache::insert(Key const & k, AudioChunkConstPtr chunk)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto i = _chunks.find(k);
+    if (i != _chunks.end()) {
+        // another thread was faster, share its chunk
+        i->second.last_used = ++_uses;
+        return i->second.chunk;
+    }
+
+    _chunks[k] = Entry { chunk, ++_uses };
+    _bytes += bytes(*chunk);
+
+    // drop the least recently used chunks, except the new one.
+    // chunks that are still in use stay alive until they're replaced
+    while (_bytes > _max_bytes && _chunks.size() > 1) {
+        auto lru = _chunks.end();
+        for (auto i = _chunks.begin(); i != _chunks.end(); ++i) {
+            if (i->second.chunk != chunk && (lru == _chunks.end() || i->second.last_used < lru->second.last_used)) {
+                lru = i;
+            }
+        }
+        _bytes -= bytes(*lru->second.chunk);
+        _chunks.erase(lru);
+    }
+
+    logv << "cached sample '" << k.filename << "', pitch " << k.pitch
+         << " (" << _chunks.size() << " chunks, " << _bytes / 1024 << " KiB)" << std::endl;
+
+    return chunk;
+}
+
+
+void SampleCache::log_time(char const *what, Key const & k, std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+
+    logv << what << " sample '" << k.filename << "' at " << AudioChunk::quality_name(k.quality)
+         << " quality in " << ms.count() << " ms" << std::endl;
+}
+
+
+std::uint64_t SampleCache::key_hash(Key const & k)
+{
+    std::uint32_t pitch;
+    std::memcpy(&pitch, &k.pitch, sizeof(pitch));
+
+    return hash(das::make_string() << k.filename << '\0' << k.mtime_sec << ' ' << k.mtime_nsec << ' '
+                                   << k.size << ' ' << k.samplerate << ' ' << pitch << ' '
+                                   << k.quality << ' ' << k.version
+#ifdef ENABLE_RUBBERBAND
+                                   << " rubberband"
+#endif
+                                   );
+}
+
+
+std::string SampleCache::cache_filename(Key const & k) const
+{
+    // named after the source file and the conversion only, so a new version of the
+    // source (or of klick) overwrites the old cache file. the full key is checked
+    // against the header when the file is loaded
+    std::uint64_t h = hash(das::make_string() << k.filename << '\0' << k.samplerate << ' ' << k.quality);
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.klicksample", static_cast<unsigned long long>(h));
+    return _directory + "/" + name;
+}
+
+
+AudioChunkConstPtr SampleCache::load(Key const & k)
+{
+    if (_directory.empty() || k.filename.empty()) {
+        return AudioChunkConstPtr();
+    }
+
+    auto t = std::chrono::steady_clock::now();
+    std::string filename = cache_filename(k);
+
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return AudioChunkConstPtr();
+    }
+
+    struct ::stat st;
+    if (::fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(FileHeader))) {
+        ::close(fd);
+        return AudioChunkConstPtr();
+    }
+
+    // private and writable, so the chunk behaves like allocated sample data
+    std::size_t size = st.st_size;
+    void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    // mark the file as recently used, prune() removes the oldest files first
+    ::futimens(fd, NULL);
+    ::close(fd);
+
+    if (p == MAP_FAILED) {
+        return AudioChunkConstPtr();
+    }
+
+    FileHeader const & h = *static_cast<FileHeader const *>(p);
+    std::size_t padded = (h.length * sizeof(sample_t) + AudioChunk::ALIGNMENT - 1) / AudioChunk::ALIGNMENT * AudioChunk::ALIGNMENT;
+
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != FORMAT_VERSION ||
+            h.byte_order != BYTE_ORDER_MARK || h.key_hash != key_hash(k) ||
+            h.samplerate != k.samplerate || h.length > (size - sizeof(FileHeader)) / sizeof(sample_t) ||
+            padded > size - sizeof(FileHeader)) {
+        // stale or broken, will be overwritten
+        ::munmap(p, size);
+        return AudioChunkConstPtr();
+    }
+
+    sample_t *samples = reinterpret_cast<sample_t *>(static_cast<char *>(p) + sizeof(FileHeader));
+    auto chunk = std::make_shared<AudioChunk>(p, size, samples, static_cast<nframes_t>(h.length), k.samplerate);
+
+    // the pages are clean, the kernel could drop them and the audio thread would have
+    // to read them back from disk. if they can't be locked, use a copy in memory
+    if (::mlock(p, size) == -1) {
+        chunk = std::make_shared<AudioChunk>(*chunk);
+    }
+
+    log_time("mapped", k, t);
+    return chunk;
+}
+
+
+void SampleCache::save(Key const & k, AudioChunk const & chunk)
+{
+    if (_directory.empty() || k.filename.empty()) {
+        return;
+    }
+
+    FileHeader h = FileHeader();
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = FORMAT_VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.key_hash = key_hash(k);
+    h.samplerate = chunk.samplerate();
+    h.length = chunk.length();
+
+    // allocated sample data is already zero-padded
+    std::size_t padded = (chunk.length() * sizeof(sample_t) + AudioChunk::ALIGNMENT - 1) / AudioChunk::ALIGNMENT * AudioChunk::ALIGNMENT;
+
+    // write to a temporary file first, so other instances never see a partial file
+    std::string filename = cache_filename(k);
+    std::string tmp = das::make_string() << filename << "." << ::getpid() << ".tmp";
+
+    {
+        std::ofstream file(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<char const *>(&h), sizeof(h));
+        file.write(reinterpret_cast<char const *>(chunk.samples()), padded);
+        file.close();
+
+        if (file && std::rename(tmp.c_str(), filename.c_str()) == 0) {
+            logv << "wrote sample cache file '" << filename << "'" << std::endl;
+            prune();
+            return;
+        }
+    }
+
+    // errors are ignored, the sample is just converted again next time
+    std::remove(tmp.c_str());
+}
+
+
+void SampleCache::prune()
+{
+    struct File {
+        std::string name;
+        std::int64_t mtime;
+        std::size_t size;
+    };
+
+    DIR *dir = ::opendir(_directory.c_str());
+    if (!dir) {
+        return;
+    }
+
+    std::vector<File> files;
+    std::size_t total = 0;
+
+    while (struct ::dirent *e = ::readdir(dir)) {
+        std::string name = e->d_name;
+        std::string const suffix = ".klicksample";
+
+        struct ::stat st;
+        if (name.size() <= suffix.size() || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0 ||
+                ::stat((_directory + "/" + name).c_str(), &st) == -1) {
+            continue;
+        }
+
+        files.push_back(File { _directory + "/" + name, st.st_mtim.tv_sec, static_cast<std::size_t>(st.st_size) });
+        total += st.st_size;
+    }
+
+    ::closedir(dir);
+
+    // oldest first. files that are mapped by a running instance stay valid after
+    // they're removed
+    std::sort(files.begin(), files.end(), [](File const & a, File const & b) { return a.mtime < b.mtime; });
+
+    for (auto i = files.begin(); i != files.end() && total > _max_disk_bytes; ++i) {
+        if (std::remove(i->name.c_str()) == 0) {
+            logv << "removed sample cache file '" << i->name << "'" << std::endl;
+            total -= i->size;
+        }
+    }
+}
+
+
+std::size_t SampleCache::bytes(AudioChunk const & chunk)
+{
+    return chunk.length() * sizeof(sample_t);
+}
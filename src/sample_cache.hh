@@ -0,0 +1,121 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_SAMPLE_CACHE_HH
+#define KLICK_SAMPLE_CACHE_HH
+
+#include "audio.hh"
+#include "audio_chunk.hh"
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <boost/noncopyable.hpp>
+
+
+/*
+ * keeps processed audio chunks, so that going back to a previous sound or setting doesn't
+ * load and convert the same file again. each file is decoded and resampled only once,
+ * regardless of pitch, and identical requests share the same chunk. volume isn't part of
+ * the chunk, it's applied during playback.
+ * converted chunks (before any pitch shift) are also written to files in a cache directory,
+ * and mapped from there the next time klick runs
+ */
+class SampleCache
+  : boost::noncopyable
+{
+  public:
+    // increase whenever the way chunks are processed changes
+    static int const PROCESSING_VERSION = 2;
+
+    static std::size_t const DEFAULT_MAX_BYTES = 32 << 20;
+    static std::size_t const DEFAULT_MAX_DISK_BYTES = 256 << 20;
+
+    // chunks are converted to the given samplerate. the least recently used ones are
+    // dropped once they take up more than max_bytes. if directory is empty, nothing is
+    // cached on disk, otherwise the least recently used files are removed once there are
+    // more than max_disk_bytes of them
+    SampleCache(nframes_t samplerate, std::size_t max_bytes = DEFAULT_MAX_BYTES,
+                std::string const & directory = std::string(),
+                std::size_t max_disk_bytes = DEFAULT_MAX_DISK_BYTES);
+
+    // klick's directory in the XDG cache directory, created if it doesn't exist.
+    // empty if there's no such directory and it can't be created
+    static std::string default_directory();
+
+    // get the chunk for a file (or silence if filename is empty), with pitch applied,
+    // converted at the given quality. the file is loaded again if it has been modified.
+    // may be called from any thread. throws if the file can't be loaded
+    AudioChunkConstPtr get(std::string const & filename, float pitch, AudioChunk::Quality quality);
+
+    // true if getting the chunk for a file at this pitch involves the samplerate
+    // converter, so that the quality makes a difference
+    bool converts(std::string const & filename, float pitch);
+
+    void clear();
+
+  private:
+    struct Key {
+        std::string filename;
+        std::int64_t mtime_sec;
+        std::int64_t mtime_nsec;
+        std::int64_t size;
+        nframes_t samplerate;
+        float pitch;
+        AudioChunk::Quality quality;
+        int version;
+
+        bool operator<(Key const & k) const;
+    };
+
+    struct Entry {
+        AudioChunkConstPtr chunk;
+        std::uint64_t last_used;
+    };
+
+    // key for the file as it is, unpitched
+    Key file_key(std::string const & filename, AudioChunk::Quality quality) const;
+    // samplerate of the file, 0 if it can't be read
+    nframes_t source_samplerate(Key const & k);
+
+    AudioChunkConstPtr find(Key const & k);
+    AudioChunkConstPtr insert(Key const & k, AudioChunkConstPtr chunk);
+
+    // map a chunk from its cache file, NULL if there's no valid file for this key
+    AudioChunkConstPtr load(Key const & k);
+    // write a chunk to its cache file. errors are ignored
+    void save(Key const & k, AudioChunk const & chunk);
+    // remove the least recently used cache files while the directory is too large
+    void prune();
+
+    static std::uint64_t key_hash(Key const & k);
+    std::string cache_filename(Key const & k) const;
+
+    // report how long loading or converting a chunk took
+    static void log_time(char const *what, Key const & k, std::chrono::steady_clock::time_point start);
+    static std::size_t bytes(AudioChunk const & chunk);
+
+    nframes_t _samplerate;
+    std::size_t _max_bytes;
+    std::string _directory;
+    std::size_t _max_disk_bytes;
+
+    std::mutex _mutex;
+    std::map<Key, Entry> _chunks;
+    std::map<Key, nframes_t> _source_samplerates;
+    std::size_t _bytes;
+    std::uint64_t _uses;
+};
+
+
+#endif // KLICK_SAMPLE_CACHE_HH
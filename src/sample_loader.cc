@@ -0,0 +1,127 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "sample_loader.hh"
+#include "sample_cache.hh"
+#include "audio_chunk.hh"
+
+#include <stdexcept>
+#include <memory>
+#include <algorithm>
+
+#include <unistd.h>
+
+
+namespace {
+
+// read one sample from each page, so the audio thread doesn't take page faults
+// when it first plays the chunk
+void prefault(AudioChunk const & chunk)
+{
+    static long const page = ::sysconf(_SC_PAGESIZE);
+    std::size_t step = std::max<std::size_t>(page / sizeof(sample_t), 1);
+
+    volatile sample_t sink = 0.0f;
+    for (nframes_t n = 0; n < chunk.length(); n += step) {
+        sink = chunk.samples()[n];
+    }
+    (void)sink;
+}
+
+}
+
+
+SampleLoader::SampleLoader(SampleCache & cache, nframes_t samplerate)
+  : _cache(cache)
+  , _samplerate(samplerate)
+  , _quit(false)
+{
+    _thread = std::thread(&SampleLoader::run, this);
+}
+
+
+SampleLoader::~SampleLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _cond.notify_one();
+    _thread.join();
+}
+
+
+void SampleLoader::load(Job const & job)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _jobs.push_back(job);
+    }
+    _cond.notify_one();
+}
+
+
+bool SampleLoader::poll(Result & result)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_results.empty()) {
+        return false;
+    }
+
+    result = _results.front();
+    _results.pop_front();
+    return true;
+}
+
+
+void SampleLoader::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (;;) {
+        _cond.wait(lock, [this]{ return _quit || !_jobs.empty(); });
+        if (_quit) {
+            return;
+        }
+
+        Job job = _jobs.front();
+        _jobs.pop_front();
+
+        lock.unlock();
+
+        Result r;
+        r.job = job;
+        r.emphasis = load_file(job.emphasis, job.pitch_emphasis, job.quality, r.error_emphasis);
+        r.normal = load_file(job.normal, job.pitch_normal, job.quality, r.error_normal);
+
+        lock.lock();
+        _results.push_back(r);
+    }
+}
+
+
+AudioChunkConstPtr SampleLoader::load_file(std::string const & filename, float pitch,
+                                           AudioChunk::Quality quality, std::string & error)
+{
+    AudioChunkConstPtr chunk;
+
+    try {
+        chunk = _cache.get(filename, pitch, quality);
+    }
+    catch (std::runtime_error const & e) {
+        error = e.what();
+        chunk = std::make_shared<AudioChunk>(_samplerate);
+    }
+
+    prefault(*chunk);
+    return chunk;
+}
@@ -0,0 +1,85 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_SAMPLE_LOADER_HH
+#define KLICK_SAMPLE_LOADER_HH
+
+#include "audio.hh"
+#include "audio_chunk.hh"
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <boost/noncopyable.hpp>
+
+
+class SampleCache;
+
+
+/*
+ * loads and converts the click sounds in a separate thread, so that long samples
+ * don't hold up whoever asked for them
+ */
+class SampleLoader
+  : boost::noncopyable
+{
+  public:
+
+    struct Job {
+        std::string emphasis;
+        std::string normal;
+        float pitch_emphasis;
+        float pitch_normal;
+        AudioChunk::Quality quality;
+        bool custom;        // files given by the user, rather than one of the built-in sounds
+    };
+
+    struct Result {
+        Job job;
+        // silence for files that couldn't be loaded
+        AudioChunkConstPtr emphasis;
+        AudioChunkConstPtr normal;
+        // empty if the file was loaded successfully
+        std::string error_emphasis;
+        std::string error_normal;
+    };
+
+    SampleLoader(SampleCache & cache, nframes_t samplerate);
+    ~SampleLoader();
+
+    // queue a job. jobs are processed one at a time, in the order they were queued
+    void load(Job const & job);
+
+    // get the next finished job. returns false if there is none
+    bool poll(Result & result);
+
+  private:
+
+    void run();
+    AudioChunkConstPtr load_file(std::string const & filename, float pitch,
+                                 AudioChunk::Quality quality, std::string & error);
+
+    SampleCache & _cache;
+    nframes_t _samplerate;
+
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Job> _jobs;
+    std::deque<Result> _results;
+
+    bool _quit;
+    std::thread _thread;
+};
+
+
+#endif // KLICK_SAMPLE_LOADER_HH
@@ -18,58 +18,25 @@
 #include <functional>
 #include <algorithm>
 #include <regex>
+#include <thread>
+#include <exception>
+#include <system_error>
+#include <limits>
 #include <cmath>
 #include <cstdlib>
-#include <boost/tokenizer.hpp>
+#include <cstring>
+#include <cstdint>
+
+#include <sys/stat.h>
 
 #include "util/string.hh"
 #include "util/lexical_cast.hh"
 
-typedef boost::char_separator<char> char_sep;
-typedef boost::tokenizer<char_sep> tokenizer;
-
 
-#define LABEL   "([[:alnum:]_-]+)"
 #define INT     "([[:digit:]]+)"
 #define FLOAT   "([[:digit:]]+(\\.[[:digit:]]*)?|\\.[[:digit:]]+)"
 #define PATTERN "([Xx.]+)"
 
-// matches a line that contains nothing but whitespace or comments
-static std::regex const REGEX_BLANK(
-    "^[[:blank:]]*(#.*)?$",
-    std::regex_constants::extended
-);
-
-// matches any valid line in a tempomap file
-static std::regex const REGEX_VALID(
-    // label
-    "^[[:blank:]]*(" LABEL ":)?" \
-    // bars
-    "[[:blank:]]*" INT "" \
-    // meter
-    "([[:blank:]]+" INT "/" INT ")?" \
-    // tempo
-    "[[:blank:]]+" FLOAT "(-" FLOAT "|((," FLOAT ")*))?" \
-    // pattern
-    "([[:blank:]]+" PATTERN ")?" \
-    // volume
-    "([[:blank:]]+" FLOAT ")?" \
-    // comment
-    "[[:blank:]]*(#.*)?$",
-    std::regex_constants::extended
-);
-
-static int const IDX_LABEL   =  2,
-                 IDX_BARS    =  3,
-                 IDX_BEATS   =  5,
-                 IDX_DENOM   =  6,
-                 IDX_TEMPO   =  7,
-                 IDX_TEMPO2  = 10,
-                 IDX_TEMPI   = 12,
-                 IDX_PATTERN = 17,
-                 IDX_VOLUME  = 19;
-
-
 // matches valid tempo parameters on the command line
 static std::regex const REGEX_CMDLINE(
     // bars
@@ -91,12 +58,115 @@ static int const IDX_BARS_CMD    =  2,
                  IDX_ACCEL_CMD   = 11,
                  IDX_PATTERN_CMD = 14;
 
-#undef LABEL
 #undef INT
 #undef FLOAT
 #undef PATTERN
 
 
+/*
+ * tokenizer for tempomap files. a valid line looks like this:
+ *
+ *   [label:] bars [beats/denom] tempo[-tempo2|,tempo...] [pattern] [volume] [# comment]
+ *
+ * all functions advance p past whatever they consumed, and never throw.
+ * numbers that don't fit into their type set the overflow flag instead of failing,
+ * so that syntax errors take precedence
+ */
+static char const * const MALFORMED_ENTRY = "malformed tempo map entry";
+static char const * const OUT_OF_RANGE = "number out of range";
+
+// files larger than this are split into chunks that are parsed in parallel
+static std::size_t const PARALLEL_CHUNK_SIZE = 1 << 20;
+
+static inline bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_label_char(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '-';
+}
+
+static inline bool is_pattern_char(char c) {
+    return c == 'X' || c == 'x' || c == '.';
+}
+
+// returns the number of blanks skipped
+static inline std::size_t skip_blanks(char const *& p, char const *end)
+{
+    char const *begin = p;
+    while (p != end && is_blank(*p)) ++p;
+    return p - begin;
+}
+
+// true if p is at the end of a token
+static inline bool at_separator(char const *p, char const *end)
+{
+    return p == end || is_blank(*p) || *p == '#';
+}
+
+static bool parse_int(char const *& p, char const *end, int & value, bool & overflow)
+{
+    if (p == end || !is_digit(*p)) {
+        return false;
+    }
+    long long v = 0;
+    for ( ; p != end && is_digit(*p); ++p) {
+        v = v * 10 + (*p - '0');
+        if (v > std::numeric_limits<int>::max()) {
+            v = 0;
+            overflow = true;
+        }
+    }
+    value = static_cast<int>(v);
+    return true;
+}
+
+static bool parse_float(char const *& p, char const *end, float & value, bool & overflow)
+{
+    // keep no more significant digits than fit into the mantissa, and count the
+    // remaining ones in the exponent
+    static std::uint64_t const MANTISSA_LIMIT = 100000000000000000ULL;
+
+    std::uint64_t mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+
+    for ( ; p != end && is_digit(*p); ++p) {
+        if (mantissa < MANTISSA_LIMIT) {
+            mantissa = mantissa * 10 + (*p - '0');
+        } else {
+            ++exponent;
+        }
+        digits = true;
+    }
+    if (p != end && *p == '.' && (digits || (p + 1 != end && is_digit(p[1])))) {
+        for (++p; p != end && is_digit(*p); ++p) {
+            if (mantissa < MANTISSA_LIMIT) {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exponent;
+            }
+        }
+        digits = true;
+    }
+    if (!digits) {
+        return false;
+    }
+
+    double v = static_cast<double>(mantissa);
+    v = exponent < 0 ? v / std::pow(10.0, -exponent) : v * std::pow(10.0, exponent);
+    if (v > std::numeric_limits<float>::max()) {
+        v = 0.0;
+        overflow = true;
+    }
+    value = static_cast<float>(v);
+    return true;
+}
+
+
 TempoMap::Pattern TempoMap::parse_pattern(std::string const &s, int nbeats)
 {
     Pattern pattern;
@@ -127,35 +197,193 @@ std::string TempoMap::pattern_to_string(Pattern const & p)
 }
 
 
-std::vector<float> TempoMap::parse_tempi(std::string const &s, float tempo1, int nbeats_total)
+char const * TempoMap::validate_entry(Entry const & e)
 {
-    std::vector<float> tempi;
-
-    char_sep sep(",");
-    tokenizer tok(s, sep);
-    if (std::distance(tok.begin(), tok.end()) != nbeats_total - 1) {
-        throw ParseError("number of tempo values doesn't match number of beats");
+    if ((e.tempo <= 0 && e.tempi.empty()) ||
+        std::find_if(e.tempi.begin(), e.tempi.end(),
+                     std::bind(std::less_equal<float>(), std::placeholders::_1, 0.0f)) != e.tempi.end()) {
+        return "tempo must be greater than zero";
+    }
+    if (e.bars <= 0 && e.bars != -1) {
+        return "number of bars must be greater than zero";
     }
-    tempi.push_back(tempo1);
-    for (auto t : tok) {
-        tempi.push_back(das::lexical_cast<float>(t));
+    if (e.beats <= 0 || e.denom <= 0) {
+        return "invalid time signature";
     }
-    return tempi;
+    return NULL;
 }
 
 
 void TempoMap::check_entry(Entry const & e)
 {
-    if ((e.tempo <= 0 && e.tempi.empty()) ||
-        std::find_if(e.tempi.begin(), e.tempi.end(),
-                     std::bind(std::less_equal<float>(), std::placeholders::_1, 0.0f)) != e.tempi.end()) {
-        throw ParseError("tempo must be greater than zero");
+    if (char const *error = validate_entry(e)) {
+        throw ParseError(error);
     }
-    if (e.bars <= 0 && e.bars != -1) {
-        throw ParseError("number of bars must be greater than zero");
+}
+
+
+char const * TempoMap::parse_line(char const *p, char const *end, Entry & e, bool & blank)
+{
+    bool overflow = false;
+
+    skip_blanks(p, end);
+    blank = (p == end || *p == '#');
+    if (blank) {
+        return NULL;
     }
-    if (e.beats <= 0 || e.denom <= 0) {
-        throw ParseError("invalid time signature");
+
+    // label
+    char const *q = p;
+    while (q != end && is_label_char(*q)) ++q;
+    if (q != p && q != end && *q == ':') {
+        e.label.assign(p, q);
+        p = q + 1;
+        skip_blanks(p, end);
+    }
+
+    // bars
+    if (!parse_int(p, end, e.bars, overflow)) return MALFORMED_ENTRY;
+    if (!skip_blanks(p, end)) return MALFORMED_ENTRY;
+
+    // meter, if the next number is followed by a slash
+    for (q = p; q != end && is_digit(*q); ++q) { }
+    if (q != p && q != end && *q == '/') {
+        if (!parse_int(p, end, e.beats, overflow)) return MALFORMED_ENTRY;
+        ++p;
+        if (!parse_int(p, end, e.denom, overflow)) return MALFORMED_ENTRY;
+        if (!skip_blanks(p, end)) return MALFORMED_ENTRY;
+    } else {
+        e.beats = 4;
+        e.denom = 4;
+    }
+
+    // tempo
+    if (!parse_float(p, end, e.tempo, overflow)) return MALFORMED_ENTRY;
+    if (p != end && *p == '-') {
+        ++p;
+        if (!parse_float(p, end, e.tempo2, overflow)) return MALFORMED_ENTRY;
+    }
+    else if (p != end && *p == ',') {
+        e.tempi.push_back(e.tempo);
+        while (p != end && *p == ',') {
+            float t;
+            ++p;
+            if (!parse_float(p, end, t, overflow)) return MALFORMED_ENTRY;
+            e.tempi.push_back(t);
+        }
+    }
+
+    bool separated = skip_blanks(p, end);
+
+    // pattern
+    char const *pattern = p, *pattern_end = p;
+    if (separated && p != end && is_pattern_char(*p)) {
+        for (q = p; q != end && is_pattern_char(*q); ++q) { }
+        if (at_separator(q, end)) {
+            pattern_end = p = q;
+            separated = skip_blanks(p, end);
+        }
+    }
+
+    // volume
+    e.volume = 1.0f;
+    if (separated && p != end && *p != '#') {
+        if (!parse_float(p, end, e.volume, overflow)) return MALFORMED_ENTRY;
+        skip_blanks(p, end);
+    }
+
+    // anything else must be a comment
+    if (p != end && *p != '#') {
+        return MALFORMED_ENTRY;
+    }
+    if (overflow) {
+        return OUT_OF_RANGE;
+    }
+
+    if (pattern_end != pattern) {
+        if (pattern_end - pattern != e.beats) {
+            return "pattern length doesn't match number of beats";
+        }
+        e.pattern.resize(e.beats);
+        for (int n = 0; n < e.beats; ++n) {
+            e.pattern[n] = (pattern[n] == 'X') ? BEAT_EMPHASIS :
+                           (pattern[n] == 'x') ? BEAT_NORMAL : BEAT_SILENT;
+        }
+    }
+
+    if (!e.tempi.empty()) {
+        if (static_cast<long long>(e.tempi.size()) != static_cast<long long>(e.bars) * e.beats) {
+            return "number of tempo values doesn't match number of beats";
+        }
+        e.tempo = 0.0f;
+    }
+
+    return validate_entry(e);
+}
+
+
+TempoMap::Entry TempoMap::parse_entry(std::string const & s)
+{
+    Entry e = Entry();
+    bool blank;
+
+    char const *error = parse_line(s.data(), s.data() + s.size(), e, blank);
+    if (!error && blank) {
+        error = "no tempo map entry";
+    }
+    if (error) {
+        throw ParseError(das::make_string() << error << ":\n" << s);
+    }
+    return e;
+}
+
+
+static_assert(sizeof(TempoMap::Segment) == 32, "segments should fit into half a cache line");
+
+std::uint64_t const TempoMap::Timeline::NO_BEATS;
+
+
+void TempoMap::Timeline::compile(Entries const & entries)
+{
+    segments.clear();
+    tempi.clear();
+    patterns.clear();
+
+    segments.reserve(entries.size());
+
+    for (auto & e : entries) {
+        Segment s = Segment();
+
+        if (!e.tempo) {
+            s.type = Segment::PER_BEAT;
+            s.tempo = e.tempi[0];
+            s.tempi = static_cast<std::uint32_t>(tempi.size());
+            tempi.insert(tempi.end(), e.tempi.begin(), e.tempi.end());
+        } else if (e.tempo2 && e.tempo2 != e.tempo) {
+            s.type = Segment::RAMP;
+            s.tempo = e.tempo;
+            s.tempo2 = e.tempo2;
+        } else {
+            s.type = Segment::CONSTANT;
+            s.tempo = e.tempo;
+        }
+
+        s.bars = e.bars;
+        s.beats = e.beats;
+        s.denom = e.denom;
+        s.volume = e.volume;
+
+        s.default_pattern = e.pattern.empty();
+        s.pattern = static_cast<std::uint32_t>(patterns.size());
+
+        for (std::size_t n = 0; n < e.pattern.size(); ++n) {
+            if (n % 32 == 0) {
+                patterns.push_back(0);
+            }
+            patterns.back() |= static_cast<std::uint64_t>(e.pattern[n]) << (n % 32 * 2);
+        }
+
+        segments.push_back(s);
     }
 }
 
@@ -166,7 +394,7 @@ std::string TempoMap::dump() const
 
     os << std::fixed << std::setprecision(2);
 
-    for (auto e : _entries) {
+    for (auto e : entries()) {
         // label
         os << (e.label.length() ? e.label : "-") << ": ";
         // bars
@@ -210,11 +438,106 @@ TempoMapPtr TempoMap::join(TempoMapConstPtr const m1, TempoMapConstPtr const m2)
 
     std::copy(m1->entries().begin(), m1->entries().end(), p);
     std::copy(m2->entries().begin(), m2->entries().end(), p);
+    map->index_labels();
 
     return map;
 }
 
 
+TempoMap::Diff TempoMap::insert(std::size_t n, Entry const & e)
+{
+    check_entry(e);
+    unpack();
+    _entries.insert(_entries.begin() + n, e);
+    edited();
+
+    Diff d = { n, n, n + 1 };
+    return d;
+}
+
+
+TempoMap::Diff TempoMap::remove(std::size_t n)
+{
+    unpack();
+    _entries.erase(_entries.begin() + n);
+    edited();
+
+    Diff d = { n, n + 1, n };
+    return d;
+}
+
+
+TempoMap::Diff TempoMap::replace(std::size_t n, Entry const & e)
+{
+    check_entry(e);
+    unpack();
+    _entries[n] = e;
+    edited();
+
+    Diff d = { n, n + 1, n + 1 };
+    return d;
+}
+
+
+TempoMap::Diff TempoMap::diff(TempoMap const & a, TempoMap const & b)
+{
+    std::size_t na = a.size(), nb = b.size();
+
+    // skip identical entries at the start and end
+    std::size_t begin = 0;
+    while (begin < na && begin < nb && a[begin] == b[begin]) {
+        ++begin;
+    }
+    std::size_t end = 0;
+    while (end < na - begin && end < nb - begin && a[na - end - 1] == b[nb - end - 1]) {
+        ++end;
+    }
+
+    Diff d = { begin, na - end, nb - end };
+    return d;
+}
+
+
+TempoMap::Diff TempoMap::Diff::then(Diff const & d) const
+{
+    if (empty()) {
+        return d;
+    }
+    if (d.empty()) {
+        return *this;
+    }
+
+    // everything from here on is unchanged by both edits, in the intermediate tempomap
+    std::size_t end = std::max(new_end, d.old_end);
+
+    Diff r = { std::min(begin, d.begin), end - new_end + old_end, end - d.old_end + d.new_end };
+    return r;
+}
+
+
+void TempoMap::edited()
+{
+    index_labels();
+
+    _timeline.reset();
+    _cache_filename.clear();
+    _source = Source();
+}
+
+
+void TempoMap::index_labels()
+{
+    _labels.clear();
+
+    for (std::size_t n = 0; n != _entries.size(); ++n) {
+        if (!_entries[n].label.empty()) {
+            // the first entry wins if a label is used more than once
+            _labels.emplace(_entries[n].label, n);
+        }
+    }
+}
+
+
 /*
  * loads tempomap from a file
  */
@@ -222,11 +545,35 @@ TempoMapPtr TempoMap::new_from_file(std::string const & filename)
 {
     std::istream *input;
     std::shared_ptr<std::ifstream> file;
+    std::string cache;
+    Source source = Source();
 
     if (filename == "-") {
         input = &std::cin;
     }
     else {
+        if (is_binary(filename)) {
+            return load_binary(filename);
+        }
+
+        // if the text hasn't been touched since the cache was written, it's not even read
+        struct stat st;
+        if (::stat(filename.c_str(), &st) == 0) {
+            source.size = st.st_size;
+            source.mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            cache = cache_filename(filename);
+
+            try {
+                TempoMapPtr map = load_binary(cache, &source);
+                if (map) {
+                    return map;
+                }
+            }
+            catch (std::runtime_error const &) {
+                // broken cache file, will be overwritten
+            }
+        }
+
         file = std::make_shared<std::ifstream>(filename.c_str());
 
         if (!file->is_open()) {
@@ -236,52 +583,154 @@ TempoMapPtr TempoMap::new_from_file(std::string const & filename)
         input = file.get();
     }
 
-    auto map = std::make_shared<TempoMap>();
+    std::ostringstream contents;
+    contents << input->rdbuf();
+    std::string const data = contents.str();
 
-    std::string line;
-    int lineno = 0;
+    if (cache.empty()) {
+        return parse(data);
+    }
 
-    while (!input->eof()) {
-        std::getline(*input, line);
-        lineno++;
+    // the file was touched, but may still be the same
+    source.hash = hash(data);
 
-        // discard blank lines right away
-        if (std::regex_match(line, REGEX_BLANK)) {
-            continue;
-        }
+    TempoMapPtr map;
 
-        try {
-            // check if this line matches the regex
-            std::smatch matches;
-            if (!std::regex_match(line, matches, REGEX_VALID)) {
-                throw ParseError("malformed tempo map entry");
-            }
+    try {
+        map = load_binary(cache, &source);
+    }
+    catch (std::runtime_error const &) {
+    }
 
-            Entry e;
+    if (!map) {
+        map = parse(data);
+        map->_source = source;
+        map->_cache_filename = cache;
+    }
 
-            e.label   = matches[IDX_LABEL];
-            e.bars    = das::lexical_cast<int>(matches[IDX_BARS]);
-            e.tempo   = das::lexical_cast<float>(matches[IDX_TEMPO]);
-            e.tempo2  = das::lexical_cast<float>(matches[IDX_TEMPO2], 0);
-            e.beats   = das::lexical_cast<int>(matches[IDX_BEATS], 4);
-            e.denom   = das::lexical_cast<int>(matches[IDX_DENOM], 4);
-            e.pattern = parse_pattern(matches[IDX_PATTERN], e.beats);
-            e.volume  = das::lexical_cast<float>(matches[IDX_VOLUME], 1.0f);
+    // store the new size and mtime
+    map->update_cache();
 
-            if (matches[IDX_TEMPI].length()) {
-                e.tempi = parse_tempi(matches[IDX_TEMPI], e.tempo, e.beats * e.bars);
-                e.tempo = 0.0f;
+    return map;
+}
+
+
+/*
+ * parses the contents of a tempomap file
+ */
+TempoMapPtr TempoMap::parse(std::string const & data)
+{
+    struct Chunk {
+        char const *begin, *end;
+        Entries entries;
+        int lines;                  // number of lines parsed
+        char const *error;          // first error in this chunk, if any
+        char const *error_line;
+        char const *error_line_end;
+        std::exception_ptr exception;   // anything else thrown while parsing this chunk
+    };
+
+    auto parse_chunk = [](Chunk & c) {
+        c.lines = 0;
+        c.error = NULL;
+        char const *p = c.begin;
+        for (;;) {
+            char const *eol = static_cast<char const *>(std::memchr(p, '\n', c.end - p));
+            if (!eol) eol = c.end;
+            c.lines++;
+
+            Entry e = Entry();
+            bool blank;
+            if ((c.error = parse_line(p, eol, e, blank))) {
+                c.error_line = p;
+                c.error_line_end = eol;
+                return;
+            }
+            if (!blank) {
+                c.entries.push_back(std::move(e));
             }
 
-            check_entry(e);
-            map->_entries.push_back(e);
+            if (eol == c.end) return;
+            p = eol + 1;
+        }
+    };
+
+    // split the file into chunks of whole lines
+    std::size_t nchunks = std::min<std::size_t>(data.size() / PARALLEL_CHUNK_SIZE,
+                                                std::thread::hardware_concurrency());
+    nchunks = std::max<std::size_t>(nchunks, 1);
+
+    std::vector<Chunk> chunks(nchunks);
+    char const *p = data.data(), *end = data.data() + data.size();
+    for (std::size_t n = 0; n < nchunks; ++n) {
+        chunks[n].begin = p;
+        if (n == nchunks - 1) {
+            p = end;
+        } else {
+            p = std::max(p, data.data() + data.size() * (n + 1) / nchunks);
+            char const *eol = static_cast<char const *>(std::memchr(p, '\n', end - p));
+            p = eol ? eol : end;
+        }
+        // the newline belongs to neither chunk
+        chunks[n].end = p;
+        if (p != end) ++p;
+    }
+
+    // nothing may escape a worker thread, e.g. std::bad_alloc. it's passed on once
+    // all threads have been joined
+    auto parse_chunk_safely = [&parse_chunk](Chunk & c) {
+        try {
+            parse_chunk(c);
         }
-        catch (ParseError const & e) {
-            throw ParseError(das::make_string() << e.what() << ":\n"
-                                << "line " << lineno << ": " << line);
+        catch (...) {
+            c.exception = std::current_exception();
         }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(nchunks);
+    for (std::size_t n = 1; n < nchunks; ++n) {
+        try {
+            threads.emplace_back(parse_chunk_safely, std::ref(chunks[n]));
+        }
+        catch (std::system_error const &) {
+            // can't start another thread, parse this chunk right here
+            parse_chunk_safely(chunks[n]);
+        }
+    }
+    parse_chunk_safely(chunks[0]);
+    for (auto & t : threads) {
+        t.join();
     }
 
+    for (auto & c : chunks) {
+        if (c.exception) {
+            std::rethrow_exception(c.exception);
+        }
+    }
+
+    auto map = std::make_shared<TempoMap>();
+
+    std::size_t nentries = 0;
+    for (auto & c : chunks) {
+        nentries += c.entries.size();
+    }
+    map->_entries.reserve(nentries);
+
+    int lineno = 0;
+
+    for (auto & c : chunks) {
+        if (c.error) {
+            throw ParseError(das::make_string() << c.error << ":\n"
+                                << "line " << lineno + c.lines << ": "
+                                << std::string(c.error_line, c.error_line_end));
+        }
+        std::move(c.entries.begin(), c.entries.end(), std::back_inserter(map->_entries));
+        lineno += c.lines;
+    }
+
+    map->index_labels();
+
     return map;
 }
 
@@ -14,8 +14,13 @@
 
 #include <string>
 #include <vector>
+#include <unordered_map>
 #include <memory>
 #include <stdexcept>
+#include <cstdint>
+
+#include "util/aligned_allocator.hh"
+#include "util/mapped_vector.hh"
 
 typedef std::shared_ptr<class TempoMap> TempoMapPtr;
 typedef std::shared_ptr<class TempoMap const> TempoMapConstPtr;
@@ -49,35 +54,168 @@ class TempoMap
         int denom;
         Pattern pattern;                // empty if default
         float volume;
+
+        bool operator==(Entry const & e) const {
+            return label == e.label && bars == e.bars && tempo == e.tempo && tempo2 == e.tempo2
+                && tempi == e.tempi && beats == e.beats && denom == e.denom
+                && pattern == e.pattern && volume == e.volume;
+        }
+        bool operator!=(Entry const & e) const { return !(*this == e); }
     };
 
     typedef std::vector<Entry> Entries;
 
-    // get all entries
-    Entries const & entries() const { return _entries; }
+    /*
+     * how a tempomap was edited: entries [begin, old_end) were replaced by entries
+     * [begin, new_end) of the new tempomap, all others are unchanged
+     */
+    struct Diff {
+        std::size_t begin;
+        std::size_t old_end;
+        std::size_t new_end;
+
+        bool empty() const { return begin == old_end && begin == new_end; }
+
+        // the combined edit of this one, followed by d
+        Diff then(Diff const & d) const;
+    };
+
+    /*
+     * compact form of an entry, used during playback. the type of tempo is decided once,
+     * and the segment fits into half a cache line
+     */
+    struct Segment {
+        enum Type : std::uint8_t {
+            CONSTANT,       // tempo for the whole segment
+            RAMP,           // gradual change from tempo to tempo2
+            PER_BEAT        // one tempo for each beat, starting at index tempi
+        };
+
+        Type type;
+        bool default_pattern;   // emphasis on the first beat, no pattern stored
+        int bars;               // -1 means play ad infinitum
+        int beats;
+        int denom;
+        float tempo;            // tempo of the first beat
+        float volume;
+        union {
+            float tempo2;           // RAMP
+            std::uint32_t tempi;    // PER_BEAT
+        };
+        std::uint32_t pattern;  // index of the first pattern word
+
+        // type of a beat, patterns are stored with two bits per beat
+        BeatType beat_type(int beat, std::uint64_t const *patterns) const {
+            if (default_pattern) {
+                return beat == 0 ? BEAT_EMPHASIS : BEAT_NORMAL;
+            }
+            return static_cast<BeatType>((patterns[pattern + beat / 32] >> (beat % 32 * 2)) & 3);
+        }
+    };
+
+    /*
+     * everything needed to play a tempomap: its entries as segments, and the start of each
+     * entry and each beat at one samplerate and the original tempo, as calculated by Position.
+     * the whole timeline is stored in compiled tempomap files, and used straight from there
+     */
+    struct Timeline {
+        // convert entries to segments, filling the tempi and pattern arenas
+        void compile(Entries const & entries);
+
+        // aligned so that no segment straddles two cache lines
+        das::mapped_vector<Segment, das::aligned_allocator<Segment, 64> > segments;
+        das::mapped_vector<float> tempi;
+        das::mapped_vector<std::uint64_t> patterns;
+
+        double samplerate;
+        das::mapped_vector<double> start_frames;
+        das::mapped_vector<std::int32_t> start_bars;
+        das::mapped_vector<std::int32_t> start_beats;
+        das::mapped_vector<double> beat_frames;
+        // NO_BEATS if the entry has no beat table
+        das::mapped_vector<std::uint64_t> beat_index;
+
+        static std::uint64_t const NO_BEATS = static_cast<std::uint64_t>(-1);
+
+        // the compiled tempomap file the tables point into, if any
+        std::shared_ptr<void const> file;
+    };
+
+    /*
+     * identifies the contents of a text tempomap file, to check if its cache is up to date
+     */
+    struct Source {
+        std::uint64_t size;
+        std::int64_t mtime;     // in nanoseconds
+        std::uint64_t hash;     // zero if unknown
+    };
+
+    TempoMap()
+      : _source()
+    {
+    }
+
+    // get all entries. for compiled tempomaps, they're only unpacked the first time
+    // they're needed, e.g. for editing or dumping the tempomap
+    Entries const & entries() const;
     // get n'th entry
-    Entry const & entry(std::size_t n) const { return _entries[n]; }
-    Entry const & operator[](std::size_t n) const { return _entries[n]; }
+    Entry const & entry(std::size_t n) const { return entries()[n]; }
+    Entry const & operator[](std::size_t n) const { return entries()[n]; }
     // get number of entries
-    std::size_t size() const { return _entries.size(); }
+    std::size_t size() const;
+
+    // true if the last entry is played ad infinitum
+    bool infinite() const;
 
     // get entry with label l, NULL if no such entry exists
     Entry const * entry(std::string const & l) const {
-        if (l.empty()) return NULL;
-        for (auto & e : _entries) {
-            if (e.label == l) return &e;
-        }
-        return NULL;
+        int n = index(l);
+        return n != -1 ? &entries()[n] : NULL;
     }
 
+    // get index of the first entry with label l, -1 if no such entry exists
+    int index(std::string const & l) const;
+
     void add(Entry const & e) {
+        unpack();
+        if (!e.label.empty()) {
+            _labels.emplace(e.label, _entries.size());
+        }
         _entries.push_back(e);
     }
 
+    // edit the n'th entry. the tempomap is no longer backed by its cache file afterwards,
+    // and its timeline is dropped
+    Diff insert(std::size_t n, Entry const & e);
+    Diff remove(std::size_t n);
+    Diff replace(std::size_t n, Entry const & e);
+
+    // find the entries that differ between two tempomaps
+    static Diff diff(TempoMap const & a, TempoMap const & b);
+
     std::string dump() const;
 
+    // precomputed timeline for the given samplerate, NULL if there is none
+    std::shared_ptr<Timeline const> timeline(double samplerate) const {
+        return _timeline && _timeline->samplerate == samplerate ? _timeline : std::shared_ptr<Timeline const>();
+    }
+    void set_timeline(std::shared_ptr<Timeline const> t) { _timeline = t; }
+
+    // write the tempomap and its timeline to a binary file, which can be loaded
+    // without parsing
+    void write_binary(std::string const & filename) const;
+
+    // file this tempomap is cached in, empty if it's not cached
+    std::string const & cache_filename() const { return _cache_filename; }
+    // rewrite the cache file, e.g. after a timeline has been added.
+    // errors are ignored, the cache is just not updated
+    void update_cache() const;
+
     static TempoMapPtr join(TempoMapConstPtr const, TempoMapConstPtr const);
 
+    // loads a text or binary tempomap file. text files are compiled into a binary
+    // cache file next to the original, which is used instead as long as the text
+    // doesn't change
     static TempoMapPtr new_from_file(std::string const & filename);
     static TempoMapPtr new_from_cmdline(std::string const & line);
 
@@ -91,13 +229,50 @@ class TempoMap
 
     static std::string pattern_to_string(Pattern const & p);
 
+    // parses a single entry, in the same format as a line of a tempomap file
+    static Entry parse_entry(std::string const & s);
+
   private:
-    // parses a comma-separated tempo string
-    static std::vector<float> parse_tempi(std::string const &s, float tempo1, int nbeats_total);
+    // parses one line of a tempomap file without throwing. returns NULL on success,
+    // or an error message. blank is set if the line contains no entry
+    static char const * parse_line(char const *begin, char const *end, Entry & e, bool & blank);
 
+    // returns NULL if the entry is valid, or an error message
+    static char const * validate_entry(Entry const & e);
     static void check_entry(Entry const & e);
 
+    // parses the contents of a text file
+    static TempoMapPtr parse(std::string const & data);
+
+    // true if the file starts with the magic number of a compiled tempomap
+    static bool is_binary(std::string const & filename);
+    // loads a compiled tempomap. if source is given, returns NULL if the file doesn't exist
+    // or if it's not the cache of that source, which is decided by size and mtime, or by
+    // the hash if one is given. throws if the file is invalid
+    static TempoMapPtr load_binary(std::string const & filename, Source const *source = NULL);
+
+    static std::string cache_filename(std::string const & filename);
+    static std::uint64_t hash(std::string const & data);
+
+    // copy the entries out of the compiled tempomap, if any, before they're modified
+    void unpack();
+    // forget everything derived from the entries
+    void edited();
+    // rebuild the label index after entries have been added or moved
+    void index_labels();
+
     Entries _entries;
+    // index of the first entry with each label
+    std::unordered_map<std::string, std::size_t> _labels;
+
+    // compiled tempomap the entries are unpacked from, instead of _entries and _labels
+    class Binary;
+    std::shared_ptr<Binary const> _binary;
+
+    std::shared_ptr<Timeline const> _timeline;
+
+    std::string _cache_filename;
+    Source _source;
 };
 
 
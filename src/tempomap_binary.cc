@@ -0,0 +1,604 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tempomap.hh"
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "util/string.hh"
+
+
+/*
+ * compiled tempomap file layout. all sections follow the header in this order,
+ * each one padded to a multiple of 8 bytes, or 64 bytes before the segments:
+ *
+ *   EntryRecord entries[nentries]
+ *   char labels[label_bytes]
+ *   float tempi[ntempi]
+ *   uint64_t patterns[npatterns]
+ *   Segment segments[nentries]
+ *
+ * followed by the timeline, if samplerate is non-zero:
+ *
+ *   double start_frames[nentries + 1]
+ *   int32_t start_bars[nentries + 1]
+ *   int32_t start_beats[nentries + 1]
+ *   uint64_t beat_index[nentries]
+ *   double beat_frames[nbeat_frames]
+ *
+ * the tempi, patterns and segments are those of TempoMap::Timeline, so everything used
+ * during playback can be used straight from the mapped file.
+ * everything is stored in native byte order, files from other architectures are rejected
+ */
+namespace {
+
+char const MAGIC[8] = { 'K', 'L', 'I', 'C', 'K', 'M', 'A', 'P' };
+
+// increment whenever the layout or the meaning of any field changes
+std::uint32_t const FORMAT_VERSION = 2;
+std::uint32_t const BYTE_ORDER_MARK = 0x01020304;
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t source_hash;
+    std::uint64_t source_size;
+    std::int64_t source_mtime;
+    std::uint64_t nentries;
+    std::uint64_t label_bytes;
+    std::uint64_t ntempi;
+    std::uint64_t npatterns;
+    double samplerate;              // zero if there's no timeline
+    std::uint64_t nbeat_frames;
+};
+
+// what's needed to unpack an entry, in addition to its segment
+struct EntryRecord {
+    std::int32_t bars;
+    std::int32_t beats;
+    std::int32_t denom;
+    float tempo;
+    float tempo2;
+    float volume;
+    std::uint64_t label_offset;
+    std::uint64_t label_length;
+    std::uint64_t tempi_offset;
+    std::uint64_t ntempi;
+    std::uint64_t pattern_offset;   // in pattern words
+    std::uint64_t pattern_length;   // in beats
+};
+
+std::size_t const ALIGNMENT = 8;
+std::size_t const SEGMENT_ALIGNMENT = 64;
+
+
+struct InvalidFile
+  : public std::runtime_error
+{
+    InvalidFile(std::string const & filename)
+      : std::runtime_error(das::make_string() << "invalid compiled tempo map file '" << filename << "'")
+    {
+    }
+};
+
+
+class Writer
+{
+  public:
+    Writer(std::ostream & os) : _os(os), _pos(0) { }
+
+    template <typename T>
+    void write(T const *data, std::size_t count) {
+        std::size_t n = count * sizeof(T);
+        _os.write(reinterpret_cast<char const *>(data), n);
+        _pos += n;
+        pad(ALIGNMENT);
+    }
+
+    template <typename C>
+    void write(C const & v) {
+        write(v.data(), v.size());
+    }
+
+    void pad(std::size_t alignment) {
+        static char const padding[SEGMENT_ALIGNMENT] = { };
+        std::size_t n = (alignment - _pos % alignment) % alignment;
+        _os.write(padding, n);
+        _pos += n;
+    }
+
+  private:
+    std::ostream & _os;
+    std::size_t _pos;
+};
+
+
+class Reader
+{
+  public:
+    Reader(char const *data, std::size_t size, std::string const & filename)
+      : _data(data), _size(size), _pos(0), _filename(filename) { }
+
+    // returns a pointer to count elements of type T, which are valid as long as the file
+    // is mapped
+    template <typename T>
+    T const * read(std::uint64_t count) {
+        if (count > (_size - _pos) / sizeof(T)) {
+            throw InvalidFile(_filename);
+        }
+        T const *p = reinterpret_cast<T const *>(_data + _pos);
+        _pos = std::min(_size, _pos + (count * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT);
+        return p;
+    }
+
+    void skip_padding(std::size_t alignment) {
+        _pos = std::min(_size, (_pos + alignment - 1) / alignment * alignment);
+    }
+
+  private:
+    char const *_data;
+    std::size_t _size;
+    std::size_t _pos;
+    std::string const & _filename;
+};
+
+
+// keeps a file mapped as long as it exists
+class Mapping
+  : boost::noncopyable
+{
+  public:
+    Mapping(int fd, std::size_t size)
+      : _size(size)
+    {
+        _data = ::mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    ~Mapping() {
+        if (_data != MAP_FAILED) {
+            ::munmap(_data, _size);
+        }
+    }
+
+    bool valid() const { return _data != MAP_FAILED; }
+    char const * data() const { return static_cast<char const *>(_data); }
+
+  private:
+    void *_data;
+    std::size_t _size;
+};
+
+
+// the same invariants the parser guarantees, checked on the segment and the parts of the
+// file it refers to, so nothing needs to be copied
+bool valid_entry(EntryRecord const & r, TempoMap::Segment const & s, Header const & h,
+                 float const *tempi, std::uint64_t const *patterns)
+{
+    typedef TempoMap::Segment Segment;
+
+    if (r.label_length > h.label_bytes || r.label_offset > h.label_bytes - r.label_length ||
+        r.ntempi > h.ntempi || r.tempi_offset > h.ntempi - r.ntempi ||
+        r.pattern_offset > h.npatterns || (r.pattern_length + 31) / 32 > h.npatterns - r.pattern_offset) {
+        return false;
+    }
+    if ((r.bars <= 0 && r.bars != -1) || r.beats <= 0 || r.denom <= 0) {
+        return false;
+    }
+    if (s.bars != r.bars || s.beats != r.beats || s.denom != r.denom || s.volume != r.volume) {
+        return false;
+    }
+
+    if (r.ntempi) {
+        if (r.tempo || static_cast<long long>(r.ntempi) != static_cast<long long>(r.bars) * r.beats ||
+            s.type != Segment::PER_BEAT || s.tempi != r.tempi_offset || s.tempo != tempi[r.tempi_offset]) {
+            return false;
+        }
+        for (std::uint64_t n = r.tempi_offset; n != r.tempi_offset + r.ntempi; ++n) {
+            if (!(tempi[n] > 0.0f)) {
+                return false;
+            }
+        }
+    } else {
+        bool ramp = r.tempo2 && r.tempo2 != r.tempo;
+        if (!(r.tempo > 0.0f) || s.tempo != r.tempo || s.type != (ramp ? Segment::RAMP : Segment::CONSTANT) ||
+            (ramp && s.tempo2 != r.tempo2)) {
+            return false;
+        }
+    }
+
+    if (s.default_pattern != (r.pattern_length == 0) || s.pattern != r.pattern_offset) {
+        return false;
+    }
+    if (r.pattern_length) {
+        if (static_cast<long long>(r.pattern_length) != r.beats) {
+            return false;
+        }
+        for (int n = 0; n != r.beats; ++n) {
+            TempoMap::BeatType b = s.beat_type(n, patterns);
+            if (b < TempoMap::BEAT_EMPHASIS || b > TempoMap::BEAT_SILENT) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+} // namespace
+
+
+/*
+ * a mapped compiled tempomap. the entries and labels are only unpacked when they're
+ * needed, playback only uses the timeline
+ */
+class TempoMap::Binary
+  : boost::noncopyable
+{
+  public:
+    Binary(std::shared_ptr<void const> file, EntryRecord const *records, std::size_t size,
+           char const *labels, float const *tempi, std::uint64_t const *patterns)
+      : _file(file)
+      , _records(records)
+      , _size(size)
+      , _labels(labels)
+      , _tempi(tempi)
+      , _patterns(patterns)
+    {
+    }
+
+    std::size_t size() const { return _size; }
+    bool infinite() const { return _records[_size - 1].bars == -1; }
+
+    Entries const & entries() const {
+        unpack();
+        return _entries;
+    }
+
+    std::unordered_map<std::string, std::size_t> const & labels() const {
+        unpack();
+        return _label_index;
+    }
+
+  private:
+    void unpack() const {
+        // may be called from more than one thread, for tempomaps shared with the audio
+        // or renderer thread
+        std::call_once(_unpacked, [this] {
+            _entries.resize(_size);
+
+            for (std::size_t n = 0; n != _size; ++n) {
+                EntryRecord const & r = _records[n];
+                Entry & e = _entries[n];
+
+                e.label.assign(_labels + r.label_offset, r.label_length);
+                e.bars = r.bars;
+                e.beats = r.beats;
+                e.denom = r.denom;
+                e.tempo = r.tempo;
+                e.tempo2 = r.tempo2;
+                e.tempi.assign(_tempi + r.tempi_offset, _tempi + r.tempi_offset + r.ntempi);
+                e.volume = r.volume;
+
+                e.pattern.resize(r.pattern_length);
+                for (std::size_t k = 0; k != r.pattern_length; ++k) {
+                    std::uint64_t w = _patterns[r.pattern_offset + k / 32];
+                    e.pattern[k] = static_cast<BeatType>((w >> (k % 32 * 2)) & 3);
+                }
+
+                if (!e.label.empty()) {
+                    _label_index.emplace(e.label, n);
+                }
+            }
+        });
+    }
+
+    std::shared_ptr<void const> _file;
+    EntryRecord const *_records;
+    std::size_t _size;
+    char const *_labels;
+    float const *_tempi;
+    std::uint64_t const *_patterns;
+
+    mutable std::once_flag _unpacked;
+    mutable Entries _entries;
+    mutable std::unordered_map<std::string, std::size_t> _label_index;
+};
+
+
+TempoMap::Entries const & TempoMap::entries() const
+{
+    return _binary ? _binary->entries() : _entries;
+}
+
+
+std::size_t TempoMap::size() const
+{
+    return _binary ? _binary->size() : _entries.size();
+}
+
+
+bool TempoMap::infinite() const
+{
+    return _binary ? _binary->infinite() : _entries.back().bars == -1;
+}
+
+
+int TempoMap::index(std::string const & l) const
+{
+    auto const & labels = _binary ? _binary->labels() : _labels;
+    auto i = labels.find(l);
+    return i != labels.end() ? static_cast<int>(i->second) : -1;
+}
+
+
+void TempoMap::unpack()
+{
+    if (_binary) {
+        _entries = _binary->entries();
+        _labels = _binary->labels();
+        _binary.reset();
+    }
+}
+
+
+bool TempoMap::is_binary(std::string const & filename)
+{
+    char magic[sizeof(MAGIC)];
+    std::ifstream file(filename.c_str(), std::ios::binary);
+    return file.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+
+TempoMapPtr TempoMap::load_binary(std::string const & filename, Source const *source)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (source) {
+            return TempoMapPtr();
+        }
+        throw std::runtime_error(das::make_string() << "can't open tempo map file '" << filename << "'");
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == -1 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+        ::close(fd);
+        throw InvalidFile(filename);
+    }
+
+    auto mapping = std::make_shared<Mapping>(fd, st.st_size);
+    ::close(fd);
+
+    if (!mapping->valid()) {
+        throw std::runtime_error(das::make_string() << "can't map tempo map file '" << filename << "': "
+                                                    << std::strerror(errno));
+    }
+
+    Reader reader(mapping->data(), st.st_size, filename);
+
+    Header const & h = *reader.read<Header>(1);
+
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+            h.version != FORMAT_VERSION || h.byte_order != BYTE_ORDER_MARK || h.nentries == 0) {
+        throw InvalidFile(filename);
+    }
+    if (source && (h.source_size != source->size || h.source_mtime != source->mtime) &&
+            (!source->hash || h.source_hash != source->hash)) {
+        return TempoMapPtr();
+    }
+
+    EntryRecord const *records = reader.read<EntryRecord>(h.nentries);
+    char const *labels = reader.read<char>(h.label_bytes);
+    float const *tempi = reader.read<float>(h.ntempi);
+    std::uint64_t const *patterns = reader.read<std::uint64_t>(h.npatterns);
+    reader.skip_padding(SEGMENT_ALIGNMENT);
+    Segment const *segments = reader.read<Segment>(h.nentries);
+
+    for (std::size_t n = 0; n != h.nentries; ++n) {
+        if (!valid_entry(records[n], segments[n], h, tempi, patterns)) {
+            throw InvalidFile(filename);
+        }
+    }
+
+    auto map = std::make_shared<TempoMap>();
+    map->_binary = std::make_shared<Binary>(mapping, records, h.nentries, labels, tempi, patterns);
+
+    if (h.samplerate > 0.0) {
+        // the timeline is used straight from the mapped file
+        auto t = std::make_shared<Timeline>();
+        t->file = mapping;
+        t->samplerate = h.samplerate;
+
+        t->segments.map(segments, h.nentries);
+        t->tempi.map(tempi, h.ntempi);
+        t->patterns.map(patterns, h.npatterns);
+
+        t->start_frames.map(reader.read<double>(h.nentries + 1), h.nentries + 1);
+        t->start_bars.map(reader.read<std::int32_t>(h.nentries + 1), h.nentries + 1);
+        t->start_beats.map(reader.read<std::int32_t>(h.nentries + 1), h.nentries + 1);
+        t->beat_index.map(reader.read<std::uint64_t>(h.nentries), h.nentries);
+        t->beat_frames.map(reader.read<double>(h.nbeat_frames), h.nbeat_frames);
+
+        for (std::size_t n = 0; n != h.nentries; ++n) {
+            Segment const & s = segments[n];
+            std::uint64_t i = t->beat_index[n];
+            std::uint64_t nbeats = s.bars != -1 ? static_cast<std::uint64_t>(s.bars) * s.beats : 0;
+            if (i != Timeline::NO_BEATS && (i > h.nbeat_frames || nbeats >= h.nbeat_frames - i)) {
+                throw InvalidFile(filename);
+            }
+        }
+
+        map->_timeline = t;
+    }
+
+    if (source) {
+        map->_source = *source;
+        map->_source.hash = h.source_hash;
+        map->_cache_filename = filename;
+    }
+
+    return map;
+}
+
+
+void TempoMap::write_binary(std::string const & filename) const
+{
+    Entries const & entries = this->entries();
+
+    // the timeline's segments and arenas are written as they are, the positions only
+    // if there is a timeline
+    Timeline compiled;
+    Timeline const *t = _timeline.get();
+    if (!t) {
+        compiled.compile(entries);
+        t = &compiled;
+    }
+
+    Header h = Header();
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = FORMAT_VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.source_hash = _source.hash;
+    h.source_size = _source.size;
+    h.source_mtime = _source.mtime;
+    h.nentries = entries.size();
+    h.ntempi = t->tempi.size();
+    h.npatterns = t->patterns.size();
+
+    std::vector<EntryRecord> records;
+    std::vector<char> labels;
+
+    records.reserve(entries.size());
+
+    for (std::size_t n = 0; n != entries.size(); ++n) {
+        Entry const & e = entries[n];
+        Segment const & s = t->segments[n];
+
+        EntryRecord r = EntryRecord();
+        r.bars = e.bars;
+        r.beats = e.beats;
+        r.denom = e.denom;
+        r.tempo = e.tempo;
+        r.tempo2 = e.tempo2;
+        r.volume = e.volume;
+        r.label_offset = labels.size();
+        r.label_length = e.label.size();
+        r.tempi_offset = e.tempi.empty() ? 0 : s.tempi;
+        r.ntempi = e.tempi.size();
+        r.pattern_offset = s.pattern;
+        r.pattern_length = e.pattern.size();
+        records.push_back(r);
+
+        labels.insert(labels.end(), e.label.begin(), e.label.end());
+    }
+
+    h.label_bytes = labels.size();
+
+    if (_timeline) {
+        h.samplerate = _timeline->samplerate;
+        h.nbeat_frames = _timeline->beat_frames.size();
+    }
+
+    std::ofstream file(filename.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        throw std::runtime_error(das::make_string() << "can't create tempo map file '" << filename << "'");
+    }
+
+    Writer w(file);
+    w.write(&h, 1);
+    w.write(records);
+    w.write(labels);
+    w.write(t->tempi);
+    w.write(t->patterns);
+    w.pad(SEGMENT_ALIGNMENT);
+    w.write(t->segments);
+
+    if (_timeline) {
+        w.write(_timeline->start_frames);
+        w.write(_timeline->start_bars);
+        w.write(_timeline->start_beats);
+        w.write(_timeline->beat_index);
+        w.write(_timeline->beat_frames);
+    }
+
+    file.close();
+    if (!file) {
+        throw std::runtime_error(das::make_string() << "can't write tempo map file '" << filename << "'");
+    }
+}
+
+
+void TempoMap::update_cache() const
+{
+    if (_cache_filename.empty()) {
+        return;
+    }
+
+    // write to a temporary file first, so other instances never see a partial cache
+    std::string tmp = das::make_string() << _cache_filename << "." << ::getpid() << ".tmp";
+
+    try {
+        write_binary(tmp);
+        if (std::rename(tmp.c_str(), _cache_filename.c_str()) == 0) {
+            return;
+        }
+    }
+    catch (std::runtime_error const &) {
+    }
+
+    std::remove(tmp.c_str());
+}
+
+
+std::string TempoMap::cache_filename(std::string const & filename)
+{
+    std::string::size_type slash = filename.rfind('/');
+    std::string::size_type base = slash == std::string::npos ? 0 : slash + 1;
+
+    return filename.substr(0, base) + "." + filename.substr(base) + ".klickmap";
+}
+
+
+std::uint64_t TempoMap::hash(std::string const & data)
+{
+    // hashes eight bytes at a time, this only needs to detect changes, not resist attacks
+    std::uint64_t h = 0xcbf29ce484222325ULL ^ data.size();
+    std::size_t n = 0;
+
+    for ( ; n + 8 <= data.size(); n += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, data.data() + n, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    for ( ; n < data.size(); ++n) {
+        h = (h ^ static_cast<unsigned char>(data[n])) * 0x100000001b3ULL;
+    }
+
+    // zero means "no hash"
+    return h ? h : 1;
+}
@@ -0,0 +1,140 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tempomap_watcher.hh"
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "util/string.hh"
+
+
+TempoMapWatcher::TempoMapWatcher(std::string const & filename)
+  : _filename(filename)
+  , _changed(false)
+  , _quit(false)
+{
+    // editors often save by writing a new file and renaming it, so watch the directory
+    std::string dir;
+    std::string::size_type n = filename.rfind('/');
+    if (n == std::string::npos) {
+        dir = ".";
+        _name = filename;
+    } else {
+        dir = n ? filename.substr(0, n) : "/";
+        _name = filename.substr(n + 1);
+    }
+
+    _fd = ::inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (_fd == -1) {
+        throw std::runtime_error(das::make_string() << "can't watch tempo map file: " << std::strerror(errno));
+    }
+
+    if (::inotify_add_watch(_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        int e = errno;
+        ::close(_fd);
+        throw std::runtime_error(das::make_string() << "can't watch directory '" << dir << "': " << std::strerror(e));
+    }
+
+    _thread = std::thread(&TempoMapWatcher::run, this);
+}
+
+
+TempoMapWatcher::~TempoMapWatcher()
+{
+    _quit = true;
+    _thread.join();
+
+    ::close(_fd);
+}
+
+
+TempoMapPtr TempoMapWatcher::poll()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_changed) {
+        return TempoMapPtr();
+    }
+    _changed = false;
+
+    if (!_error.empty()) {
+        std::string error;
+        error.swap(_error);
+        throw std::runtime_error(error);
+    }
+
+    TempoMapPtr map;
+    map.swap(_map);
+    return map;
+}
+
+
+void TempoMapWatcher::run()
+{
+    ::pollfd p = { _fd, POLLIN, 0 };
+
+    while (!_quit) {
+        if (::poll(&p, 1, QUIT_INTERVAL) <= 0 || !read_events()) {
+            continue;
+        }
+
+        // the file may be written in several steps, wait until it's complete
+        while (!_quit && ::poll(&p, 1, SETTLE_TIME) > 0) {
+            read_events();
+        }
+
+        load();
+    }
+}
+
+
+bool TempoMapWatcher::read_events()
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(::inotify_event))));
+    bool found = false;
+
+    ssize_t len;
+    while ((len = ::read(_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + len; ) {
+            ::inotify_event const *e = reinterpret_cast< ::inotify_event const *>(p);
+            if (e->len && _name == e->name) {
+                found = true;
+            }
+            p += sizeof(::inotify_event) + e->len;
+        }
+    }
+
+    return found;
+}
+
+
+void TempoMapWatcher::load()
+{
+    TempoMapPtr map;
+    std::string error;
+
+    try {
+        map = TempoMap::new_from_file(_filename);
+    } catch (std::runtime_error const & e) {
+        error = e.what();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _changed = true;
+    _map = map;
+    _error = error;
+}
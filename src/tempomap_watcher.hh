@@ -0,0 +1,66 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_TEMPOMAP_WATCHER_HH
+#define KLICK_TEMPOMAP_WATCHER_HH
+
+#include "tempomap.hh"
+
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <boost/noncopyable.hpp>
+
+
+/*
+ * watches a tempomap file, and loads it again in a separate thread whenever it's written
+ */
+class TempoMapWatcher
+  : boost::noncopyable
+{
+  public:
+    TempoMapWatcher(std::string const & filename);
+    ~TempoMapWatcher();
+
+    std::string const & filename() const { return _filename; }
+
+    // the tempomap loaded since the last call, or NULL if the file hasn't changed.
+    // throws if the changed file couldn't be loaded
+    TempoMapPtr poll();
+
+  private:
+    // how long to wait for further changes before loading the file, in milliseconds
+    static int const SETTLE_TIME = 100;
+    // how often to check whether the thread should quit, in milliseconds
+    static int const QUIT_INTERVAL = 250;
+
+    void run();
+    // read pending events, returns true if any of them concerned the file
+    bool read_events();
+    void load();
+
+    std::string _filename;
+    std::string _name;
+
+    int _fd;
+
+    std::mutex _mutex;
+    bool _changed;
+    TempoMapPtr _map;
+    std::string _error;
+
+    std::atomic<bool> _quit;
+    std::thread _thread;
+};
+
+
+#endif // KLICK_TEMPOMAP_WATCHER_HH
@@ -16,7 +16,10 @@
 
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <stdexcept>
 #include <cstdio>
+#include <cstdlib>
 
 #include <sys/select.h>
 #include <unistd.h>
@@ -30,6 +33,7 @@ typedef std::shared_ptr<MetronomeSimple> MetronomeSimplePtr;
 TerminalHandler::TerminalHandler(Klick & klick, AudioInterface & audio)
   : _klick(klick)
   , _audio(audio)
+  , _bar(0)
 {
     // save current terminal mode
     ::tcgetattr(STDIN_FILENO, &_old_mode);
@@ -105,18 +109,27 @@ bool TerminalHandler::munch_key(int k)
 
 void TerminalHandler::handle_input()
 {
+    bool simple = !!std::dynamic_pointer_cast<MetronomeSimple>(_klick.metronome());
+
     while (key_pressed())
     {
-        switch (get_key()) {
+        int k = get_key();
+
+        if (!simple && edit_locate(k)) {
+            update();
+            continue;
+        }
+
+        switch (k) {
             case 033:
                 if (key_pressed() && get_key() == '[' && key_pressed()) {
                     // escape sequence
                     switch (get_key()) {
-                        // arrow keys: tempo
+                        // arrow keys: tempo, or bar of tempomap
                         case 'A': change_tempo(+10); break;
                         case 'B': change_tempo(-10); break;
-                        case 'C': change_tempo(+1); break;
-                        case 'D': change_tempo(-1); break;
+                        case 'C': if (simple) change_tempo(+1); else locate_bar(+1); break;
+                        case 'D': if (simple) change_tempo(-1); else locate_bar(-1); break;
                         // pgup/pgdn: double/halve tempo
                         case '5': if (munch_key('~')) multiply_tempo(2.0f); break;
                         case '6': if (munch_key('~')) multiply_tempo(0.5f); break;
@@ -164,12 +177,68 @@ void TerminalHandler::handle_input()
 
         update();
     }
+
+    if (!simple && _klick.tempomap_bar() != _bar) {
+        // show the current bar while playing
+        update();
+    }
+}
+
+
+bool TerminalHandler::edit_locate(int k)
+{
+    bool label = !_locate.empty() && _locate[0] == ':';
+
+    if ((k >= '0' && k <= '9') || (k == ':' && _locate.empty()) ||
+            (label && ((k >= 'a' && k <= 'z') || (k >= 'A' && k <= 'Z') || k == '_' || k == '-'))) {
+        _locate += static_cast<char>(k);
+        _error.clear();
+        return true;
+    }
+    if (_locate.empty()) {
+        return false;
+    }
+    if (k == '\n' || k == '\r') {
+        locate(_locate);
+        _locate.clear();
+        return true;
+    }
+    if (k == 0177 || k == '\b') {
+        _locate.erase(_locate.size() - 1);
+        return true;
+    }
+    return false;
+}
+
+
+void TerminalHandler::locate(std::string const & s)
+{
+    try {
+        if (s[0] == ':') {
+            _klick.locate_tempomap(s.substr(1), 1, 1);
+        } else {
+            _klick.locate_tempomap(std::atoi(s.c_str()), 1);
+        }
+    } catch (std::runtime_error const & e) {
+        _error = e.what();
+    }
+}
+
+
+void TerminalHandler::locate_bar(int n)
+{
+    try {
+        _klick.locate_tempomap(std::max(_klick.tempomap_bar() + n, 1), 1);
+    } catch (std::runtime_error const & e) {
+        _error = e.what();
+    }
 }
 
 
 void TerminalHandler::set_beats(int n)
 {
     MetronomeSimplePtr m = std::dynamic_pointer_cast<MetronomeSimple>(_klick.metronome());
+    if (!m) return;
 
     m->set_meter(n, m->denom());
 }
@@ -178,6 +247,7 @@ void TerminalHandler::set_beats(int n)
 void TerminalHandler::set_denom(int n)
 {
     MetronomeSimplePtr m = std::dynamic_pointer_cast<MetronomeSimple>(_klick.metronome());
+    if (!m) return;
 
     m->set_meter(m->beats(), n);
 }
@@ -186,6 +256,7 @@ void TerminalHandler::set_denom(int n)
 void TerminalHandler::change_tempo(float f)
 {
     MetronomeSimplePtr m = std::dynamic_pointer_cast<MetronomeSimple>(_klick.metronome());
+    if (!m) return;
 
     float t = m->tempo() + f;
     t = std::min(std::max(t, 10.0f), 1000.0f);
@@ -196,6 +267,7 @@ void TerminalHandler::change_tempo(float f)
 void TerminalHandler::multiply_tempo(float f)
 {
     MetronomeSimplePtr m = std::dynamic_pointer_cast<MetronomeSimple>(_klick.metronome());
+    if (!m) return;
 
     float t = m->tempo() * f;
     t = std::min(std::max(t, 10.0f), 1000.0f);
@@ -221,13 +293,23 @@ void TerminalHandler::toggle_running()
 void TerminalHandler::update()
 {
     MetronomeSimplePtr m = std::dynamic_pointer_cast<MetronomeSimple>(_klick.metronome());
-    ASSERT(m);
 
     // clear current line
     std::cout << "\r\033[K\r";
 
-    std::cout << "meter: " << m->beats() << "/" << m->denom() << ", ";
-    std::cout << std::fixed << std::setprecision(0) << "tempo: " << m->tempo() << ", ";
-    std::cout << std::setprecision(1) << "volume: " << _audio.volume();
+    if (m) {
+        std::cout << "meter: " << m->beats() << "/" << m->denom() << ", ";
+        std::cout << std::fixed << std::setprecision(0) << "tempo: " << m->tempo() << ", ";
+    } else {
+        _bar = _klick.tempomap_bar();
+        std::cout << "bar: " << _bar << ", ";
+    }
+    std::cout << std::fixed << std::setprecision(1) << "volume: " << _audio.volume();
+
+    if (!_locate.empty()) {
+        std::cout << ", go to: " << _locate;
+    } else if (!_error.empty()) {
+        std::cout << ", " << _error;
+    }
     std::cout << std::flush;
 }
@@ -9,6 +9,7 @@
  * (at your option) any later version.
  */
 
+#include <string>
 #include <boost/noncopyable.hpp>
 
 #include <termios.h>
@@ -40,10 +41,19 @@ class TerminalHandler
     void change_volume(float);
     void toggle_running();
 
+    // tempomap: bar number or :label typed to locate to, confirmed by enter
+    bool edit_locate(int);
+    void locate(std::string const &);
+    void locate_bar(int);
+
     void update();
 
     Klick & _klick;
     AudioInterface & _audio;
 
+    std::string _locate;
+    std::string _error;
+    int _bar;
+
     ::termios _old_mode;
 };
@@ -0,0 +1,420 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "tick_scheduler.hh"
+
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <cerrno>
+#include <time.h>
+
+#include "util/debug.hh"
+
+
+TickScheduler::TickScheduler(Position const & pos, nframes_t samplerate, nframes_t lookahead, bool threaded)
+  : _pos(pos)
+  , _samplerate(samplerate)
+  , _lookahead(lookahead)
+  , _threaded(threaded)
+  , _queue(QUEUE_SIZE)
+  , _relocation(pack_relocation(0, 0))
+  , _play_generation(0)
+  , _ready_generation(~0u)
+  , _playback_frame(0)
+  , _next_position(NULL)
+  , _jumps(0)
+  , _version(0)
+  , _current_generation(~0u)
+  , _start_frame(0)
+  , _position_queued(false)
+  , _end_queued(false)
+  , _jumps_queued(0)
+  , _jump_shift(0)
+  , _quit(false)
+{
+    if (::sem_init(&_sem, 0, 0) != 0) {
+        throw std::runtime_error("can't create semaphore for tick scheduler");
+    }
+
+    if (_threaded) {
+        _thread = std::thread(&TickScheduler::run, this);
+    }
+}
+
+
+TickScheduler::~TickScheduler()
+{
+    if (_threaded) {
+        _quit = true;
+        ::sem_post(&_sem);
+        _thread.join();
+    }
+
+    ::sem_destroy(&_sem);
+
+    delete _next_position.load(std::memory_order_acquire);
+}
+
+
+void TickScheduler::relocate(framepos_t frame)
+{
+    unsigned int g = next_generation(frame);
+    _playback_frame.store(frame, std::memory_order_relaxed);
+
+    // never go back to an earlier generation if another thread relocated at the same time
+    unsigned int p = _play_generation.load(std::memory_order_relaxed);
+    while (newer(g, p) && !_play_generation.compare_exchange_weak(p, g, std::memory_order_release,
+                                                                   std::memory_order_relaxed)) { }
+
+    if (_threaded) {
+        ::sem_post(&_sem);
+    }
+}
+
+
+void TickScheduler::seek(framepos_t frame)
+{
+    next_generation(frame);
+
+    if (_threaded) {
+        ::sem_post(&_sem);
+    }
+}
+
+
+bool TickScheduler::seek_ready(framepos_t & frame)
+{
+    std::uint64_t r = _relocation.load(std::memory_order_acquire);
+    unsigned int g = relocation_generation(r);
+    unsigned int p = _play_generation.load(std::memory_order_relaxed);
+
+    if (!newer(g, p)) {
+        // no seek pending
+        return false;
+    }
+    if (_threaded && _ready_generation.load(std::memory_order_acquire) != g) {
+        // keep playing until the scheduler has caught up, so no tick is missed
+        return false;
+    }
+
+    if (!_play_generation.compare_exchange_strong(p, g, std::memory_order_release, std::memory_order_relaxed)) {
+        // relocated in the meantime
+        return false;
+    }
+    frame = relocation_frame(r);
+    _playback_frame.store(frame, std::memory_order_relaxed);
+    return true;
+}
+
+
+unsigned int TickScheduler::next_generation(framepos_t frame)
+{
+    std::uint64_t r = _relocation.load(std::memory_order_relaxed);
+    std::uint64_t next;
+
+    do {
+        next = pack_relocation(frame, relocation_generation(r) + 1);
+    } while (!_relocation.compare_exchange_weak(r, next, std::memory_order_release, std::memory_order_relaxed));
+
+    return relocation_generation(next);
+}
+
+
+void TickScheduler::set_position(Position const & pos, TempoMap::Diff const & diff, unsigned int version, LoopPtr loop)
+{
+    PendingPosition *p = new PendingPosition { pos, diff, loop, version };
+
+    // replace the previous position if the scheduler hasn't picked it up yet,
+    // the scheduler's current position then needs to follow both edits
+    std::unique_ptr<PendingPosition> prev(_next_position.exchange(NULL, std::memory_order_acq_rel));
+    if (prev) {
+        p->diff = prev->diff.then(diff);
+    }
+    _next_position.store(p, std::memory_order_release);
+
+    if (_threaded) {
+        ::sem_post(&_sem);
+    }
+}
+
+
+bool TickScheduler::wait_ready(float timeout)
+{
+    if (!_threaded) {
+        return true;
+    }
+
+    unsigned int g = relocation_generation(_relocation.load(std::memory_order_acquire));
+
+    for (int n = 0; n < timeout * 1000; ++n) {
+        if (_ready_generation.load(std::memory_order_acquire) == g) {
+            return true;
+        }
+        ::timespec ts = { 0, 1000000 };
+        ::nanosleep(&ts, NULL);
+    }
+
+    return false;
+}
+
+
+void TickScheduler::progress(framepos_t frame)
+{
+    _playback_frame.store(frame, std::memory_order_relaxed);
+
+    if (_threaded) {
+        ::sem_post(&_sem);
+    }
+}
+
+
+TickScheduler::Event const * TickScheduler::front()
+{
+    unsigned int g = _play_generation.load(std::memory_order_acquire);
+
+    for (;;) {
+        Event const *e = _queue.front();
+
+        if (!e) {
+            if (_threaded) {
+                return NULL;
+            }
+            // no scheduler thread, calculate the next ticks right now
+            schedule();
+            if (!(e = _queue.front())) {
+                return NULL;
+            }
+        }
+
+        if (e->generation == g) {
+            return e;
+        }
+        if (newer(e->generation, g)) {
+            // queued after a seek the audio thread hasn't followed yet
+            return NULL;
+        }
+
+        // left over from before the last relocation
+        _queue.pop();
+    }
+}
+
+
+void TickScheduler::pop()
+{
+    // jumps played while a seek is pending belong to an earlier generation, and don't count
+    Event const *e = _queue.front();
+    if (e->jump && e->generation == relocation_generation(_relocation.load(std::memory_order_acquire))) {
+        _jumps.fetch_add(1, std::memory_order_release);
+    }
+    _queue.pop();
+}
+
+
+void TickScheduler::run()
+{
+    while (!_quit) {
+        schedule();
+
+        while (::sem_wait(&_sem) != 0 && errno == EINTR) { }
+    }
+}
+
+
+void TickScheduler::schedule()
+{
+    std::uint64_t r = _relocation.load(std::memory_order_acquire);
+    unsigned int g = relocation_generation(r);
+
+    if (g != _current_generation) {
+        // start over at the new position, in the edited tempomap if there is one
+        _current_generation = g;
+        _start_frame = relocation_frame(r);
+        _jumps_queued = _jumps.load(std::memory_order_acquire);
+
+        std::unique_ptr<PendingPosition> p(_next_position.exchange(NULL, std::memory_order_acq_rel));
+        if (p) {
+            _pos = p->pos;
+            _loop = p->loop;
+            _version = p->version;
+        }
+
+        _pos.locate(_start_frame);
+        _position_queued = false;
+        _end_queued = false;
+    }
+    else if (_next_position.load(std::memory_order_relaxed) && !_queue.full()
+             && _jumps.load(std::memory_order_acquire) == _jumps_queued) {
+        // only one jump at a time, so the audio thread's frames can be converted below
+        std::unique_ptr<PendingPosition> p(_next_position.exchange(NULL, std::memory_order_acq_rel));
+        switch_position(*p);
+    }
+
+    if (!_position_queued) {
+        // tell the audio thread where we are, even before the next tick
+        if (!push(false)) return;
+        _position_queued = true;
+        _end_queued = _pos.end();
+    }
+
+    std::int64_t playback = _playback_frame.load(std::memory_order_relaxed);
+    if (_play_generation.load(std::memory_order_acquire) != g) {
+        // the audio thread is still playing from before the last seek
+        playback = _start_frame;
+    }
+    else if (_jumps.load(std::memory_order_acquire) != _jumps_queued) {
+        // the audio thread hasn't reached the last jump yet
+        playback = std::max<std::int64_t>(playback + _jump_shift, 0);
+    }
+    framepos_t limit = static_cast<framepos_t>(playback) + _lookahead;
+
+    while (!_end_queued && _pos.next_frame() < limit) {
+        if (_queue.full() || relocation_generation(_relocation.load(std::memory_order_relaxed)) != g) {
+            // try again later
+            return;
+        }
+
+        // decided in beats, the frames of the loop end and the next tick may be calculated
+        // differently and needn't be exactly equal
+        if (_loop && _pos.next_beat_total() >= _loop->end_beat) {
+            if (_jumps.load(std::memory_order_acquire) != _jumps_queued) {
+                // the loop is shorter than the lookahead, and the audio thread hasn't reached
+                // the previous wrap yet. that's as far ahead as we get for now
+                _ready_generation.store(g, std::memory_order_release);
+                return;
+            }
+            wrap_loop();
+            // the limit is in frames of the previous iteration
+            limit = static_cast<framepos_t>(std::max<std::int64_t>(static_cast<std::int64_t>(limit) + _jump_shift, 0));
+            continue;
+        }
+
+        _pos.advance();
+        push(!_pos.end());
+        _end_queued = _pos.end();
+    }
+
+    _ready_generation.store(g, std::memory_order_release);
+}
+
+
+void TickScheduler::switch_position(PendingPosition const & p)
+{
+    if (!_position_queued) {
+        // nothing queued since the last relocation, just start over
+        _pos = p.pos;
+        _pos.locate(_start_frame);
+        _loop = p.loop;
+        _version = p.version;
+        return;
+    }
+    if (_end_queued) {
+        // stopped at the end, the new position is used after the next relocation
+        _pos = p.pos;
+        _loop = p.loop;
+        _version = p.version;
+        return;
+    }
+
+    // the next tick that would have been queued
+    Position next(_pos);
+    next.advance();
+
+    // continue at the same place in the new tempomap
+    _pos = p.pos;
+    _pos.locate_edited(next, p.diff);
+    _loop = p.loop;
+    _version = p.version;
+
+    if (_loop && _pos.beat_total() >= _loop->end_beat) {
+        // past the end of the new loop, wrap right away
+        _pos = _loop->start;
+    }
+
+    Event e = Event();
+    e.generation = _current_generation;
+    e.version = _version;
+    e.tick.frame = static_cast<framepos_t>(next.frame());
+    e.frame = next.frame();
+    e.jump = true;
+    e.jump_to = static_cast<framepos_t>(_pos.frame());
+    _queue.push(e);
+
+    _jumps_queued++;
+    _jump_shift = static_cast<std::int64_t>(e.jump_to) - static_cast<std::int64_t>(e.tick.frame);
+}
+
+
+void TickScheduler::wrap_loop()
+{
+    // wrap at the end of the loop, or at the next tick if we're already past it,
+    // e.g. because the loop was changed
+    Position::float_frames_t end = _pos.beat_total() < _loop->end_beat ? _loop->end : _pos.next_frame();
+
+    Event e = Event();
+    e.generation = _current_generation;
+    e.version = _version;
+    e.tick.frame = static_cast<framepos_t>(end);
+    e.frame = end;
+    e.jump = true;
+    e.jump_to = static_cast<framepos_t>(_loop->start.frame());
+    _queue.push(e);
+
+    // no need to locate, the start of the loop is already known
+    _pos = _loop->start;
+
+    _jumps_queued++;
+    _jump_shift = static_cast<std::int64_t>(e.jump_to) - static_cast<std::int64_t>(e.tick.frame);
+}
+
+
+bool TickScheduler::push(bool play)
+{
+    Event e;
+
+    e.generation = _current_generation;
+    e.version = _version;
+    e.tick = _pos.tick();
+    e.play = play;
+    e.end = _pos.end();
+    e.jump = false;
+    e.frame = _pos.frame();
+    e.dist = _pos.dist_to_next();
+
+    if (!e.end) {
+        TempoMap::Segment const & s = _pos.current_segment();
+
+        e.bar_total = _pos.bar_total();
+        e.beat = _pos.beat();
+        e.beat_total = _pos.beat_total();
+        e.beats = s.beats;
+        e.denom = s.denom;
+
+        // NOTE: jack's notion of bpm is different from ours.
+        // all tempo values are converted from "quarters per minute"
+        // to the actual beats per minute used by jack
+        if (s.type == TempoMap::Segment::CONSTANT || (s.type == TempoMap::Segment::RAMP && e.dist == 0.0)) {
+            // constant tempo, and/or start of tempomap
+            e.bpm = s.tempo * _pos.multiplier() * s.denom / 4.0;
+        }
+        else if (s.type == TempoMap::Segment::RAMP) {
+            // tempo change, use average tempo for this beat
+            e.bpm = _samplerate * 60.0 / e.dist;
+        }
+        else {
+            // tempo per beat
+            e.bpm = _pos.beat_tempo() * _pos.multiplier();
+        }
+    }
+
+    return _queue.push(e);
+}
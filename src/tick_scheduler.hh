@@ -0,0 +1,190 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_TICK_SCHEDULER_HH
+#define KLICK_TICK_SCHEDULER_HH
+
+#include "position.hh"
+#include "util/ringbuffer.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <semaphore.h>
+#include <boost/noncopyable.hpp>
+
+#include "main.hh"
+
+
+/*
+ * walks the tempomap ahead of playback in a separate thread, and queues the upcoming
+ * ticks for the audio thread. all tempo calculations happen here, the audio thread
+ * only has to take events from the queue
+ */
+class TickScheduler
+  : boost::noncopyable
+{
+  public:
+
+    struct Event {
+        unsigned int generation;
+        // timeline version of the position this event belongs to, see set_position()
+        unsigned int version;
+
+        Position::Tick tick;
+        bool play;      // false if this event only carries the position after relocating
+        bool end;       // end of tempomap, tick is invalid
+
+        // playback continues at frame jump_to from this event's frame on, either at the same
+        // beat of an edited tempomap or at the start of the loop. tick is invalid
+        bool jump;
+        framepos_t jump_to;
+
+        // position in the tempomap, for the timebase master
+        Position::float_frames_t frame;
+        Position::float_frames_t dist;  // distance to the next tick
+        int bar_total;
+        int beat;
+        int beat_total;
+        int beats;
+        int denom;
+        double bpm;
+    };
+
+    /*
+     * part of the tempomap that's played repeatedly. once playback reaches beat end_beat
+     * (as in Position::beat_total()) at frame end, it continues at start, which is located
+     * at the first beat of the loop
+     */
+    struct Loop {
+        Position start;
+        int end_beat;
+        Position::float_frames_t end;
+    };
+    typedef std::shared_ptr<Loop const> LoopPtr;
+
+    static std::size_t const QUEUE_SIZE = 1024;
+
+    // schedules ticks up to lookahead frames ahead of the playback position.
+    // if threaded is false, ticks are calculated on demand in the caller's thread
+    TickScheduler(Position const & pos, nframes_t samplerate, nframes_t lookahead, bool threaded);
+    ~TickScheduler();
+
+    // discard all queued events and restart at the given frame.
+    // may be called from any thread
+    void relocate(framepos_t frame);
+
+    // restart at the given frame, but keep playing the events queued so far until the
+    // events from there on are ready, see seek_ready().
+    // may be called from one thread other than the audio thread
+    void seek(framepos_t frame) NONREALTIME;
+    // true if the audio thread should continue at the frame of the last seek now.
+    // front() then returns the events following the seek
+    bool seek_ready(framepos_t & frame) REALTIME;
+
+    // switch to a position in an edited tempomap, at the next beat that hasn't been
+    // queued yet. playback continues at the same entry, bar and beat. the loop, if not NULL,
+    // must be in the same tempomap. all events from the switch on carry the given version,
+    // which should change whenever the frames of the timeline do.
+    // may be called from one thread other than the audio thread
+    void set_position(Position const & pos, TempoMap::Diff const & diff, unsigned int version,
+                      LoopPtr loop = LoopPtr()) NONREALTIME;
+
+    // wait until the events following the last relocation have been queued, or
+    // until the timeout (in seconds) has expired
+    bool wait_ready(float timeout) NONREALTIME;
+
+    // tell the scheduler that events up to the given frame are needed now.
+    // after a jump, frames are those of the new tempomap
+    void progress(framepos_t frame) REALTIME;
+
+    // next event, or NULL if there is none (yet)
+    Event const * front() REALTIME;
+    void pop() REALTIME;
+
+  private:
+
+    static int const GENERATION_BITS = 16;
+    static unsigned int const GENERATION_MASK = (1u << GENERATION_BITS) - 1;
+
+    static std::uint64_t pack_relocation(framepos_t frame, unsigned int generation) {
+        return (frame << GENERATION_BITS) | (generation & GENERATION_MASK);
+    }
+    static framepos_t relocation_frame(std::uint64_t r) { return r >> GENERATION_BITS; }
+    static unsigned int relocation_generation(std::uint64_t r) { return r & GENERATION_MASK; }
+
+    // true if generation a came after b, generations wrap around
+    static bool newer(unsigned int a, unsigned int b) {
+        unsigned int d = (a - b) & GENERATION_MASK;
+        return d != 0 && d <= GENERATION_MASK / 2;
+    }
+
+    // start a new generation at the given frame, returns its number
+    unsigned int next_generation(framepos_t frame);
+
+    void run();
+
+    // queue events up to the lookahead
+    void schedule();
+    bool push(bool play);
+
+    struct PendingPosition {
+        Position pos;
+        TempoMap::Diff diff;
+        LoopPtr loop;
+        unsigned int version;
+    };
+
+    void switch_position(PendingPosition const & p);
+    // queue a jump back to the start of the loop
+    void wrap_loop();
+
+    Position _pos;
+    nframes_t _samplerate;
+    nframes_t _lookahead;
+    bool _threaded;
+
+    das::ringbuffer<Event> _queue;
+
+    // frame and generation of the last relocation or seek, in one word so that concurrent
+    // callers can't mix them up. the generation is incremented each time, events from
+    // earlier generations are discarded
+    std::atomic<std::uint64_t> _relocation;
+    // generation played by the audio thread, behind _generation while a seek is pending
+    std::atomic<unsigned int> _play_generation;
+    // generation for which the queue has been filled up to the lookahead
+    std::atomic<unsigned int> _ready_generation;
+
+    std::atomic<framepos_t> _playback_frame;
+
+    // position passed to set_position(), owned by whoever takes it out
+    std::atomic<PendingPosition *> _next_position;
+    // number of jumps played by the audio thread
+    std::atomic<unsigned int> _jumps;
+
+    // scheduler side
+    LoopPtr _loop;
+    unsigned int _version;
+    unsigned int _current_generation;
+    framepos_t _start_frame;
+    bool _position_queued;
+    bool _end_queued;
+    // number of jumps queued, and the distance between old and new frames of the last one
+    unsigned int _jumps_queued;
+    std::int64_t _jump_shift;
+
+    std::atomic<bool> _quit;
+    sem_t _sem;
+    std::thread _thread;
+};
+
+
+#endif // KLICK_TICK_SCHEDULER_HH
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2015  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DAS_UTIL_ALIGNED_ALLOCATOR_HH
+#define DAS_UTIL_ALIGNED_ALLOCATOR_HH
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+
+namespace das {
+
+
+/*
+ * allocator for containers whose storage must start at a multiple of Alignment bytes,
+ * e.g. to keep elements from straddling cache lines
+ */
+template <typename T, std::size_t Alignment>
+class aligned_allocator
+{
+  public:
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef aligned_allocator<U, Alignment> other;
+    };
+
+    aligned_allocator() { }
+
+    template <typename U>
+    aligned_allocator(aligned_allocator<U, Alignment> const &) { }
+
+    T * allocate(std::size_t n)
+    {
+        void *p;
+        if (::posix_memalign(&p, Alignment, n * sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t)
+    {
+        std::free(p);
+    }
+
+    template <typename U>
+    bool operator==(aligned_allocator<U, Alignment> const &) const { return true; }
+    template <typename U>
+    bool operator!=(aligned_allocator<U, Alignment> const &) const { return false; }
+};
+
+
+} // namespace das
+
+
+#endif // DAS_UTIL_ALIGNED_ALLOCATOR_HH
@@ -13,6 +13,7 @@
 #include <memory>
 #include <list>
 #include <algorithm>
+#include <functional>
 #include <boost/noncopyable.hpp>
 
 
@@ -22,25 +23,29 @@ namespace das {
 /*
  * simple garbage collector that deletes objects held by a shared pointer
  * once only its own reference to the object remains.
+ * optionally, deletion can be delayed until a given condition is met, e.g. to make sure
+ * no other thread still uses the object through a raw pointer.
  */
 class garbage_collector
   : boost::noncopyable
 {
   public:
 
-    void manage(std::shared_ptr<void> p)
+    void manage(std::shared_ptr<void> p, std::function<bool ()> ready = std::function<bool ()>())
     {
-        _pointers.push_back(p);
+        _pointers.push_back(std::make_pair(p, ready));
     }
 
     void collect()
     {
         auto it = std::remove_if(_pointers.begin(), _pointers.end(),
-                         [](std::shared_ptr<void> p) { return p.unique(); });
+                         [](managed_ptr const & p) { return p.first.unique() && (!p.second || p.second()); });
         _pointers.erase(it, _pointers.end());
     }
 
-    std::list<std::shared_ptr<void>> _pointers;
+    typedef std::pair<std::shared_ptr<void>, std::function<bool ()>> managed_ptr;
+
+    std::list<managed_ptr> _pointers;
 };
 
 
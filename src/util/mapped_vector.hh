@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2015  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DAS_UTIL_MAPPED_VECTOR_HH
+#define DAS_UTIL_MAPPED_VECTOR_HH
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+
+namespace das {
+
+
+/*
+ * vector that can also refer to read-only elements owned by someone else, e.g. a mapped
+ * file. modifying it copies those elements first
+ */
+template <typename T, typename Alloc = std::allocator<T> >
+class mapped_vector
+{
+  public:
+    typedef T value_type;
+    typedef T const * const_iterator;
+
+    mapped_vector()
+      : _data(NULL), _size(0), _mapped(false) { }
+
+    mapped_vector(mapped_vector const & v)
+      : _vec(v._vec), _mapped(v._mapped)
+    {
+        _data = _mapped ? v._data : _vec.data();
+        _size = v._size;
+    }
+
+    mapped_vector & operator=(mapped_vector const & v) {
+        _vec = v._vec;
+        _mapped = v._mapped;
+        _data = _mapped ? v._data : _vec.data();
+        _size = v._size;
+        return *this;
+    }
+
+    // refer to size elements at data, which must stay valid as long as they're used
+    void map(T const *data, std::size_t size) {
+        _vec.clear();
+        _data = data;
+        _size = size;
+        _mapped = true;
+    }
+
+    bool mapped() const { return _mapped; }
+
+    std::size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    T const * data() const { return _data; }
+    T const & operator[](std::size_t n) const { return _data[n]; }
+    T const & back() const { return _data[_size - 1]; }
+
+    const_iterator begin() const { return _data; }
+    const_iterator end() const { return _data + _size; }
+
+    T & back() {
+        own();
+        return _vec.back();
+    }
+
+    void clear() {
+        _mapped = false;
+        _vec.clear();
+        sync();
+    }
+
+    void reserve(std::size_t n) {
+        own();
+        _vec.reserve(n);
+        sync();
+    }
+
+    void push_back(T const & v) {
+        own();
+        _vec.push_back(v);
+        sync();
+    }
+
+    template <typename I>
+    void assign(I first, I last) {
+        _mapped = false;
+        _vec.assign(first, last);
+        sync();
+    }
+
+    template <typename I>
+    void insert(const_iterator pos, I first, I last) {
+        std::size_t n = pos - _data;
+        own();
+        _vec.insert(_vec.begin() + n, first, last);
+        sync();
+    }
+
+  private:
+    void own() {
+        if (_mapped) {
+            _vec.assign(_data, _data + _size);
+            _mapped = false;
+            sync();
+        }
+    }
+
+    void sync() {
+        _data = _vec.data();
+        _size = _vec.size();
+    }
+
+    std::vector<T, Alloc> _vec;
+    T const *_data;
+    std::size_t _size;
+    bool _mapped;
+};
+
+
+} // namespace das
+
+
+#endif // DAS_UTIL_MAPPED_VECTOR_HH
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2015  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DAS_UTIL_RINGBUFFER_HH
+#define DAS_UTIL_RINGBUFFER_HH
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+
+
+namespace das {
+
+
+/*
+ * lock-free single-producer/single-consumer queue of fixed capacity.
+ * all memory is allocated by the constructor
+ */
+template <typename T>
+class ringbuffer
+  : boost::noncopyable
+{
+  public:
+
+    // capacity is rounded up to the next power of two
+    explicit ringbuffer(std::size_t capacity)
+      : _buffer(round_up(capacity))
+      , _mask(_buffer.size() - 1)
+      , _read(0)
+      , _write(0)
+    {
+    }
+
+    std::size_t capacity() const { return _buffer.size(); }
+
+    // producer: true if there's no room for another element
+    bool full() const
+    {
+        return _write.load(std::memory_order_relaxed) - _read.load(std::memory_order_acquire) == _buffer.size();
+    }
+
+    // producer: append an element, returns false if the queue is full
+    bool push(T const & value)
+    {
+        std::size_t w = _write.load(std::memory_order_relaxed);
+        if (w - _read.load(std::memory_order_acquire) == _buffer.size()) {
+            return false;
+        }
+        _buffer[w & _mask] = value;
+        _write.store(w + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer: oldest element, or NULL if the queue is empty
+    T const * front() const
+    {
+        std::size_t r = _read.load(std::memory_order_relaxed);
+        if (r == _write.load(std::memory_order_acquire)) {
+            return NULL;
+        }
+        return &_buffer[r & _mask];
+    }
+
+    // consumer: remove the oldest element. the queue must not be empty
+    void pop()
+    {
+        _read.store(_read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+  private:
+
+    static std::size_t round_up(std::size_t n)
+    {
+        std::size_t c = 1;
+        while (c < n) c <<= 1;
+        return c;
+    }
+
+    std::vector<T> _buffer;
+    std::size_t const _mask;
+
+    std::atomic<std::size_t> _read;
+    std::atomic<std::size_t> _write;
+};
+
+
+} // namespace das
+
+
+#endif // DAS_UTIL_RINGBUFFER_HH
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2015  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef DAS_UTIL_TRIPLE_BUFFER_HH
+#define DAS_UTIL_TRIPLE_BUFFER_HH
+
+#include <atomic>
+#include <boost/noncopyable.hpp>
+
+
+namespace das {
+
+
+/*
+ * wait-free single-writer/single-reader triple buffer.
+ * the writer publishes complete copies of T, the reader always sees the most recently
+ * published one. neither side ever blocks, allocates or sees a partially written value.
+ */
+template <typename T>
+class triple_buffer
+  : boost::noncopyable
+{
+  public:
+
+    triple_buffer(T const & init = T())
+      : _back(0)
+      , _middle(1)
+      , _front(2)
+    {
+        _buffers[0] = _buffers[1] = _buffers[2] = init;
+    }
+
+    // writer: publish a new value
+    void write(T const & value)
+    {
+        _buffers[_back] = value;
+        _back = _middle.exchange(_back | DIRTY, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // reader: switch to the most recently published value.
+    // returns false if nothing has been published since the last call
+    bool update()
+    {
+        if (!(_middle.load(std::memory_order_relaxed) & DIRTY)) {
+            return false;
+        }
+        _front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+    // reader: the value picked up by the last call to update()
+    T const & read() const { return _buffers[_front]; }
+
+  private:
+
+    static unsigned int const INDEX_MASK = 3;
+    static unsigned int const DIRTY = 4;
+
+    T _buffers[3];
+
+    unsigned int _back;                 // owned by the writer
+    std::atomic<unsigned int> _middle;  // index of the shared buffer, plus dirty flag
+    unsigned int _front;                // owned by the reader
+};
+
+
+} // namespace das
+
+
+#endif // DAS_UTIL_TRIPLE_BUFFER_HH
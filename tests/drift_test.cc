@@ -0,0 +1,117 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * simulates a week of playback at 48kHz. jack's 32-bit frame counter wraps around
+ * several times in that time, the unwrapped frames and the ticks must not drift
+ */
+
+#include "test.hh"
+#include "audio.hh"
+#include "position.hh"
+#include "tempomap.hh"
+
+#include <cmath>
+#include <cstdint>
+
+
+namespace {
+
+framepos_t const SAMPLERATE = 48000;
+framepos_t const WEEK = SAMPLERATE * 60 * 60 * 24 * 7;
+
+
+// what the jack backend does each period: unwrap the transport frame, and expect
+// the next period to start where this one ends
+void test_transport_rolling()
+{
+    nframes_t const nframes = 1024;
+    framepos_t expected = 0;
+    bool ok = true;
+
+    for (framepos_t frame = 0; frame < WEEK; frame += nframes) {
+        framepos_t f = unwrap_frame(expected, static_cast<nframes_t>(frame));
+        if (f != frame) {
+            ok = false;
+            break;
+        }
+        expected = f + nframes;
+    }
+    CHECK(ok);
+    CHECK(expected > 4 * (framepos_t(1) << 32));
+}
+
+
+void test_transport_relocate()
+{
+    framepos_t const wrap = framepos_t(1) << 32;
+    framepos_t expected = 3 * wrap + 1000;
+
+    // stopped: the frame stays the same
+    CHECK(unwrap_frame(expected, 1000) == expected);
+
+    // relocating to the start after the counter wrapped starts from 0 again
+    CHECK(unwrap_frame(expected, 0) == 0);
+
+    // small relocations after a wrap are taken literally, too
+    CHECK(unwrap_frame(expected, 500) == 500);
+    CHECK(unwrap_frame(expected, 5000) == 5000);
+
+    // as are jumps of more than 2^31 frames
+    expected = 1000;
+    CHECK(unwrap_frame(expected, 1000 + 0x90000000u) == 1000 + 0x90000000u);
+    expected = 0xf0000000u;
+    CHECK(unwrap_frame(expected, 100) == 100);
+}
+
+
+// walks through a week of an infinite tempomap. every tick must be at the frame
+// it would be at when calculated directly from its beat number
+void test_position(float tempo, int beats, int denom)
+{
+    TempoMapPtr map = TempoMap::new_simple(-1, tempo, beats, denom);
+    Position pos(map, SAMPLERATE, 1.0f);
+
+    double beat_length = SAMPLERATE * 240.0 / (tempo * denom);
+    double max_error = 0.0;
+    int ticks = 0;
+
+    while (pos.frame() < WEEK && !pos.end()) {
+        double exact = pos.beat_total() * beat_length;
+        max_error = std::max(max_error, std::fabs(pos.frame() - exact));
+        CHECK(pos.bar() == pos.beat_total() / beats);
+        CHECK(pos.beat() == pos.beat_total() % beats);
+        pos.advance();
+        ++ticks;
+    }
+
+    CHECK(!pos.end());
+    CHECK(ticks > 1000000);
+    CHECK(max_error < 1.0);
+
+    // the frame of the last tick, as seen by the jack backend
+    CHECK(std::fabs(pos.tick().frame - pos.beat_total() * beat_length) <= 1.0);
+}
+
+} // namespace
+
+
+int main()
+{
+    test_transport_rolling();
+    test_transport_relocate();
+
+    test_position(127.0f, 4, 4);
+    test_position(133.0f, 3, 4);
+    test_position(97.3f, 7, 8);
+
+    return test_result();
+}
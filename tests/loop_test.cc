@@ -0,0 +1,184 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * plays loops in random constant-tempo tempomaps, and checks where the clicks end up in
+ * the output. each iteration must play exactly the beats of the loop, and the first beat
+ * of the next iteration must follow the last one after the length of its beat
+ */
+
+#include "test.hh"
+#include "audio_interface_memory.hh"
+#include "audio_chunk.hh"
+#include "metronome_map.hh"
+#include "position.hh"
+#include "tempomap.hh"
+
+#include <vector>
+#include <random>
+#include <cmath>
+#include <time.h>
+#include <sys/mman.h>
+
+
+namespace {
+
+int const NMAPS = 200;
+int const NMAPS_THREADED = 10;
+// number of times each loop is played
+int const ITERATIONS = 4;
+
+std::mt19937 rng(4711);
+
+int random_int(int min, int max)
+{
+    return std::uniform_int_distribution<int>(min, max)(rng);
+}
+
+
+// the threaded scheduler is only used with realtime backends
+class AudioInterfaceRealtime
+  : public AudioInterfaceMemory
+{
+  public:
+    AudioInterfaceRealtime(nframes_t samplerate)
+      : AudioInterfaceMemory(samplerate) { }
+
+    bool is_realtime() const { return true; }
+};
+
+
+// a click that's a single sample, so its exact position can be found in the output
+AudioChunkConstPtr make_click(nframes_t samplerate)
+{
+    std::size_t const bytes = 4096;
+    void *p = ::mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return AudioChunkConstPtr();
+    }
+    sample_t *samples = static_cast<sample_t *>(p);
+    samples[0] = 1.0f;
+    return std::make_shared<AudioChunk>(p, bytes, samples, 64, samplerate);
+}
+
+TempoMapConstPtr random_map()
+{
+    static int const DENOMS[] = { 4, 8, 16 };
+
+    TempoMapPtr map;
+    for (int n = random_int(1, 3); n > 0; --n) {
+        // with a fraction, so beat lengths are rarely whole frames
+        float tempo = random_int(600, 3000) / 10.0f + random_int(0, 99) / 1000.0f;
+        TempoMapPtr e = TempoMap::new_simple(random_int(1, 4), tempo, random_int(1, 9), DENOMS[random_int(0, 2)]);
+        map = map ? TempoMap::join(map, e) : e;
+    }
+    return map;
+}
+
+Position::float_frames_t beat_frame(Position const & pos, int beat)
+{
+    Position p(pos);
+    p.locate_beat(beat);
+    return p.end() ? p.total_frames() : p.frame();
+}
+
+
+void test_loop(bool threaded)
+{
+    static nframes_t const SAMPLERATES[] = { 44100, 48000, 96000 };
+
+    nframes_t samplerate = SAMPLERATES[random_int(0, 2)];
+    nframes_t nframes = 1 << (threaded ? random_int(9, 11) : random_int(5, 11));
+    float lookahead = random_int(5, 50) / 100.0f;
+
+    AudioInterfaceMemory unthreaded_audio(samplerate);
+    AudioInterfaceRealtime threaded_audio(samplerate);
+    AudioInterfaceMemory & audio = threaded ? threaded_audio : unthreaded_audio;
+
+    AudioChunkConstPtr click = make_click(samplerate);
+    CHECK(click);
+    audio.samples().set({ { 0, click }, { 1, click } });
+
+    TempoMapConstPtr map = random_map();
+    Position pos(map, samplerate, 1.0f);
+
+    MetronomeMap m(audio, map, 1.0f, false, -1, "", lookahead);
+    m.set_sound(0, 1);
+    audio.set_processor(&m);
+
+    int first = random_int(0, pos.total_bars() - 1);
+    int end = random_int(first + 1, pos.total_bars());
+    CHECK(m.set_loop(first, end));
+
+    Position p(pos);
+    p.locate_bar(first, 0);
+    int start_beat = p.beat_total();
+    int end_beat = p.locate_bar(end, 0) ? p.beat_total() : pos.total_beats();
+
+    // the distance from each beat of the loop to the next one
+    std::vector<double> gaps;
+    for (int b = start_beat; b < end_beat; ++b) {
+        gaps.push_back(beat_frame(pos, b + 1) - beat_frame(pos, b));
+    }
+    double length = beat_frame(pos, end_beat) - beat_frame(pos, start_beat);
+
+    m.start();
+
+    std::vector<sample_t> buffer(nframes);
+    std::vector<framepos_t> clicks;
+    framepos_t periods = static_cast<framepos_t>(length * ITERATIONS) / nframes + 1;
+
+    for (framepos_t n = 0; n < periods; ++n) {
+        std::fill(buffer.begin(), buffer.end(), 0.0f);
+        audio.process(buffer.data(), nframes);
+
+        for (nframes_t i = 0; i < nframes; ++i) {
+            if (buffer[i] != 0.0f) {
+                clicks.push_back(n * nframes + i);
+            }
+        }
+
+        if (threaded) {
+            // give the scheduler time to keep up, as it would have in realtime
+            ::timespec ts = { 0, 50000 };
+            ::nanosleep(&ts, NULL);
+        }
+    }
+
+    CHECK(clicks.size() >= gaps.size() * (ITERATIONS - 1));
+    CHECK(!clicks.empty() && clicks[0] == 0);
+
+    for (std::size_t n = 1; n < clicks.size(); ++n) {
+        double expected = gaps[(n - 1) % gaps.size()];
+        double gap = static_cast<double>(clicks[n] - clicks[n - 1]);
+        if (std::fabs(gap - expected) > 1.0) {
+            std::cerr << "click " << n << " of loop [" << start_beat << ", " << end_beat << ") at "
+                      << gap << " frames after the previous one instead of " << expected << std::endl;
+            ++test_failures;
+            break;
+        }
+    }
+}
+
+} // namespace
+
+
+int main()
+{
+    for (int n = 0; n < NMAPS; ++n) {
+        test_loop(false);
+    }
+    for (int n = 0; n < NMAPS_THREADED; ++n) {
+        test_loop(true);
+    }
+
+    return test_result();
+}
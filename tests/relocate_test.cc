@@ -0,0 +1,171 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * relocates a rolling transport to the start of a random bar, like a DAW jumping back to
+ * the start of its loop. the downbeat at the new position must be played, at most one
+ * period late if the scheduler hasn't queued it yet, and the beat after it on time
+ */
+
+#include "test.hh"
+#include "audio_interface_memory.hh"
+#include "audio_chunk.hh"
+#include "metronome_map.hh"
+#include "position.hh"
+#include "tempomap.hh"
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <time.h>
+#include <sys/mman.h>
+
+
+namespace {
+
+int const NMAPS = 200;
+int const NMAPS_THREADED = 50;
+
+std::mt19937 rng(815);
+
+int random_int(int min, int max)
+{
+    return std::uniform_int_distribution<int>(min, max)(rng);
+}
+
+
+// the threaded scheduler is only used with realtime backends
+class AudioInterfaceRealtime
+  : public AudioInterfaceMemory
+{
+  public:
+    AudioInterfaceRealtime(nframes_t samplerate)
+      : AudioInterfaceMemory(samplerate) { }
+
+    bool is_realtime() const { return true; }
+};
+
+
+// a click that's a single sample, so its exact position can be found in the output
+AudioChunkConstPtr make_click(nframes_t samplerate)
+{
+    std::size_t const bytes = 4096;
+    void *p = ::mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return AudioChunkConstPtr();
+    }
+    sample_t *samples = static_cast<sample_t *>(p);
+    samples[0] = 1.0f;
+    return std::make_shared<AudioChunk>(p, bytes, samples, 64, samplerate);
+}
+
+
+void test_relocate(bool threaded)
+{
+    static nframes_t const SAMPLERATES[] = { 44100, 48000, 96000 };
+    static int const DENOMS[] = { 4, 8 };
+
+    nframes_t samplerate = SAMPLERATES[random_int(0, 2)];
+    nframes_t nframes = 1 << random_int(8, 11);
+    float lookahead = random_int(5, 50) / 100.0f;
+
+    AudioInterfaceMemory unthreaded_audio(samplerate);
+    AudioInterfaceRealtime threaded_audio(samplerate);
+    AudioInterfaceMemory & audio = threaded ? threaded_audio : unthreaded_audio;
+
+    AudioChunkConstPtr click = make_click(samplerate);
+    CHECK(click);
+    audio.samples().set({ { 0, click }, { 1, click } });
+
+    float tempo = random_int(600, 2400) / 10.0f;
+    TempoMapConstPtr map = TempoMap::new_simple(random_int(4, 16), tempo, random_int(2, 7), DENOMS[random_int(0, 1)]);
+    Position pos(map, samplerate, 1.0f);
+
+    MetronomeMap m(audio, map, 1.0f, true, -1, "", lookahead);
+    m.set_sound(0, 1);
+    audio.set_processor(&m);
+
+    // the downbeat to jump to, and the beat after it
+    Position target(pos);
+    target.locate_bar(random_int(1, pos.total_bars() - 1), 0);
+    framepos_t target_frame = static_cast<framepos_t>(target.frame());
+    target.locate_beat(target.beat_total() + 1);
+    framepos_t next_frame = static_cast<framepos_t>(target.frame());
+
+    m.start();
+
+    AudioInterface::TransportState transport;
+    transport.available = true;
+    transport.rolling = true;
+    transport.frame = 0;
+
+    std::vector<sample_t> buffer(nframes);
+    std::vector<framepos_t> clicks;
+    int roll = random_int(1, 20);
+
+    for (int n = 0; n <= roll || transport.frame <= next_frame + nframes; ++n) {
+        if (n == roll) {
+            transport.frame = target_frame;
+        }
+
+        std::fill(buffer.begin(), buffer.end(), 0.0f);
+        audio.process(buffer.data(), nframes, transport);
+
+        if (n >= roll) {
+            for (nframes_t i = 0; i < nframes; ++i) {
+                if (buffer[i] != 0.0f) {
+                    clicks.push_back(transport.frame + i);
+                }
+            }
+        }
+
+        transport.frame += nframes;
+
+        if (threaded) {
+            // give the scheduler time to keep up, as it would have in realtime
+            ::timespec ts = { 0, 50000 };
+            ::nanosleep(&ts, NULL);
+        }
+    }
+
+    // relocating to a frame that's already being played doesn't relocate at all
+    if (static_cast<framepos_t>(roll) * nframes == target_frame) {
+        return;
+    }
+
+    if (clicks.empty() || clicks[0] < target_frame || clicks[0] > target_frame + nframes) {
+        std::cerr << "downbeat at frame " << target_frame << " not played after relocating, period size "
+                  << nframes << (threaded ? ", threaded" : "") << std::endl;
+        ++test_failures;
+        return;
+    }
+
+    if (clicks.size() < 2 || clicks[1] != next_frame) {
+        std::cerr << "beat at frame " << next_frame << " after relocating to " << target_frame
+                  << " not played on time" << std::endl;
+        ++test_failures;
+    }
+}
+
+} // namespace
+
+
+int main()
+{
+    for (int n = 0; n < NMAPS; ++n) {
+        test_relocate(false);
+    }
+    for (int n = 0; n < NMAPS_THREADED; ++n) {
+        test_relocate(true);
+    }
+
+    return test_result();
+}
@@ -0,0 +1,38 @@
+/*
+ * klick - an advanced metronome for jack
+ *
+ * Copyright (C) 2007-2013  Dominic Sacré  <dominic.sacre@gmx.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KLICK_TEST_HH
+#define KLICK_TEST_HH
+
+#include <iostream>
+
+// minimal checks for the tests in this directory, each of which is a single source file.
+// a failed check is reported and counted, and the test keeps going.
+// main() returns test_result()
+static int test_failures = 0;
+
+inline int test_result()
+{
+    if (test_failures) {
+        std::cerr << test_failures << " check(s) failed" << std::endl;
+    }
+    return test_failures ? 1 : 0;
+}
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++test_failures; \
+        } \
+    } while (0)
+
+#endif // KLICK_TEST_HH